@@ -0,0 +1,145 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "freeMap.h"
+
+// allocator microbenchmark: fills an in memory free block bit array with
+// the byte at a time first-fit search tfs used before the free map, then
+// with the free map, and prints the average time per allocation for every
+// tenth of the disk. one block in FREE_EVERY is freed again at random so
+// the disk fragments while it fills
+//
+// usage: allocbench [blocks] [rounds]
+
+#define FREE_EVERY 4
+#define BUCKETS 10
+
+// the original allocator, scanning from block 0 a byte then a bit at a time
+static int legacy_alloc(uint8_t *bitmap, int n_blocks)
+{
+    int i, j;
+    for (i = 0; i < n_blocks / 8; i++)
+    {
+        if (bitmap[i] != 0xFF)
+        {
+            for (j = 0; j < 8; j++)
+            {
+                if (!(bitmap[i] & (1 << j)))
+                {
+                    bitmap[i] |= (1 << j);
+                    return 8 * i + j;
+                }
+            }
+        }
+    }
+    for (j = 0; j < n_blocks % 8; j++)
+    {
+        if (!(bitmap[i] & (1 << j)))
+        {
+            bitmap[i] |= (1 << j);
+            return 8 * i + j;
+        }
+    }
+    return -1;
+}
+
+static void legacy_free(uint8_t *bitmap, int index)
+{
+    bitmap[index / 8] &= ~(1 << index % 8);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// fill the disk once, adding the time spent at each fill level to seconds
+// and the allocations made there to counts. returns -1 on malloc error
+static int fill(int use_map, int n_blocks, unsigned seed, \
+    double *seconds, long *counts)
+{
+    uint8_t *bitmap = (uint8_t *) calloc((n_blocks + 7) / 8, 1);
+    int *allocated = (int *) malloc(n_blocks * sizeof(int));
+    Free_map *map = NULL;
+    if (bitmap != NULL && use_map)
+        map = create_free_map(n_blocks, 256);
+    if (bitmap == NULL || allocated == NULL || (use_map && map == NULL))
+    {
+        free(bitmap);
+        free(allocated);
+        free_free_map(map);
+        return -1;
+    }
+
+    srand(seed);
+    int used = 0;
+    long ops = 0;
+    while (used < n_blocks)
+    {
+        int bucket = (int) ((long) used * BUCKETS / n_blocks);
+        double start = now();
+        int index = use_map ? free_map_alloc(map) : legacy_alloc(bitmap, n_blocks);
+        seconds[bucket] += now() - start;
+        counts[bucket]++;
+        if (index < 0)
+            break;
+        allocated[used++] = index;
+
+        // fragment the disk by giving back a random block now and then
+        if (++ops % FREE_EVERY == 0)
+        {
+            int victim = rand() % used;
+            if (use_map)
+                free_map_free(map, allocated[victim]);
+            else
+                legacy_free(bitmap, allocated[victim]);
+            allocated[victim] = allocated[--used];
+        }
+    }
+
+    free(bitmap);
+    free(allocated);
+    free_free_map(map);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int n_blocks = argc > 1 ? atoi(argv[1]) : 65536;
+    int rounds = argc > 2 ? atoi(argv[2]) : 3;
+    if (n_blocks <= 0 || rounds <= 0)
+    {
+        fprintf(stderr, "usage: %s [blocks] [rounds]\n", argv[0]);
+        return 1;
+    }
+
+    double seconds[2][BUCKETS] = {{0}};
+    long counts[2][BUCKETS] = {{0}};
+    int use_map, r;
+    for (use_map = 0; use_map < 2; use_map++)
+    {
+        for (r = 0; r < rounds; r++)
+        {
+            if (fill(use_map, n_blocks, r + 1, seconds[use_map], counts[use_map]) < 0)
+            {
+                fprintf(stderr, "out of memory\n");
+                return 1;
+            }
+        }
+    }
+
+    printf("%d blocks, %d rounds, ns per allocation\n", n_blocks, rounds);
+    printf("%-8s %12s %12s\n", "fill", "first-fit", "free map");
+    int b;
+    for (b = 0; b < BUCKETS; b++)
+    {
+        printf("%3d%%     %12.1f %12.1f\n", (b + 1) * 100 / BUCKETS, \
+            counts[0][b] ? seconds[0][b] * 1e9 / counts[0][b] : 0.0, \
+            counts[1][b] ? seconds[1][b] * 1e9 / counts[1][b] : 0.0);
+    }
+    return 0;
+}
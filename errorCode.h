@@ -38,7 +38,7 @@ static const int errorCodes[11] =
     EOF_ERR         //index 10
 };
 
-static char* errorMessage[11] =
+static const char *const errorMessage[11] =
 {
     MALLOC_MESS,        //index 0
     INVALID_OP_MESS,    //index 1
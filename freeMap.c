@@ -0,0 +1,370 @@
+#include "freeMap.h"
+
+// set or clear the summary bit of word w after it changed
+static void update_summary(Free_map *map, int w)
+{
+    uint64_t bit = (uint64_t) 1 << (w % WORD_BITS);
+    if (~map->words[w] != 0)
+        map->summary[w / WORD_BITS] |= bit;
+    else
+        map->summary[w / WORD_BITS] &= ~bit;
+}
+
+// remember that the chunk holding word w must be written back
+static void mark_dirty(Free_map *map, int w)
+{
+    int chunk = w / (map->chunk_bytes / 8);
+    if (map->dirty[chunk])
+        return;
+    map->dirty[chunk] = 1;
+    map->dirty_list[map->n_dirty++] = chunk;
+}
+
+// make room in the undo log for n more changes, nothing is logged outside
+// free_map_begin and free_map_end
+// returns 0 if successful or FREE_MAP_NO_UNDO if the log can't grow
+static int reserve_undo(Free_map *map, int n)
+{
+    if (!map->logging || map->n_undo + n <= map->undo_capacity)
+        return 0;
+    int capacity = map->undo_capacity ? map->undo_capacity : 16;
+    while (capacity < map->n_undo + n)
+        capacity *= 2;
+    int64_t *undo = (int64_t *) realloc(map->undo, capacity * sizeof(int64_t));
+    if (undo == NULL)
+        return FREE_MAP_NO_UNDO; // realloc error
+    map->undo = undo;
+    map->undo_capacity = capacity;
+    return 0;
+}
+
+// remember the bit of block index before it is changed, reserve_undo made
+// room for it
+static void log_change(Free_map *map, int index)
+{
+    if (!map->logging)
+        return;
+    int bit = (map->words[index / WORD_BITS] >> (index % WORD_BITS)) & 1;
+    map->undo[map->n_undo++] = (int64_t) index * 2 + bit;
+}
+
+// first free block at or after index, without wrapping around
+// returns -1 if there is none
+static int next_free(Free_map *map, int index)
+{
+    if (index < 0 || index >= map->n_blocks)
+        return -1;
+    int w = index / WORD_BITS;
+    uint64_t free_bits = ~map->words[w] & (~(uint64_t) 0 << (index % WORD_BITS));
+    if (free_bits != 0)
+        return w * WORD_BITS + __builtin_ctzll(free_bits);
+
+    // the summary finds the next word with a free bit
+    w++;
+    int t = w / WORD_BITS;
+    if (t >= map->n_summary)
+        return -1;
+    uint64_t candidates = map->summary[t] & (~(uint64_t) 0 << (w % WORD_BITS));
+    while (candidates == 0)
+    {
+        if (++t >= map->n_summary)
+            return -1;
+        candidates = map->summary[t];
+    }
+    w = t * WORD_BITS + __builtin_ctzll(candidates);
+    return w * WORD_BITS + __builtin_ctzll(~map->words[w]);
+}
+
+// number of adjacent free blocks from free block start, at most max
+static int run_length(Free_map *map, int start, int max)
+{
+    int length = 0;
+    while (length < max && start + length < map->n_blocks)
+    {
+        int index = start + length;
+        uint64_t used = map->words[index / WORD_BITS] >> (index % WORD_BITS);
+        if (used != 0)
+            return length + __builtin_ctzll(used) < max ? \
+                length + __builtin_ctzll(used) : max;
+        length += WORD_BITS - index % WORD_BITS;
+    }
+    return length < max ? length : max;
+}
+
+// make a map of n_blocks free blocks, stored in chunks of chunk_bytes
+Free_map *create_free_map(int n_blocks, int chunk_bytes)
+{
+    if (n_blocks < 0 || chunk_bytes <= 0 || chunk_bytes % 8 != 0)
+        return NULL;
+    Free_map *map = (Free_map *) malloc(sizeof(Free_map));
+    if (map == NULL)
+        return NULL;
+    map->n_blocks = n_blocks;
+    map->n_free = n_blocks;
+    map->n_words = (n_blocks + WORD_BITS - 1) / WORD_BITS;
+    map->n_summary = (map->n_words + WORD_BITS - 1) / WORD_BITS;
+    map->cursor = 0;
+    map->chunk_bytes = chunk_bytes;
+    map->n_chunks = (map->n_words + chunk_bytes / 8 - 1) / (chunk_bytes / 8);
+    map->n_dirty = 0;
+    map->undo = NULL;
+    map->n_undo = 0;
+    map->undo_capacity = 0;
+    map->logging = 0;
+    map->words = (uint64_t *) calloc(map->n_words + 1, sizeof(uint64_t));
+    map->summary = (uint64_t *) calloc(map->n_summary + 1, sizeof(uint64_t));
+    map->dirty = (uint8_t *) calloc(map->n_chunks + 1, 1);
+    map->dirty_list = (int *) malloc((map->n_chunks + 1) * sizeof(int));
+    if (map->words == NULL || map->summary == NULL || map->dirty == NULL || \
+        map->dirty_list == NULL)
+    {
+        free_free_map(map);
+        return NULL;
+    }
+
+    // blocks past the end of the disk are never free
+    if (n_blocks % WORD_BITS != 0)
+        map->words[map->n_words - 1] |= ~(uint64_t) 0 << (n_blocks % WORD_BITS);
+
+    int w;
+    for (w = 0; w < map->n_words; w++)
+        update_summary(map, w);
+    return map;
+}
+
+void free_free_map(Free_map *map)
+{
+    if (map == NULL)
+        return;
+    free(map->words);
+    free(map->summary);
+    free(map->dirty);
+    free(map->dirty_list);
+    free(map->undo);
+    free(map);
+}
+
+// replace a chunk of the map with chunk_bytes bytes of little endian bit
+// array, byte i of the chunk is bits 8 * i to 8 * i + 7 of the chunk
+void free_map_load_chunk(Free_map *map, int chunk, uint8_t *bytes)
+{
+    int words_per_chunk = map->chunk_bytes / 8;
+    int first = chunk * words_per_chunk;
+    int w, i;
+    for (w = first; w < first + words_per_chunk && w < map->n_words; w++)
+    {
+        uint64_t word = 0;
+        for (i = 0; i < 8; i++)
+            word |= (uint64_t) bytes[(w - first) * 8 + i] << (8 * i);
+
+        // blocks past the end of the disk are never free
+        if (w == map->n_words - 1 && map->n_blocks % WORD_BITS != 0)
+            word |= ~(uint64_t) 0 << (map->n_blocks % WORD_BITS);
+        map->n_free += __builtin_popcountll(map->words[w]) - __builtin_popcountll(word);
+        map->words[w] = word;
+        update_summary(map, w);
+    }
+}
+
+// pack a chunk of the map into chunk_bytes bytes of little endian bit array
+void free_map_store_chunk(Free_map *map, int chunk, uint8_t *bytes)
+{
+    int words_per_chunk = map->chunk_bytes / 8;
+    int first = chunk * words_per_chunk;
+    int w, i;
+    memset(bytes, 0, map->chunk_bytes);
+    for (w = first; w < first + words_per_chunk && w < map->n_words; w++)
+        for (i = 0; i < 8; i++)
+            bytes[(w - first) * 8 + i] = (uint8_t) (map->words[w] >> (8 * i));
+}
+
+// forget which chunks changed, after they were written back or reloaded
+void free_map_clean(Free_map *map)
+{
+    int i;
+    for (i = 0; i < map->n_dirty; i++)
+        map->dirty[map->dirty_list[i]] = 0;
+    map->n_dirty = 0;
+}
+
+// start a new undo log, changes before this can't be rolled back
+void free_map_begin(Free_map *map)
+{
+    map->n_undo = 0;
+    map->logging = 1;
+}
+
+// keep the changes since free_map_begin and stop logging them
+void free_map_end(Free_map *map)
+{
+    map->n_undo = 0;
+    map->logging = 0;
+}
+
+// undo every change since free_map_begin, newest first, and stop logging
+void free_map_rollback(Free_map *map)
+{
+    map->logging = 0;
+    while (map->n_undo > 0)
+    {
+        int64_t change = map->undo[--map->n_undo];
+        int index = (int) (change / 2);
+        int w = index / WORD_BITS;
+        uint64_t bit = (uint64_t) 1 << (index % WORD_BITS);
+        if ((map->words[w] & bit) != 0 && change % 2 == 0)
+            map->n_free += 1;
+        else if ((map->words[w] & bit) == 0 && change % 2 == 1)
+            map->n_free -= 1;
+        if (change % 2)
+            map->words[w] |= bit;
+        else
+            map->words[w] &= ~bit;
+        update_summary(map, w);
+        mark_dirty(map, w);
+    }
+}
+
+// find a free block starting at the cursor, mark it not free and return it
+// returns FREE_MAP_FULL if there are no free blocks
+// returns FREE_MAP_NO_UNDO if the undo log can't grow
+int free_map_alloc(Free_map *map)
+{
+    if (map->n_words == 0)
+        return FREE_MAP_FULL;
+
+    // look at the summary from the cursor to the end, then wrap around to
+    // the summary words before the cursor
+    int t = map->cursor / WORD_BITS;
+    uint64_t candidates = map->summary[t] & (~(uint64_t) 0 << (map->cursor % WORD_BITS));
+    int checked = 0;
+    while (candidates == 0)
+    {
+        if (++checked > map->n_summary)
+            return FREE_MAP_FULL; // every word is full
+        t = (t + 1) % map->n_summary;
+        candidates = map->summary[t];
+    }
+
+    // lowest word with a free bit, then lowest free bit in that word
+    int w = t * WORD_BITS + __builtin_ctzll(candidates);
+    int bit = __builtin_ctzll(~map->words[w]);
+    if (reserve_undo(map, 1) < 0)
+        return FREE_MAP_NO_UNDO; // realloc error
+    log_change(map, w * WORD_BITS + bit);
+    map->words[w] |= (uint64_t) 1 << bit;
+    map->n_free -= 1;
+    update_summary(map, w);
+    mark_dirty(map, w);
+    map->cursor = w;
+    return w * WORD_BITS + bit;
+}
+
+// find up to want adjacent free blocks, mark them not free and return the
+// first. a run of want blocks at hint is taken first, so a file can grow
+// in place. otherwise the search starts at the cursor and takes the first
+// run of want blocks, or the longest of the run at hint and the first
+// ALLOC_RUN_TRIES runs. the number of blocks taken is put in length
+// returns FREE_MAP_FULL if there are no free blocks
+// returns FREE_MAP_NO_UNDO if the undo log can't grow
+int free_map_alloc_run(Free_map *map, int hint, int want, int *length)
+{
+    int start = -1;
+    int best = 0;
+    if (want <= 0)
+        return FREE_MAP_FULL;
+    if (hint >= 0 && hint < map->n_blocks && \
+        ((map->words[hint / WORD_BITS] >> (hint % WORD_BITS)) & 1) == 0)
+    {
+        start = hint;
+        best = run_length(map, hint, want);
+    }
+    if (best < want)
+    {
+        // look from the cursor to the end, then from the start of the map
+        // back to the cursor
+        int origin = map->cursor * WORD_BITS;
+        int index = origin;
+        int wrapped = 0;
+        int tries;
+        for (tries = 0; tries < ALLOC_RUN_TRIES && best < want; tries++)
+        {
+            int found = next_free(map, index);
+            if (found < 0 && !wrapped)
+            {
+                wrapped = 1;
+                found = next_free(map, 0);
+            }
+            if (found < 0 || (wrapped && found >= origin))
+                break; // looked at the whole map
+            int run = run_length(map, found, want);
+            if (run > best)
+            {
+                start = found;
+                best = run;
+            }
+            index = found + run;
+            if (index >= map->n_blocks && !wrapped)
+            {
+                wrapped = 1;
+                index = 0;
+            }
+        }
+    }
+    if (start < 0)
+        return FREE_MAP_FULL; // every word is full
+    if (reserve_undo(map, best) < 0)
+        return FREE_MAP_NO_UNDO; // realloc error
+
+    int index;
+    for (index = start; index < start + best; index++)
+    {
+        int w = index / WORD_BITS;
+        log_change(map, index);
+        map->words[w] |= (uint64_t) 1 << (index % WORD_BITS);
+        if (index == start + best - 1 || (index + 1) % WORD_BITS == 0)
+        {
+            update_summary(map, w);
+            mark_dirty(map, w);
+        }
+    }
+    map->n_free -= best;
+    map->cursor = (start + best - 1) / WORD_BITS;
+    *length = best;
+    return start;
+}
+
+// mark block index free
+// returns 0 if successful or FREE_MAP_NO_UNDO if the undo log can't grow
+int free_map_free(Free_map *map, int index)
+{
+    if (index < 0 || index >= map->n_blocks)
+        return 0;
+    if (reserve_undo(map, 1) < 0)
+        return FREE_MAP_NO_UNDO; // realloc error
+    int w = index / WORD_BITS;
+    log_change(map, index);
+    if ((map->words[w] >> (index % WORD_BITS)) & 1)
+        map->n_free += 1;
+    map->words[w] &= ~((uint64_t) 1 << (index % WORD_BITS));
+    update_summary(map, w);
+    mark_dirty(map, w);
+    return 0;
+}
+
+// mark block index not free
+// returns 0 if successful or FREE_MAP_NO_UNDO if the undo log can't grow
+int free_map_unfree(Free_map *map, int index)
+{
+    if (index < 0 || index >= map->n_blocks)
+        return 0;
+    if (reserve_undo(map, 1) < 0)
+        return FREE_MAP_NO_UNDO; // realloc error
+    int w = index / WORD_BITS;
+    log_change(map, index);
+    if (((map->words[w] >> (index % WORD_BITS)) & 1) == 0)
+        map->n_free -= 1;
+    map->words[w] |= (uint64_t) 1 << (index % WORD_BITS);
+    update_summary(map, w);
+    mark_dirty(map, w);
+    return 0;
+}
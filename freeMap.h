@@ -0,0 +1,73 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#define WORD_BITS 64
+
+// free_map_alloc_run gives up looking for a run of the length asked for
+// after this many shorter ones and takes the longest
+#define ALLOC_RUN_TRIES 64
+
+// returned by free_map_alloc and free_map_alloc_run if there are no free
+// blocks, and by every call that changes the map if the undo log can't grow
+#define FREE_MAP_FULL -1
+#define FREE_MAP_NO_UNDO -2
+
+// in memory copy of the free block bit array, searched a 64-bit word at a
+// time. bit i of words[w] is block 64 * w + i, 0 bit = free, 1 bit = not free
+// like the bit array on disk. bit s of summary[t] is set if word 64 * t + s
+// has a free bit, so full stretches of the disk are skipped 4096 blocks at
+// a time
+//
+// the bit array is stored on disk in chunks of chunk_bytes bytes, one per
+// block. chunks changed since the last free_map_clean are listed in
+// dirty_list so only those have to be written back
+//
+// every change from free_map_begin to free_map_end is also kept in an undo
+// log, so an operation that fails half way can put the map back with
+// free_map_rollback. a change the log has no room for is refused with
+// FREE_MAP_NO_UNDO before the map is touched
+typedef struct Free_map
+{
+    uint64_t *words;
+    uint64_t *summary;
+    int n_blocks;
+    int n_free;         // free blocks in the map
+    int n_words;
+    int n_summary;
+    int cursor;         // next-fit hint, word the next search starts at
+    int chunk_bytes;    // multiple of 8
+    int n_chunks;
+    uint8_t *dirty;     // 1 if the chunk is in dirty_list
+    int *dirty_list;
+    int n_dirty;
+    int64_t *undo;      // block number * 2 + previous bit, oldest first
+    int n_undo;
+    int undo_capacity;
+    int logging;        // 1 from free_map_begin to free_map_end or rollback
+} Free_map;
+
+Free_map *create_free_map(int n_blocks, int chunk_bytes);
+
+void free_free_map(Free_map *map);
+
+void free_map_load_chunk(Free_map *map, int chunk, uint8_t *bytes);
+
+void free_map_store_chunk(Free_map *map, int chunk, uint8_t *bytes);
+
+void free_map_clean(Free_map *map);
+
+void free_map_begin(Free_map *map);
+
+void free_map_end(Free_map *map);
+
+void free_map_rollback(Free_map *map);
+
+int free_map_alloc(Free_map *map);
+
+int free_map_alloc_run(Free_map *map, int hint, int want, int *length);
+
+int free_map_free(Free_map *map, int index);
+
+int free_map_unfree(Free_map *map, int index);
@@ -0,0 +1,145 @@
+#include "hashIndex.h"
+
+static uint32_t hash_slot(Hash_index *index, uint64_t key)
+{
+    // fibonacci hashing, the high bits are the best mixed
+    key *= 0x9E3779B97F4A7C15ULL;
+    return (uint32_t) (key >> 32) & (index->capacity - 1);
+}
+
+static int hash_grow(Hash_index *index)
+{
+    Hash_slot *old_slots = index->slots;
+    int old_capacity = index->capacity;
+
+    Hash_slot *slots = (Hash_slot *) calloc(old_capacity * 2, sizeof(Hash_slot));
+    if (slots == NULL)
+        return -1;
+    index->slots = slots;
+    index->capacity = old_capacity * 2;
+    index->size = 0;
+
+    // reinsert every entry
+    int i;
+    for (i = 0; i < old_capacity; i++)
+        if (old_slots[i].value != NULL)
+            hash_insert(index, old_slots[i].key, old_slots[i].value);
+    free(old_slots);
+    return 0;
+}
+
+Hash_index *create_hash_index()
+{
+    Hash_index *index = (Hash_index *) malloc(sizeof(Hash_index));
+    if (index == NULL)
+        return NULL;
+    index->slots = (Hash_slot *) calloc(HASH_INITIAL_CAPACITY, sizeof(Hash_slot));
+    if (index->slots == NULL)
+    {
+        free(index);
+        return NULL;
+    }
+    index->capacity = HASH_INITIAL_CAPACITY;
+    index->size = 0;
+    return index;
+}
+
+// frees the index only, the values belong to the caller
+void free_hash_index(Hash_index *index)
+{
+    free(index->slots);
+    free(index);
+}
+
+// pack a name of up to 8 characters into a key, padding with null
+uint64_t name_key(char *name)
+{
+    char padded[HASH_NAME_LEN] = {0};
+    memcpy(padded, name, strnlen(name, HASH_NAME_LEN));
+
+    uint64_t key;
+    memcpy(&key, padded, HASH_NAME_LEN);
+    return key;
+}
+
+// returns the value stored under key, or NULL
+void *hash_find(Hash_index *index, uint64_t key)
+{
+    int probes;
+    return hash_find_probes(index, key, &probes);
+}
+
+// hash_find, also putting the number of slots looked at in probes
+void *hash_find_probes(Hash_index *index, uint64_t key, int *probes)
+{
+    uint32_t i = hash_slot(index, key);
+    *probes = 1;
+    while (index->slots[i].value != NULL)
+    {
+        if (index->slots[i].key == key)
+            return index->slots[i].value;
+        i = (i + 1) & (index->capacity - 1);
+        *probes += 1;
+    }
+    return NULL;
+}
+
+// store value under key, replacing any previous value
+// returns 0 if successful, -1 if the index could not grow
+int hash_insert(Hash_index *index, uint64_t key, void *value)
+{
+    // keep the load factor at or below one half
+    if (2 * (index->size + 1) > index->capacity)
+    {
+        if (hash_grow(index) < 0)
+            return -1;
+    }
+
+    uint32_t i = hash_slot(index, key);
+    while (index->slots[i].value != NULL)
+    {
+        if (index->slots[i].key == key)
+        {
+            index->slots[i].value = value;
+            return 0;
+        }
+        i = (i + 1) & (index->capacity - 1);
+    }
+    index->slots[i].key = key;
+    index->slots[i].value = value;
+    index->size += 1;
+    return 0;
+}
+
+void hash_remove(Hash_index *index, uint64_t key)
+{
+    uint32_t mask = index->capacity - 1;
+    uint32_t i = hash_slot(index, key);
+    while (index->slots[i].value != NULL && index->slots[i].key != key)
+        i = (i + 1) & mask;
+    if (index->slots[i].value == NULL)
+        return; // not in the index
+
+    // shift later entries of the probe run back so lookups never stop early
+    uint32_t j = i;
+    while (1)
+    {
+        index->slots[i].value = NULL;
+        while (1)
+        {
+            j = (j + 1) & mask;
+            if (index->slots[j].value == NULL)
+            {
+                index->size -= 1;
+                return;
+            }
+            uint32_t home = hash_slot(index, index->slots[j].key);
+            // move the entry at j unless its home lies cyclically in (i, j]
+            if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+                continue;
+            break;
+        }
+        index->slots[i] = index->slots[j];
+        i = j;
+    }
+}
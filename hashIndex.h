@@ -0,0 +1,37 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#define HASH_INITIAL_CAPACITY 16 // must be a power of two
+#define HASH_NAME_LEN 8
+
+// one slot of the index, value is NULL if the slot is empty
+typedef struct Hash_slot
+{
+    uint64_t key;
+    void *value;
+} Hash_slot;
+
+// open addressing hash index with linear probing, keyed by 8 byte names
+// packed into a single 64-bit word
+typedef struct Hash_index
+{
+    Hash_slot *slots;
+    int capacity;
+    int size;
+} Hash_index;
+
+Hash_index *create_hash_index();
+
+void free_hash_index(Hash_index *index);
+
+uint64_t name_key(char *name);
+
+void *hash_find(Hash_index *index, uint64_t key);
+
+void *hash_find_probes(Hash_index *index, uint64_t key, int *probes);
+
+int hash_insert(Hash_index *index, uint64_t key, void *value);
+
+void hash_remove(Hash_index *index, uint64_t key);
@@ -0,0 +1,584 @@
+#include "libDisk.h"
+#include "hashIndex.h"
+#include "journal.h"
+
+#define PENDING_INITIAL_CAPACITY 16
+
+// one transaction found in the journal region by replay_journal
+typedef struct Journal_record
+{
+    uint32_t seq;
+    uint32_t replay;
+    int pos;
+    int n_desc;
+    int n_images;
+    int n_revokes;
+} Journal_record;
+
+static uint32_t get_u32(uint8_t *buf)
+{
+    uint32_t value;
+    memcpy(&value, buf, sizeof(uint32_t));
+    return value;
+}
+
+static void put_u32(uint8_t *buf, uint32_t value)
+{
+    memcpy(buf, &value, sizeof(uint32_t));
+}
+
+static uint64_t get_u64(uint8_t *buf)
+{
+    uint64_t value;
+    memcpy(&value, buf, sizeof(uint64_t));
+    return value;
+}
+
+static void put_u64(uint8_t *buf, uint64_t value)
+{
+    memcpy(buf, &value, sizeof(uint64_t));
+}
+
+// FNV-1a, continued from sum
+static uint64_t checksum(uint64_t sum, uint8_t *buf, int size)
+{
+    int i;
+    for (i = 0; i < size; i++)
+    {
+        sum ^= buf[i];
+        sum *= 0x100000001B3ULL;
+    }
+    return sum;
+}
+
+#define CHECKSUM_START 0xCBF29CE484222325ULL
+
+// block number of ring position pos
+static int ring_block(Journal *journal, int pos)
+{
+    return journal->start + pos % journal->n_blocks;
+}
+
+// number of descriptor blocks for entries addresses
+static int desc_blocks(Journal *journal, int entries)
+{
+    int per_block = JOURNAL_DESC_ADDRS(journal->block_size);
+    if (entries == 0)
+        return 1;
+    return (entries + per_block - 1) / per_block;
+}
+
+static int compare_int(const void *a, const void *b)
+{
+    int x = *(const int *) a;
+    int y = *(const int *) b;
+    return (x > y) - (x < y);
+}
+
+// make an empty journal for the region of n_blocks blocks at start,
+// replay_journal sets it up from what is on disk
+Journal *create_journal(int disk, int start, int n_blocks)
+{
+    Journal *journal = (Journal *) malloc(sizeof(Journal));
+    if (journal == NULL)
+        return NULL;
+    journal->disk = disk;
+    journal->block_size = get_block_size(disk);
+    journal->start = start;
+    journal->n_blocks = n_blocks;
+    journal->seq = 1;
+    journal->durable = 0;
+    journal->tail = 0;
+    journal->protect = 0;
+    journal->last_pos = 0;
+    journal->n_pending = 0;
+    journal->pending_capacity = PENDING_INITIAL_CAPACITY;
+    journal->n_revokes = 0;
+    journal->revoke_capacity = PENDING_INITIAL_CAPACITY;
+    journal->n_last = 0;
+    journal->pending = (Journal_block **) \
+        malloc(journal->pending_capacity * sizeof(Journal_block *));
+    journal->pending_index = create_hash_index();
+    journal->revokes = (int *) malloc(journal->revoke_capacity * sizeof(int));
+    journal->last_addrs = NULL;
+    if (journal->pending == NULL || journal->pending_index == NULL || \
+        journal->revokes == NULL)
+    {
+        free_journal(journal);
+        return NULL;
+    }
+    return journal;
+}
+
+// drop the running transaction
+static void clear_pending(Journal *journal)
+{
+    int i;
+    for (i = 0; i < journal->n_pending; i++)
+    {
+        hash_remove(journal->pending_index, journal->pending[i]->addr);
+        free(journal->pending[i]->data);
+        free(journal->pending[i]);
+    }
+    journal->n_pending = 0;
+    journal->n_revokes = 0;
+}
+
+// frees the journal and any blocks that were never committed
+void free_journal(Journal *journal)
+{
+    if (journal == NULL)
+        return;
+    if (journal->pending != NULL && journal->pending_index != NULL)
+        clear_pending(journal);
+    if (journal->pending_index != NULL)
+        free_hash_index(journal->pending_index);
+    free(journal->pending);
+    free(journal->revokes);
+    free(journal->last_addrs);
+    free(journal);
+}
+
+// read the descriptor at ring position pos and check its commit block
+// returns 1 and fills record if the transaction is complete, 0 if not,
+// or a negative error code
+static int read_record(Journal *journal, int pos, Journal_record *record, \
+    uint8_t *block)
+{
+    int err = readBlock(journal->disk, ring_block(journal, pos), block);
+    if (err < 0)
+        return err; // read error
+    if (get_u64(&block[JD_MAGIC_INDEX]) != JOURNAL_MAGIC)
+        return 0; // not a descriptor
+
+    record->seq = get_u32(&block[JD_SEQ_INDEX]);
+    record->replay = get_u32(&block[JD_REPLAY_INDEX]);
+    record->pos = pos;
+    record->n_images = get_u32(&block[JD_IMAGES_INDEX]);
+    record->n_revokes = get_u32(&block[JD_REVOKES_INDEX]);
+    if (record->n_images < 0 || record->n_revokes < 0 || \
+        record->n_images > journal->n_blocks || \
+        record->n_revokes > journal->n_blocks * JOURNAL_DESC_ADDRS(journal->block_size) || \
+        record->replay > record->seq)
+        return 0; // not a sane descriptor
+    record->n_desc = desc_blocks(journal, record->n_images + record->n_revokes);
+    if (record->n_desc + record->n_images + 1 > journal->n_blocks)
+        return 0; // does not fit in the ring
+
+    // checksum the descriptor blocks and the images
+    uint64_t sum = CHECKSUM_START;
+    int i;
+    for (i = 0; i < record->n_desc + record->n_images; i++)
+    {
+        if (i > 0)
+        {
+            err = readBlock(journal->disk, ring_block(journal, pos + i), block);
+            if (err < 0)
+                return err; // read error
+        }
+        sum = checksum(sum, block, journal->block_size);
+    }
+
+    // the commit block must match
+    err = readBlock(journal->disk, ring_block(journal, pos + i), block);
+    if (err < 0)
+        return err; // read error
+    if (get_u64(&block[JC_MAGIC_INDEX]) != JOURNAL_COMMIT_MAGIC || \
+        get_u32(&block[JC_SEQ_INDEX]) != record->seq || \
+        get_u64(&block[JC_SUM_INDEX]) != sum)
+        return 0; // torn or stale transaction
+    return 1;
+}
+
+// address entry of a transaction, images first then revokes
+static int read_entry(Journal *journal, Journal_record *record, int entry, \
+    uint8_t *block)
+{
+    int per_block = JOURNAL_DESC_ADDRS(journal->block_size);
+    int err = readBlock(journal->disk, \
+        ring_block(journal, record->pos + entry / per_block), block);
+    if (err < 0)
+        return err; // read error
+    return get_u32(&block[JD_ADDR_INDEX + (entry % per_block) * 4]);
+}
+
+// find the last complete transaction in the journal region and write the
+// images of every transaction it may not have been checkpointed past to
+// their home blocks, then get ready to append after it
+// returns 0 if successful or a negative error code
+int replay_journal(Journal *journal)
+{
+    int n = journal->n_blocks;
+    Journal_record *records = (Journal_record *) malloc(n * sizeof(Journal_record));
+    uint8_t *block = (uint8_t *) malloc(journal->block_size);
+    Hash_index *revoked = create_hash_index();
+    if (records == NULL || block == NULL || revoked == NULL)
+    {
+        free(records);
+        free(block);
+        if (revoked != NULL)
+            free_hash_index(revoked);
+        return MALLOC_ERR; // malloc error
+    }
+
+    // scan the ring for complete transactions, skipping over each one
+    int n_records = 0;
+    int newest = -1;
+    int pos = 0;
+    int err = 0;
+    while (pos < n)
+    {
+        err = read_record(journal, pos, &records[n_records], block);
+        if (err < 0)
+            break; // read error
+        if (err == 0)
+        {
+            pos++;
+            continue;
+        }
+        Journal_record *record = &records[n_records];
+        if (newest < 0 || record->seq > records[newest].seq)
+            newest = n_records;
+        pos += record->n_desc + record->n_images + 1;
+        n_records++;
+    }
+    if (err < 0 || newest < 0)
+    {
+        free(records);
+        free(block);
+        free_hash_index(revoked);
+        return err < 0 ? err : 0; // read error, or an empty journal
+    }
+    err = 0;
+
+    // the transactions to replay, oldest first
+    Journal_record *last = &records[newest];
+    int n_replay = last->seq - last->replay + 1;
+    Journal_record **replay = (Journal_record **) \
+        malloc(n_replay * sizeof(Journal_record *));
+    if (replay == NULL)
+    {
+        free(records);
+        free(block);
+        free_hash_index(revoked);
+        return MALLOC_ERR; // malloc error
+    }
+    int i, j;
+    for (i = 0; i < n_replay; i++)
+    {
+        replay[i] = NULL;
+        for (j = 0; j < n_records; j++)
+            if (records[j].seq == last->replay + i)
+                replay[i] = &records[j];
+        if (replay[i] == NULL)
+            err = INVALID_DISK; // a transaction is missing
+    }
+
+    // a block revoked by a transaction is not replayed from older ones,
+    // the value is the newest transaction that revoked it
+    for (i = 0; err == 0 && i < n_replay; i++)
+    {
+        Journal_record *record = replay[i];
+        for (j = 0; j < record->n_revokes; j++)
+        {
+            int addr = read_entry(journal, record, record->n_images + j, block);
+            if (addr < 0)
+            {
+                err = addr; // read error
+                break;
+            }
+            if (hash_insert(revoked, addr, record) < 0)
+            {
+                err = MALLOC_ERR; // malloc error
+                break;
+            }
+        }
+    }
+
+    // write the images home
+    for (i = 0; err == 0 && i < n_replay; i++)
+    {
+        Journal_record *record = replay[i];
+        for (j = 0; j < record->n_images; j++)
+        {
+            int addr = read_entry(journal, record, j, block);
+            if (addr < 0)
+            {
+                err = addr; // read error
+                break;
+            }
+            Journal_record *revoke = (Journal_record *) hash_find(revoked, addr);
+            if (revoke != NULL && revoke->seq > record->seq)
+                continue;
+            err = readBlock(journal->disk, \
+                ring_block(journal, record->pos + record->n_desc + j), block);
+            if (err == 0)
+                err = writeBlock(journal->disk, addr, block);
+            if (err < 0)
+                break; // read or write error
+        }
+    }
+    if (err == 0)
+        err = syncDisk(journal->disk);
+
+    // the next commit goes after the newest one, which is now checkpointed
+    // but may be replayed again until that commit is on disk
+    if (err == 0)
+    {
+        journal->seq = last->seq + 1;
+        journal->durable = last->seq;
+        journal->tail = (last->pos + last->n_desc + last->n_images + 1) % n;
+        journal->protect = replay[0]->pos;
+        journal->last_pos = last->pos;
+    }
+
+    free(replay);
+    free(records);
+    free(block);
+    free_hash_index(revoked);
+    return err;
+}
+
+// add the new contents of metadata block addr to the running transaction
+// returns 0 if successful or MALLOC_ERR
+int journal_write(Journal *journal, int addr, void *block)
+{
+    Journal_block *pending = (Journal_block *) \
+        hash_find(journal->pending_index, addr);
+    if (pending != NULL)
+    {
+        memcpy(pending->data, block, journal->block_size);
+        return 0;
+    }
+
+    // make room in the pending array
+    if (journal->n_pending == journal->pending_capacity)
+    {
+        Journal_block **grown = (Journal_block **) realloc(journal->pending, \
+            2 * journal->pending_capacity * sizeof(Journal_block *));
+        if (grown == NULL)
+            return MALLOC_ERR; // realloc error
+        journal->pending = grown;
+        journal->pending_capacity *= 2;
+    }
+
+    pending = (Journal_block *) malloc(sizeof(Journal_block));
+    if (pending == NULL)
+        return MALLOC_ERR; // malloc error
+    pending->data = (uint8_t *) malloc(journal->block_size);
+    if (pending->data == NULL || \
+        hash_insert(journal->pending_index, addr, pending) < 0)
+    {
+        free(pending->data);
+        free(pending);
+        return MALLOC_ERR; // malloc error
+    }
+    memcpy(pending->data, block, journal->block_size);
+    pending->addr = addr;
+    pending->slot = journal->n_pending;
+    journal->pending[journal->n_pending] = pending;
+    journal->n_pending += 1;
+    return 0;
+}
+
+// copy the uncommitted contents of block addr into block
+// returns 1 if the running transaction has the block, 0 if it does not
+int journal_read(Journal *journal, int addr, void *block)
+{
+    Journal_block *pending = (Journal_block *) \
+        hash_find(journal->pending_index, addr);
+    if (pending == NULL)
+        return 0;
+    memcpy(block, pending->data, journal->block_size);
+    return 1;
+}
+
+// block addr was freed, drop it from the running transaction and revoke it
+// if the last commit logged it
+// returns 0 if successful or MALLOC_ERR
+int journal_forget(Journal *journal, int addr)
+{
+    Journal_block *pending = (Journal_block *) \
+        hash_find(journal->pending_index, addr);
+    if (pending != NULL)
+    {
+        hash_remove(journal->pending_index, addr);
+        Journal_block *moved = journal->pending[journal->n_pending - 1];
+        journal->pending[pending->slot] = moved;
+        moved->slot = pending->slot;
+        journal->n_pending -= 1;
+        free(pending->data);
+        free(pending);
+    }
+
+    if (journal->n_last == 0 || bsearch(&addr, journal->last_addrs, \
+        journal->n_last, sizeof(int), compare_int) == NULL)
+        return 0; // cannot be replayed
+
+    if (journal->n_revokes == journal->revoke_capacity)
+    {
+        int *grown = (int *) realloc(journal->revokes, \
+            2 * journal->revoke_capacity * sizeof(int));
+        if (grown == NULL)
+            return MALLOC_ERR; // realloc error
+        journal->revokes = grown;
+        journal->revoke_capacity *= 2;
+    }
+    journal->revokes[journal->n_revokes] = addr;
+    journal->n_revokes += 1;
+    return 0;
+}
+
+// number of ring blocks the running transaction needs
+static int pending_blocks(Journal *journal)
+{
+    return desc_blocks(journal, journal->n_pending + journal->n_revokes) + \
+        journal->n_pending + 1;
+}
+
+// returns 1 if the running transaction should be committed before it
+// outgrows the journal, 0 if not
+int journal_full(Journal *journal)
+{
+    return pending_blocks(journal) > journal->n_blocks / 4;
+}
+
+// write the running transaction at the tail of the ring and sync the disk,
+// then write its blocks home through the block cache
+static int write_transaction(Journal *journal)
+{
+    int bs = journal->block_size;
+    int per_block = JOURNAL_DESC_ADDRS(bs);
+    int entries = journal->n_pending + journal->n_revokes;
+    int n_desc = desc_blocks(journal, entries);
+    int pos = journal->tail;
+    uint32_t replay = journal->durable + 1;
+
+    uint8_t *block = (uint8_t *) malloc(bs);
+    int *addrs = (int *) malloc((journal->n_pending + 1) * sizeof(int));
+    if (block == NULL || addrs == NULL)
+    {
+        free(block);
+        free(addrs);
+        return MALLOC_ERR; // malloc error
+    }
+
+    // descriptor blocks, every one carries the header
+    uint64_t sum = CHECKSUM_START;
+    int err = 0;
+    int i, j;
+    for (i = 0; err == 0 && i < n_desc; i++)
+    {
+        memset(block, 0, bs);
+        put_u64(&block[JD_MAGIC_INDEX], JOURNAL_MAGIC);
+        put_u32(&block[JD_SEQ_INDEX], journal->seq);
+        put_u32(&block[JD_REPLAY_INDEX], replay);
+        put_u32(&block[JD_IMAGES_INDEX], journal->n_pending);
+        put_u32(&block[JD_REVOKES_INDEX], journal->n_revokes);
+        for (j = 0; j < per_block && i * per_block + j < entries; j++)
+        {
+            int entry = i * per_block + j;
+            int addr = entry < journal->n_pending ? journal->pending[entry]->addr : \
+                journal->revokes[entry - journal->n_pending];
+            put_u32(&block[JD_ADDR_INDEX + j * 4], addr);
+        }
+        sum = checksum(sum, block, bs);
+        err = writeBlock(journal->disk, ring_block(journal, pos + i), block);
+    }
+
+    // images
+    for (i = 0; err == 0 && i < journal->n_pending; i++)
+    {
+        sum = checksum(sum, journal->pending[i]->data, bs);
+        err = writeBlock(journal->disk, ring_block(journal, pos + n_desc + i), \
+            journal->pending[i]->data);
+    }
+
+    // commit block, then one sync for the whole transaction
+    if (err == 0)
+    {
+        memset(block, 0, bs);
+        put_u64(&block[JC_MAGIC_INDEX], JOURNAL_COMMIT_MAGIC);
+        put_u32(&block[JC_SEQ_INDEX], journal->seq);
+        put_u64(&block[JC_SUM_INDEX], sum);
+        err = writeBlock(journal->disk, \
+            ring_block(journal, pos + n_desc + journal->n_pending), block);
+    }
+    if (err == 0)
+        err = syncDisk(journal->disk);
+    free(block);
+    if (err < 0)
+    {
+        free(addrs);
+        return err; // write error, the transaction stays pending
+    }
+
+    // the last commit was checkpointed before this sync
+    journal->durable = journal->seq - 1;
+    journal->protect = replay == journal->seq ? pos : journal->last_pos;
+    journal->last_pos = pos;
+    journal->tail = (pos + n_desc + journal->n_pending + 1) % journal->n_blocks;
+    journal->seq += 1;
+
+    // checkpoint, the blocks reach the disk by the next sync at the latest
+    for (i = 0; i < journal->n_pending; i++)
+    {
+        addrs[i] = journal->pending[i]->addr;
+        int write_err = writeBlock(journal->disk, addrs[i], journal->pending[i]->data);
+        if (write_err < 0)
+            err = write_err; // a replay still has the block
+    }
+    qsort(addrs, journal->n_pending, sizeof(int), compare_int);
+    free(journal->last_addrs);
+    journal->last_addrs = addrs;
+    journal->n_last = journal->n_pending;
+    clear_pending(journal);
+    return err;
+}
+
+// commit the running transaction, every metadata write since the last
+// commit becomes durable with a single sync of the disk
+// returns 0 if successful or a negative error code
+int journal_commit(Journal *journal)
+{
+    if (journal->n_pending == 0 && journal->n_revokes == 0)
+        return syncDisk(journal->disk); // nothing logged, still flush data
+
+    // a commit may only overwrite transactions that will not be replayed,
+    // and always leaves room for an empty one
+    int n = journal->n_blocks;
+    int used = (journal->tail - journal->protect + n) % n;
+    if (pending_blocks(journal) + 2 <= n - used - 1)
+        return write_transaction(journal);
+
+    // sync the last checkpoint and commit an empty transaction after it,
+    // then nothing before the empty one is replayed again
+    int err = syncDisk(journal->disk);
+    if (err < 0)
+        return err; // write error
+    journal->durable = journal->seq - 1;
+    int n_pending = journal->n_pending;
+    int n_revokes = journal->n_revokes;
+    journal->n_pending = 0;
+    journal->n_revokes = 0;
+    err = write_transaction(journal);
+    journal->n_pending = n_pending;
+    journal->n_revokes = n_revokes;
+    if (err < 0)
+        return err; // write error
+    journal->durable = journal->seq - 1;
+    if (pending_blocks(journal) + 2 <= n - 3)
+        return write_transaction(journal);
+
+    // too big for the journal at all, write the blocks home directly
+    int i;
+    for (i = 0; i < journal->n_pending; i++)
+    {
+        err = writeBlock(journal->disk, journal->pending[i]->addr, \
+            journal->pending[i]->data);
+        if (err < 0)
+            return err; // write error
+    }
+    clear_pending(journal);
+    return syncDisk(journal->disk);
+}
@@ -0,0 +1,82 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+// block layout of a transaction in the journal region, which is used as a
+// ring. a transaction is a descriptor block, the new contents of every
+// metadata block it changes, then a commit block
+#define JOURNAL_MAGIC 0x4C4E524A53465454ULL // "TTFSJRNL"
+#define JOURNAL_COMMIT_MAGIC 0x54494D4D4F435454ULL // "TTCOMMIT"
+
+// descriptor block
+#define JD_MAGIC_INDEX 0        // JOURNAL_MAGIC, uint64_t
+#define JD_SEQ_INDEX 8          // sequence number of the transaction
+#define JD_REPLAY_INDEX 12      // oldest transaction a replay must start at
+#define JD_IMAGES_INDEX 16      // number of block images that follow
+#define JD_REVOKES_INDEX 20     // number of revoked blocks
+#define JD_ADDR_INDEX 24        // home block of every image, then revokes
+#define JOURNAL_DESC_ADDRS(bs) (((bs) - JD_ADDR_INDEX) / 4)
+
+// commit block
+#define JC_MAGIC_INDEX 0        // JOURNAL_COMMIT_MAGIC, uint64_t
+#define JC_SEQ_INDEX 8          // sequence number of the transaction
+#define JC_SUM_INDEX 16         // checksum of the descriptor and images
+
+// one metadata block waiting for the next commit
+typedef struct Journal_block
+{
+    int addr;
+    int slot;       // index in the pending array
+    uint8_t *data;
+} Journal_block;
+
+// write-ahead log of metadata blocks
+//
+// metadata writes are collected in memory as the running transaction and
+// written out together by journal_commit, so every operation between two
+// commits shares one fsync. after the commit is on disk the blocks are
+// written to their home locations through the block cache, and become
+// durable with the fsync of the next commit
+//
+// a replay therefore has to start at the transaction before the last
+// commit, which each descriptor records. blocks freed while that
+// transaction can still be replayed are revoked so a replay never writes
+// over a block that has been reused for file data
+typedef struct Journal
+{
+    int disk;
+    int block_size;
+    int start;              // first block of the journal region
+    int n_blocks;           // blocks in the journal region
+    uint32_t seq;           // sequence number of the next commit
+    uint32_t durable;       // every commit up to this one is checkpointed
+    int tail;               // ring position of the next commit
+    int protect;            // ring position of the oldest replayable commit
+    int last_pos;           // ring position of the last commit
+    Journal_block **pending;
+    int n_pending;
+    int pending_capacity;
+    struct Hash_index *pending_index; // pending blocks by home block
+    int *revokes;
+    int n_revokes;
+    int revoke_capacity;
+    int *last_addrs;        // home blocks of the last commit, sorted
+    int n_last;
+} Journal;
+
+Journal *create_journal(int disk, int start, int n_blocks);
+
+void free_journal(Journal *journal);
+
+int replay_journal(Journal *journal);
+
+int journal_write(Journal *journal, int addr, void *block);
+
+int journal_read(Journal *journal, int addr, void *block);
+
+int journal_forget(Journal *journal, int addr);
+
+int journal_full(Journal *journal);
+
+int journal_commit(Journal *journal);
@@ -1,15 +1,86 @@
 #include "libDisk.h"
+#include "stats.h"
 
-int openDisk(char *filename, int nBytes)
+// table of open disks, indexed by disk number
+static Disk disk_table[MAX_OPEN_DISKS];
+
+// held while a disk table entry is taken or given back
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int open_disk(char *filename, int64_t nBytes, int mode, int blockSize);
+static Disk *get_disk(int disk);
+static int raw_read(Disk *d, int bNum, void *block);
+static int raw_write(Disk *d, int bNum, void *block);
+static Block_cache *create_cache(int nFrames, int blockSize);
+static void free_cache(Block_cache *cache);
+static int cache_lookup(Block_cache *cache, int bNum);
+static int cache_settle(Disk *d, int bNum);
+static int cache_victim(Disk *d);
+static void cache_insert(Block_cache *cache, int frame, int bNum);
+static int flush_frame(Disk *d, int frame);
+static void end_write_back(Block_cache *cache, int frame, int err);
+static int flush_cache(Disk *d);
+static int compare_block_ref(const void *a, const void *b);
+static int raw_transfer(Disk *d, off_t offset, struct iovec *iov, int count, int write);
+static int transfer_runs(Disk *d, Block_ref *refs, int n, void **blocks, int write);
+static int ring_transfer_runs(Disk *d, struct iovec *iov, int *runs, int n_runs, \
+    Block_ref *refs, int write);
+static Block_queue *create_queue(int depth, int use_ring);
+static void free_queue(Block_queue *queue);
+static Block_queue *get_queue(Disk *d);
+static int reserve_completion(Block_queue *queue);
+static void push_completion(Block_queue *queue, void *tag, int result);
+static int submit_block(int disk, int bNum, void *block, void *tag, int write);
+static int wait_queue(Disk *d);
+static void finish_request(Disk *d, int slot, int res);
+
+int openDisk(char *filename, int64_t nBytes)
+{
+    return openDiskMode(filename, nBytes, DISK_MODE_FD);
+}
+
+// open a disk with the given backend
+int openDiskMode(char *filename, int64_t nBytes, int mode)
+{
+    return openDiskBlockSize(filename, nBytes, mode, BLOCKSIZE);
+}
+
+// open a disk with the given backend and block size, a power of two between
+// MIN_BLOCKSIZE and MAX_BLOCKSIZE
+int openDiskBlockSize(char *filename, int64_t nBytes, int mode, int blockSize)
+{
+    pthread_mutex_lock(&table_lock);
+    int disk = open_disk(filename, nBytes, mode, blockSize);
+    pthread_mutex_unlock(&table_lock);
+    return disk;
+}
+
+// openDiskBlockSize, with the disk table locked
+static int open_disk(char *filename, int64_t nBytes, int mode, int blockSize)
 {
     // file descriptor for disk
     int fd = -1;
 
-    // error if less than 3 blocks, byte size not multiple of 256, byte size larger than max disk size
-    // SLIGHT ISSUE HERE IF SETTING nBytes < BLOCKSIZE * 3
-    if ((nBytes < BLOCKSIZE * 3 && nBytes != 0) || nBytes % BLOCKSIZE != 0 || \
-        nBytes > MAX_DISK_SIZE)
+    if (blockSize < MIN_BLOCKSIZE || blockSize > MAX_BLOCKSIZE || \
+        (blockSize & (blockSize - 1)) != 0)
+        return INVALID_OP; // invalid block size
+
+    // error if less than 3 blocks, byte size not multiple of the block size,
+    // more blocks than fit in a block number
+    // SLIGHT ISSUE HERE IF SETTING nBytes < blockSize * 3
+    if ((nBytes < (int64_t) blockSize * 3 && nBytes != 0) || nBytes % blockSize != 0 || \
+        nBytes / blockSize > MAX_DISK_BLOCKS)
         return INVALID_OP; // invalid nBytes size
+    if (mode != DISK_MODE_FD && mode != DISK_MODE_MMAP && mode != DISK_MODE_URING)
+        return INVALID_OP; // unknown backend
+
+    // find a free slot in the disk table
+    int disk;
+    for (disk = 0; disk < MAX_OPEN_DISKS; disk++)
+        if (!disk_table[disk].in_use)
+            break;
+    if (disk == MAX_OPEN_DISKS)
+        return OPEN_ERR; // too many open disks
 
     // open file
     if (nBytes == 0) // disk already exists
@@ -29,42 +100,148 @@ int openDisk(char *filename, int nBytes)
         {
             return OPEN_ERR; // open error
         }
-        // fill in disk space with null characters
-        uint8_t *buf = (uint8_t *) calloc(nBytes, 1);
-        if (buf == NULL)
-            return MALLOC_ERR; // calloc error
-        if (write(fd, buf, nBytes) < 0)
+        // extend the disk to nBytes null characters, the file system
+        // allocates the space lazily so large disks are created instantly
+        if (ftruncate(fd, (off_t) nBytes) < 0)
         {
-            free(buf);
-            return WRITE_ERR; // write error
+            close(fd);
+            return WRITE_ERR; // truncate error
+        }
+    }
+
+    // record the disk geometry once
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+    {
+        close(fd);
+        return OPEN_ERR; // stat error
+    }
+
+    if (st.st_size / blockSize > MAX_DISK_BLOCKS)
+    {
+        close(fd);
+        return INVALID_OP; // disk too large for 32-bit block numbers
+    }
+
+    // fill in disk table entry
+    pthread_mutex_init(&disk_table[disk].lock, NULL);
+    disk_table[disk].in_use = 1;
+    disk_table[disk].fd = fd;
+    disk_table[disk].nBlocks = st.st_size / blockSize;
+    disk_table[disk].blockSize = blockSize;
+    disk_table[disk].mode = mode;
+    disk_table[disk].map = NULL;
+    disk_table[disk].cache = NULL;
+    disk_table[disk].queue = NULL;
+
+    // map the whole disk, the mapping replaces the block cache
+    if (mode == DISK_MODE_MMAP)
+    {
+        if (disk_table[disk].nBlocks == 0)
+        {
+            close(fd);
+            disk_table[disk].in_use = 0;
+            pthread_mutex_destroy(&disk_table[disk].lock);
+            return INVALID_OP; // nothing to map
+        }
+        void *map = mmap(NULL, (size_t) disk_table[disk].nBlocks * blockSize, \
+            PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED)
+        {
+            close(fd);
+            disk_table[disk].in_use = 0;
+            pthread_mutex_destroy(&disk_table[disk].lock);
+            return OPEN_ERR; // mmap error
+        }
+        disk_table[disk].map = (uint8_t *) map;
+    }
+    else if (DEFAULT_CACHE_FRAMES > 0)
+    {
+        disk_table[disk].cache = create_cache(DEFAULT_CACHE_FRAMES, blockSize);
+        if (disk_table[disk].cache == NULL)
+        {
+            close(fd);
+            disk_table[disk].in_use = 0;
+            pthread_mutex_destroy(&disk_table[disk].lock);
+            return MALLOC_ERR; // malloc error
         }
+    }
 
-        // free buffer
-        free(buf);
+    // set up io_uring, without it the disk works like DISK_MODE_FD
+    if (mode == DISK_MODE_URING)
+    {
+        disk_table[disk].queue = create_queue(DEFAULT_QUEUE_DEPTH, 1);
+        if (disk_table[disk].queue == NULL)
+        {
+            free_cache(disk_table[disk].cache);
+            disk_table[disk].cache = NULL;
+            close(fd);
+            disk_table[disk].in_use = 0;
+            pthread_mutex_destroy(&disk_table[disk].lock);
+            return MALLOC_ERR; // malloc error
+        }
+        if (disk_table[disk].queue->ring == NULL)
+            disk_table[disk].mode = DISK_MODE_FD;
     }
 
-    // return disk file descriptor
-    return fd;
+    // return disk number
+    return disk;
 }
 
 int readBlock(int disk, int bNum, void *block)
 {
-    // find disk size
-    int disk_size = get_disk_size(disk);
-    if (disk_size < 0)
-        return LSEEK_ERR; // lseek error
+    Disk *d = get_disk(disk);
+    if (d == NULL)
+        return INVALID_OP; // disk not open
+    stat_add(STAT_READ_BLOCK, 1);
+    stat_add(STAT_BLOCKS_READ, 1);
 
-    // error check number of blocks
-    if (bNum < 0 || bNum * BLOCKSIZE >= disk_size)
-        return INVALID_OP; // invalid number of blocks
+    // copy the block out of the mapping
+    if (d->map != NULL)
+    {
+        if (bNum < 0 || bNum >= d->nBlocks)
+            return INVALID_OP; // invalid number of blocks
+        memcpy(block, &d->map[(size_t) bNum * d->blockSize], d->blockSize);
+        stat_add(STAT_BYTES_READ, d->blockSize);
+        return 0;
+    }
+
+    // serve the block from the cache if it is there
+    pthread_mutex_lock(&d->lock);
+    Block_cache *cache = d->cache;
+    if (cache != NULL)
+    {
+        int frame = cache_lookup(cache, bNum);
+        if (frame >= 0)
+        {
+            cache->frames[frame].ref = 1;
+            memcpy(block, &cache->data[(size_t) frame * d->blockSize], d->blockSize);
+            pthread_mutex_unlock(&d->lock);
+            stat_add(STAT_CACHE_HITS, 1);
+            return 0;
+        }
+    }
+    pthread_mutex_unlock(&d->lock);
+    if (cache != NULL)
+        stat_add(STAT_CACHE_MISSES, 1);
 
-    // read bNum bytes from disk and copy to block buffer
-    if (lseek(disk, bNum * BLOCKSIZE, SEEK_SET) < 0)
-        return LSEEK_ERR; // lseek error
+    // read block from disk, other threads can use the cache meanwhile
+    int err = raw_read(d, bNum, block);
+    if (err < 0 || cache == NULL)
+        return err;
 
-    // read block into buffer
-    if (read(disk, block, BLOCKSIZE) < 0)
-        return READ_ERR; // read error
+    // keep a copy in the cache, unless another thread cached it first,
+    // also while a victim was written back
+    pthread_mutex_lock(&d->lock);
+    int frame = -1;
+    if (cache_lookup(cache, bNum) < 0)
+        frame = cache_victim(d);
+    if (frame >= 0 && cache_lookup(cache, bNum) < 0)
+    {
+        memcpy(&cache->data[(size_t) frame * d->blockSize], block, d->blockSize);
+        cache_insert(cache, frame, bNum);
+    }
+    pthread_mutex_unlock(&d->lock);
 
     // successful return
     return 0;
@@ -72,38 +249,1173 @@ int readBlock(int disk, int bNum, void *block)
 
 int writeBlock(int disk, int bNum, void *block)
 {
-    // find disk size
-    int disk_size = get_disk_size(disk);
-    if (disk_size < 0)
-        return LSEEK_ERR; // lseek error
+    Disk *d = get_disk(disk);
+    if (d == NULL)
+        return INVALID_OP; // disk not open
+    stat_add(STAT_WRITE_BLOCK, 1);
+    stat_add(STAT_BLOCKS_WRITTEN, 1);
 
-    // error check number of blocks
-    if (bNum < 0 || bNum * BLOCKSIZE >= disk_size)
-        return INVALID_OP; // invalid number of blocks
+    // copy the block into the mapping
+    if (d->map != NULL)
+    {
+        if (bNum < 0 || bNum >= d->nBlocks)
+            return INVALID_OP; // invalid number of blocks
+        memcpy(&d->map[(size_t) bNum * d->blockSize], block, d->blockSize);
+        stat_add(STAT_BYTES_WRITTEN, d->blockSize);
+        return 0;
+    }
+
+    // write straight through if caching is disabled
+    pthread_mutex_lock(&d->lock);
+    Block_cache *cache = d->cache;
+    if (cache == NULL)
+    {
+        pthread_mutex_unlock(&d->lock);
+        return raw_write(d, bNum, block);
+    }
 
-    // read bNum bytes from disk and copy to block buffer
-    if (lseek(disk, bNum * BLOCKSIZE, SEEK_SET) < 0)
-        return LSEEK_ERR; // lseek error
+    // overwrite the cached copy if the block is cached
+    int frame = cache_lookup(cache, bNum);
+    stat_add(frame >= 0 ? STAT_CACHE_HITS : STAT_CACHE_MISSES, 1);
+    if (frame < 0)
+    {
+        // error check number of blocks before taking a frame
+        if (bNum < 0 || bNum >= d->nBlocks)
+        {
+            pthread_mutex_unlock(&d->lock);
+            return INVALID_OP; // invalid number of blocks
+        }
 
-    // write block to disk
-    if (write(disk, block, BLOCKSIZE) < 0)
-        return WRITE_ERR; // write error
+        // another thread may cache the block while a victim is written
+        // back, if no frame could be freed write through
+        int victim = cache_victim(d);
+        frame = cache_lookup(cache, bNum);
+        if (frame < 0 && victim < 0)
+        {
+            pthread_mutex_unlock(&d->lock);
+            return raw_write(d, bNum, block);
+        }
+        if (frame < 0)
+        {
+            frame = victim;
+            cache_insert(cache, frame, bNum);
+        }
+    }
+    memcpy(&cache->data[(size_t) frame * d->blockSize], block, d->blockSize);
+    cache->frames[frame].ref = 1;
+    cache->frames[frame].dirty = 1;
+    pthread_mutex_unlock(&d->lock);
 
     // successful return
     return 0;
 }
 
+// read nBlocks blocks, bNums[i] into blocks[i]. cached blocks are copied
+// from the cache, the rest are sorted and runs of adjacent blocks are read
+// with one preadv each. blocks read this way are not added to the cache
+int readBlocks(int disk, int nBlocks, int *bNums, void **blocks)
+{
+    Disk *d = get_disk(disk);
+    if (d == NULL || nBlocks < 0)
+        return INVALID_OP; // disk not open or invalid count
+    int i;
+    for (i = 0; i < nBlocks; i++)
+        if (bNums[i] < 0 || bNums[i] >= d->nBlocks)
+            return INVALID_OP; // invalid number of blocks
+    stat_add(STAT_READ_BLOCKS, 1);
+    stat_add(STAT_BLOCKS_READ, nBlocks);
+
+    // copy the blocks out of the mapping
+    if (d->map != NULL)
+    {
+        for (i = 0; i < nBlocks; i++)
+            memcpy(blocks[i], &d->map[(size_t) bNums[i] * d->blockSize], d->blockSize);
+        stat_add(STAT_BYTES_READ, (uint64_t) nBlocks * d->blockSize);
+        return 0;
+    }
+
+    Block_ref *refs = (Block_ref *) malloc((nBlocks + 1) * sizeof(Block_ref));
+    if (refs == NULL)
+        return MALLOC_ERR; // malloc error
+
+    // serve what the cache has, the newest copy of a dirty block is there
+    pthread_mutex_lock(&d->lock);
+    Block_cache *cache = d->cache;
+    int n = 0;
+    for (i = 0; i < nBlocks; i++)
+    {
+        int frame = cache == NULL ? -1 : cache_lookup(cache, bNums[i]);
+        if (frame >= 0)
+        {
+            cache->frames[frame].ref = 1;
+            memcpy(blocks[i], &cache->data[(size_t) frame * d->blockSize], d->blockSize);
+            continue;
+        }
+        refs[n].bNum = bNums[i];
+        refs[n].index = i;
+        n++;
+    }
+    pthread_mutex_unlock(&d->lock);
+    if (cache != NULL)
+    {
+        stat_add(STAT_CACHE_HITS, nBlocks - n);
+        stat_add(STAT_CACHE_MISSES, n);
+    }
+
+    int err = transfer_runs(d, refs, n, blocks, 0);
+    free(refs);
+    return err;
+}
+
+// write nBlocks blocks, blocks[i] to bNums[i]. the blocks are sorted and
+// runs of adjacent blocks are written with one pwritev each, cached copies
+// are updated. if a block number is listed twice the later buffer wins
+int writeBlocks(int disk, int nBlocks, int *bNums, void **blocks)
+{
+    Disk *d = get_disk(disk);
+    if (d == NULL || nBlocks < 0)
+        return INVALID_OP; // disk not open or invalid count
+    int i;
+    for (i = 0; i < nBlocks; i++)
+        if (bNums[i] < 0 || bNums[i] >= d->nBlocks)
+            return INVALID_OP; // invalid number of blocks
+    stat_add(STAT_WRITE_BLOCKS, 1);
+    stat_add(STAT_BLOCKS_WRITTEN, nBlocks);
+
+    // copy the blocks into the mapping
+    if (d->map != NULL)
+    {
+        for (i = 0; i < nBlocks; i++)
+            memcpy(&d->map[(size_t) bNums[i] * d->blockSize], blocks[i], d->blockSize);
+        stat_add(STAT_BYTES_WRITTEN, (uint64_t) nBlocks * d->blockSize);
+        return 0;
+    }
+
+    Block_ref *refs = (Block_ref *) malloc((nBlocks + 1) * sizeof(Block_ref));
+    if (refs == NULL)
+        return MALLOC_ERR; // malloc error
+    for (i = 0; i < nBlocks; i++)
+    {
+        refs[i].bNum = bNums[i];
+        refs[i].index = i;
+    }
+
+    // cached copies get the new contents first, so a frame written back
+    // by another thread while the blocks are written can't undo them. an
+    // older copy already being written back is waited for
+    pthread_mutex_lock(&d->lock);
+    Block_cache *cache = d->cache;
+    for (i = 0; cache != NULL && i < nBlocks; i++)
+    {
+        int frame = cache_settle(d, bNums[i]);
+        if (frame < 0)
+            continue;
+        memcpy(&cache->data[(size_t) frame * d->blockSize], blocks[i], d->blockSize);
+        cache->frames[frame].ref = 1;
+    }
+    pthread_mutex_unlock(&d->lock);
+
+    int err = transfer_runs(d, refs, nBlocks, blocks, 1);
+    free(refs);
+    if (err < 0)
+        return err; // write error
+
+    // the disk now has the new contents, cached copies are clean again
+    pthread_mutex_lock(&d->lock);
+    for (i = 0; cache != NULL && i < nBlocks; i++)
+    {
+        int frame = cache_lookup(cache, bNums[i]);
+        if (frame >= 0)
+            cache->frames[frame].dirty = 0;
+    }
+    pthread_mutex_unlock(&d->lock);
+
+    // successful return
+    return 0;
+}
+
+// read nBlocks blocks into the block cache before they are needed, so a
+// later readBlock or readBlocks of them doesn't wait on the backing file.
+// cached blocks are skipped and the rest are read in runs like readBlocks.
+// at most half the cache is filled, so a read-ahead never evicts itself.
+// a mapped disk asks the kernel to start reading the pages instead
+int prefetchBlocks(int disk, int nBlocks, int *bNums)
+{
+    Disk *d = get_disk(disk);
+    if (d == NULL || nBlocks < 0)
+        return INVALID_OP; // disk not open or invalid count
+    int i;
+    for (i = 0; i < nBlocks; i++)
+        if (bNums[i] < 0 || bNums[i] >= d->nBlocks)
+            return INVALID_OP; // invalid number of blocks
+
+    // one madvise per run of adjacent blocks, from the page holding the
+    // start of the run
+    if (d->map != NULL)
+    {
+        size_t page = (size_t) sysconf(_SC_PAGESIZE);
+        int start = 0;
+        for (i = 1; i <= nBlocks; i++)
+        {
+            if (i < nBlocks && bNums[i] == bNums[i - 1] + 1)
+                continue;
+            size_t offset = (size_t) bNums[start] * d->blockSize;
+            size_t end = ((size_t) bNums[i - 1] + 1) * d->blockSize;
+            offset -= offset % page;
+            madvise(&d->map[offset], end - offset, MADV_WILLNEED);
+            start = i;
+        }
+        return 0;
+    }
+
+    Block_ref *refs = (Block_ref *) malloc((nBlocks + 1) * sizeof(Block_ref));
+    if (refs == NULL)
+        return MALLOC_ERR; // malloc error
+
+    // list the blocks the cache doesn't have
+    pthread_mutex_lock(&d->lock);
+    Block_cache *cache = d->cache;
+    int max = cache == NULL ? 0 : cache->nFrames / 2;
+    int n = 0;
+    for (i = 0; i < nBlocks && n < max; i++)
+    {
+        if (cache_lookup(cache, bNums[i]) >= 0)
+            continue;
+        refs[n].bNum = bNums[i];
+        refs[n].index = n;
+        n++;
+    }
+    pthread_mutex_unlock(&d->lock);
+    if (n == 0)
+    {
+        free(refs);
+        return 0; // everything is cached already
+    }
+
+    uint8_t *data = (uint8_t *) malloc((size_t) n * d->blockSize);
+    void **blocks = (void **) malloc(n * sizeof(void *));
+    if (data == NULL || blocks == NULL)
+    {
+        free(refs);
+        free(data);
+        free(blocks);
+        return MALLOC_ERR; // malloc error
+    }
+    for (i = 0; i < n; i++)
+        blocks[i] = &data[(size_t) i * d->blockSize];
+
+    // read the blocks from disk, other threads can use the cache meanwhile
+    int err = transfer_runs(d, refs, n, blocks, 0);
+
+    // cache the copies, unless another thread cached the block first
+    if (err >= 0)
+    {
+        pthread_mutex_lock(&d->lock);
+        for (i = 0; d->cache == cache && i < n; i++)
+        {
+            if (cache_lookup(cache, refs[i].bNum) >= 0)
+                continue;
+            int frame = cache_victim(d);
+            if (frame < 0)
+                break;
+            if (cache_lookup(cache, refs[i].bNum) >= 0)
+                continue; // cached while a victim was written back
+            memcpy(&cache->data[(size_t) frame * d->blockSize], blocks[refs[i].index], \
+                d->blockSize);
+            cache_insert(cache, frame, refs[i].bNum);
+        }
+        pthread_mutex_unlock(&d->lock);
+    }
+
+    free(refs);
+    free(data);
+    free(blocks);
+    return err < 0 ? err : 0;
+}
+
 int closeDisk(int disk)
 {
+    Disk *d = get_disk(disk);
+    if (d == NULL)
+        return INVALID_OP; // disk not open
+
+    // write back dirty blocks before closing
+    // let requests in flight finish, their buffers belong to the caller
+    int err = 0;
+    if (d->queue != NULL)
+        pthread_mutex_lock(&d->queue->lock);
+    while (d->queue != NULL && d->queue->n_free < d->queue->depth)
+        if (wait_queue(d) < 0)
+        {
+            err = READ_ERR;
+            break; // the ring failed, nothing more will complete
+        }
+    if (d->queue != NULL)
+        pthread_mutex_unlock(&d->queue->lock);
+    free_queue(d->queue);
+    d->queue = NULL;
+
+    int flush_err = flushDisk(disk);
+    if (flush_err < 0)
+        err = flush_err;
+
+    // free the cache or mapping and the disk table entry
+    free_cache(d->cache);
+    d->cache = NULL;
+    if (d->map != NULL && munmap(d->map, (size_t) d->nBlocks * d->blockSize) < 0)
+        err = CLOSE_ERR;
+    d->map = NULL;
+    int fd = d->fd;
+    pthread_mutex_destroy(&d->lock);
+    pthread_mutex_lock(&table_lock);
+    d->in_use = 0;
+    pthread_mutex_unlock(&table_lock);
+
     // close disk (returns 0 if successful, -1 if error)
-    if (close(disk) < 0){
+    if (close(fd) < 0){
         return CLOSE_ERR;
     }
+    return err;
+}
+
+// returns the block size of an open disk
+int get_block_size(int disk)
+{
+    Disk *d = get_disk(disk);
+    if (d == NULL)
+        return INVALID_OP; // disk not open
+    return d->blockSize;
+}
+
+int64_t get_disk_size(int disk)
+{
+    Disk *d = get_disk(disk);
+    if (d == NULL)
+        return INVALID_OP; // disk not open
+
+    // return disk size recorded by openDisk
+    return (int64_t) d->nBlocks * d->blockSize;
+}
+
+// resize the block cache of an open disk, 0 frames disables caching
+// dirty blocks are written back first
+int setCacheSize(int disk, int nFrames)
+{
+    Disk *d = get_disk(disk);
+    if (d == NULL || nFrames < 0 || d->map != NULL)
+        return INVALID_OP; // disk not open, invalid size or mapped
+
+    int err = flushDisk(disk);
+    if (err < 0)
+        return err; // write back error
+
+    // replace the cache
+    Block_cache *cache = NULL;
+    if (nFrames > 0)
+    {
+        cache = create_cache(nFrames, d->blockSize);
+        if (cache == NULL)
+            return MALLOC_ERR; // malloc error
+    }
+    pthread_mutex_lock(&d->lock);
+    free_cache(d->cache);
+    d->cache = cache;
+    pthread_mutex_unlock(&d->lock);
+
+    // successful return
     return 0;
 }
 
-int get_disk_size(int disk)
+// write every dirty cached block back to disk
+// a mapped disk is synced to the backing file instead
+int flushDisk(int disk)
 {
-    // return disk size, or -1 if error
-    return lseek(disk, 0, SEEK_END);
-}
\ No newline at end of file
+    Disk *d = get_disk(disk);
+    if (d == NULL)
+        return INVALID_OP; // disk not open
+    if (d->map != NULL)
+    {
+        if (msync(d->map, (size_t) d->nBlocks * d->blockSize, MS_SYNC) < 0)
+            return WRITE_ERR; // msync error
+        return 0;
+    }
+    pthread_mutex_lock(&d->lock);
+    int err = flush_cache(d);
+    pthread_mutex_unlock(&d->lock);
+    return err;
+}
+
+// flushDisk of a disk with a cache, with the cache locked. the dirty
+// frames are copied out and written with the cache unlocked
+static int flush_cache(Disk *d)
+{
+    Block_cache *cache = d->cache;
+    if (cache == NULL)
+        return 0; // nothing cached
+
+    // write backs in flight may hold older copies of dirty frames
+    while (cache->n_busy > 0)
+        pthread_cond_wait(&cache->written, &d->lock);
+
+    // list the dirty frames, each block is cached at most once
+    int i;
+    int n = 0;
+    for (i = 0; i < cache->nFrames; i++)
+        if (cache->frames[i].bNum >= 0 && cache->frames[i].dirty)
+            n++;
+    if (n == 0)
+        return 0; // nothing dirty
+    Block_ref *refs = (Block_ref *) malloc(n * sizeof(Block_ref));
+    void **blocks = (void **) malloc(cache->nFrames * sizeof(void *));
+    uint8_t *data = (uint8_t *) malloc((size_t) n * d->blockSize);
+    if (refs == NULL || blocks == NULL || data == NULL)
+    {
+        free(refs);
+        free(blocks);
+        free(data);
+
+        // write the frames back one at a time instead
+        int err = 0;
+        for (i = 0; i < cache->nFrames; i++)
+        {
+            int frame_err = flush_frame(d, i);
+            if (frame_err < 0)
+                err = frame_err; // keep flushing, report the error
+        }
+        return err;
+    }
+    n = 0;
+    for (i = 0; i < cache->nFrames; i++)
+    {
+        Cache_frame *f = &cache->frames[i];
+        if (f->bNum < 0 || !f->dirty)
+            continue;
+        blocks[i] = &data[(size_t) n * d->blockSize];
+        memcpy(blocks[i], &cache->data[(size_t) i * d->blockSize], d->blockSize);
+        refs[n].bNum = f->bNum;
+        refs[n].index = i;
+        f->dirty = 0;
+        f->busy = 1;
+        cache->n_busy++;
+        n++;
+    }
+
+    // write them back in runs of adjacent blocks, frames written meanwhile
+    // are dirty again
+    pthread_mutex_unlock(&d->lock);
+    int err = transfer_runs(d, refs, n, blocks, 1);
+    pthread_mutex_lock(&d->lock);
+    for (i = 0; i < n; i++)
+        end_write_back(cache, refs[i].index, err);
+    free(refs);
+    free(blocks);
+    free(data);
+    return err;
+}
+
+// write every dirty cached block back to disk and wait until the backing
+// file has it on stable storage
+int syncDisk(int disk)
+{
+    int err = flushDisk(disk);
+    if (err < 0)
+        return err; // write back error
+    if (fsync(disk_table[disk].fd) < 0)
+        return WRITE_ERR; // fsync error
+    return 0;
+}
+
+// start reading block bNum into block, tag is returned by completeBlocks
+// when the read has finished. block must stay valid until then
+int submitRead(int disk, int bNum, void *block, void *tag)
+{
+    return submit_block(disk, bNum, block, tag, 0);
+}
+
+// start writing block to block bNum, tag is returned by completeBlocks
+// when the write has finished. block must stay valid and unchanged until
+// then, and the block must not be read or written another way meanwhile
+int submitWrite(int disk, int bNum, void *block, void *tag)
+{
+    return submit_block(disk, bNum, block, tag, 1);
+}
+
+// wait until at least minComplete submitted requests have finished, or
+// none are left in flight, and copy up to maxDone completions to done,
+// oldest first
+// returns the number of completions copied, or a negative error code
+int completeBlocks(int disk, int minComplete, Block_completion *done, int maxDone)
+{
+    Disk *d = get_disk(disk);
+    if (d == NULL || minComplete < 0 || maxDone < 0 || (maxDone > 0 && done == NULL))
+        return INVALID_OP; // disk not open or invalid count
+    Block_queue *queue = d->queue;
+    if (queue == NULL)
+        return 0; // nothing was ever submitted
+    if (minComplete > maxDone)
+        minComplete = maxDone;
+
+    // hand queued requests to the kernel and collect what has finished
+    pthread_mutex_lock(&queue->lock);
+    int err = 0;
+    if (queue->ring != NULL && queue->n_free < queue->depth)
+    {
+        err = uring_submit(queue->ring, 0);
+        uint64_t user_data;
+        int res;
+        while (err == 0 && uring_reap(queue->ring, &user_data, &res))
+            finish_request(d, (int) user_data, res);
+    }
+    while (err == 0 && queue->n_ready < minComplete && queue->n_free < queue->depth)
+        err = wait_queue(d);
+    if (err < 0)
+    {
+        pthread_mutex_unlock(&queue->lock);
+        return READ_ERR; // the ring failed
+    }
+
+    // return the oldest completions
+    int n = queue->n_ready < maxDone ? queue->n_ready : maxDone;
+    if (n > 0)
+    {
+        memcpy(done, queue->ready, n * sizeof(Block_completion));
+        memmove(queue->ready, &queue->ready[n], \
+            (queue->n_ready - n) * sizeof(Block_completion));
+        queue->n_ready -= n;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return n;
+}
+
+// change how many submitted requests can be in flight at once, between 1
+// and MAX_QUEUE_DEPTH. nothing may be in flight or waiting in completeBlocks
+int setQueueDepth(int disk, int depth)
+{
+    Disk *d = get_disk(disk);
+    if (d == NULL || depth < 1 || depth > MAX_QUEUE_DEPTH)
+        return INVALID_OP; // disk not open or invalid depth
+    if (d->queue != NULL && (d->queue->n_free < d->queue->depth || d->queue->n_ready > 0))
+        return INVALID_OP; // requests not completed yet
+
+    // replace the queue, the ring is sized by the depth
+    Block_queue *queue = create_queue(depth, d->mode == DISK_MODE_URING);
+    if (queue == NULL)
+        return MALLOC_ERR; // malloc error
+    free_queue(d->queue);
+    d->queue = queue;
+    if (d->mode == DISK_MODE_URING && queue->ring == NULL)
+        d->mode = DISK_MODE_FD;
+
+    // successful return
+    return 0;
+}
+
+// returns the backend of an open disk, DISK_MODE_FD if io_uring was asked
+// for but is not available
+int get_disk_mode(int disk)
+{
+    Disk *d = get_disk(disk);
+    if (d == NULL)
+        return INVALID_OP; // disk not open
+    return d->mode;
+}
+
+// returns the table entry of an open disk, or NULL
+static Disk *get_disk(int disk)
+{
+    if (disk < 0 || disk >= MAX_OPEN_DISKS || !disk_table[disk].in_use)
+        return NULL;
+    return &disk_table[disk];
+}
+
+// read a block from the backing file, bypassing the cache
+static int raw_read(Disk *d, int bNum, void *block)
+{
+    // error check number of blocks
+    if (bNum < 0 || bNum >= d->nBlocks)
+        return INVALID_OP; // invalid number of blocks
+
+    // read block into buffer, retrying short reads
+    off_t offset = (off_t) bNum * d->blockSize;
+    size_t done = 0;
+    while (done < (size_t) d->blockSize)
+    {
+        ssize_t n = pread(d->fd, (uint8_t *) block + done, \
+            d->blockSize - done, offset + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return READ_ERR; // read error or unexpected end of disk
+        done += n;
+    }
+    stat_add(STAT_BYTES_READ, done);
+
+    // successful return
+    return 0;
+}
+
+// write a block to the backing file, bypassing the cache
+static int raw_write(Disk *d, int bNum, void *block)
+{
+    // error check number of blocks
+    if (bNum < 0 || bNum >= d->nBlocks)
+        return INVALID_OP; // invalid number of blocks
+
+    // write block to disk, retrying short writes
+    off_t offset = (off_t) bNum * d->blockSize;
+    size_t done = 0;
+    while (done < (size_t) d->blockSize)
+    {
+        ssize_t n = pwrite(d->fd, (uint8_t *) block + done, \
+            d->blockSize - done, offset + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return WRITE_ERR; // write error
+        done += n;
+    }
+    stat_add(STAT_BYTES_WRITTEN, done);
+
+    // successful return
+    return 0;
+}
+
+// allocate an empty cache with nFrames frames of blockSize bytes
+static Block_cache *create_cache(int nFrames, int blockSize)
+{
+    Block_cache *cache = (Block_cache *) malloc(sizeof(Block_cache));
+    if (cache == NULL)
+        return NULL;
+
+    // twice as many buckets as frames keeps the chains short
+    cache->nBuckets = 1;
+    while (cache->nBuckets < 2 * nFrames)
+        cache->nBuckets <<= 1;
+
+    cache->nFrames = nFrames;
+    cache->hand = 0;
+    cache->n_busy = 0;
+    pthread_cond_init(&cache->written, NULL);
+    cache->buckets = (int *) malloc(cache->nBuckets * sizeof(int));
+    cache->frames = (Cache_frame *) malloc(nFrames * sizeof(Cache_frame));
+    cache->data = (uint8_t *) malloc((size_t) nFrames * blockSize);
+    if (cache->buckets == NULL || cache->frames == NULL || cache->data == NULL)
+    {
+        free_cache(cache);
+        return NULL;
+    }
+
+    int i;
+    for (i = 0; i < cache->nBuckets; i++)
+        cache->buckets[i] = -1;
+    for (i = 0; i < nFrames; i++)
+    {
+        cache->frames[i].bNum = -1;
+        cache->frames[i].dirty = 0;
+        cache->frames[i].ref = 0;
+        cache->frames[i].busy = 0;
+        cache->frames[i].next = -1;
+    }
+    return cache;
+}
+
+static void free_cache(Block_cache *cache)
+{
+    if (cache == NULL)
+        return;
+    free(cache->buckets);
+    free(cache->frames);
+    free(cache->data);
+    pthread_cond_destroy(&cache->written);
+    free(cache);
+}
+
+// returns the frame holding bNum, or -1 if it isn't cached
+static int cache_lookup(Block_cache *cache, int bNum)
+{
+    int frame = cache->buckets[bNum & (cache->nBuckets - 1)];
+    while (frame >= 0 && cache->frames[frame].bNum != bNum)
+        frame = cache->frames[frame].next;
+    return frame;
+}
+
+// wait until no copy of bNum is being written back, returns the frame
+// holding bNum or -1 if it isn't cached. the cache is locked
+static int cache_settle(Disk *d, int bNum)
+{
+    int frame;
+    while ((frame = cache_lookup(d->cache, bNum)) >= 0 && d->cache->frames[frame].busy)
+        pthread_cond_wait(&d->cache->written, &d->lock);
+    return frame;
+}
+
+// pick a frame to reuse with the CLOCK algorithm, skipping busy frames
+// the frame is written back if dirty and unlinked from its hash chain.
+// the cache is unlocked during the write back
+// returns -1 if every frame is busy, or the frame could not be written
+// back or was written again meanwhile
+static int cache_victim(Disk *d)
+{
+    Block_cache *cache = d->cache;
+    Cache_frame *f = NULL;
+    int frame = -1;
+    int i;
+
+    // two sweeps clear every reference bit
+    for (i = 0; i <= 2 * cache->nFrames && frame < 0; i++)
+    {
+        f = &cache->frames[cache->hand];
+        if (!f->busy && (f->bNum < 0 || !f->ref))
+            frame = cache->hand;
+        else
+            f->ref = 0; // second chance
+        cache->hand = (cache->hand + 1) % cache->nFrames;
+    }
+    if (frame < 0)
+        return -1; // every frame is being written back
+    if (f->bNum < 0)
+        return frame; // empty frame
+
+    // write back the old block
+    if (flush_frame(d, frame) < 0 || f->dirty)
+        return -1;
+
+    // unlink the frame from its hash chain
+    int *link = &cache->buckets[f->bNum & (cache->nBuckets - 1)];
+    while (*link != frame)
+        link = &cache->frames[*link].next;
+    *link = f->next;
+    f->bNum = -1;
+    f->next = -1;
+    return frame;
+}
+
+// assign an unlinked frame to bNum
+static void cache_insert(Block_cache *cache, int frame, int bNum)
+{
+    int bucket = bNum & (cache->nBuckets - 1);
+    cache->frames[frame].bNum = bNum;
+    cache->frames[frame].dirty = 0;
+    cache->frames[frame].ref = 1;
+    cache->frames[frame].next = cache->buckets[bucket];
+    cache->buckets[bucket] = frame;
+}
+
+// order block references by block number, then by position in the list
+static int compare_block_ref(const void *a, const void *b)
+{
+    const Block_ref *x = (const Block_ref *) a;
+    const Block_ref *y = (const Block_ref *) b;
+    if (x->bNum != y->bNum)
+        return (x->bNum > y->bNum) - (x->bNum < y->bNum);
+    return (x->index > y->index) - (x->index < y->index);
+}
+
+// read or write count buffers to consecutive bytes starting at offset,
+// at most MAX_IOV_BLOCKS buffers per call, retrying short transfers. iov is
+// used up in the process
+static int raw_transfer(Disk *d, off_t offset, struct iovec *iov, int count, int write)
+{
+    while (count > 0)
+    {
+        int n_iov = count < MAX_IOV_BLOCKS ? count : MAX_IOV_BLOCKS;
+        ssize_t n = write ? pwritev(d->fd, iov, n_iov, offset) : \
+            preadv(d->fd, iov, n_iov, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return write ? WRITE_ERR : READ_ERR; // error or unexpected end of disk
+        stat_add(write ? STAT_BYTES_WRITTEN : STAT_BYTES_READ, n);
+        offset += n;
+
+        // skip the buffers that are done and trim a partly done one
+        while (count > 0 && (size_t) n >= iov->iov_len)
+        {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (n > 0)
+        {
+            iov->iov_base = (uint8_t *) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+// sort refs and move every run of adjacent blocks with one transfer,
+// blocks[refs[i].index] is the buffer of refs[i]. a block listed twice
+// starts a new run, so the later buffer is written last
+static int transfer_runs(Disk *d, Block_ref *refs, int n, void **blocks, int write)
+{
+    if (n == 0)
+        return 0;
+    qsort(refs, n, sizeof(Block_ref), compare_block_ref);
+    struct iovec *iov = (struct iovec *) malloc(n * sizeof(struct iovec));
+    int *runs = (int *) malloc((n + 1) * sizeof(int));
+    if (iov == NULL || runs == NULL)
+    {
+        free(iov);
+        free(runs);
+        return MALLOC_ERR; // malloc error
+    }
+
+    // run i is refs[runs[i]] up to refs[runs[i + 1]]
+    int i;
+    int n_runs = 0;
+    for (i = 0; i < n; i++)
+    {
+        iov[i].iov_base = blocks[refs[i].index];
+        iov[i].iov_len = d->blockSize;
+        if (i == 0 || refs[i].bNum != refs[i - 1].bNum + 1 || \
+            i - runs[n_runs - 1] == MAX_IOV_BLOCKS)
+            runs[n_runs++] = i;
+    }
+    runs[n_runs] = n;
+
+    // with io_uring all the runs are in flight at once
+    int err = 0;
+    if (d->queue != NULL && d->queue->ring != NULL)
+    {
+        pthread_mutex_lock(&d->queue->lock);
+        err = ring_transfer_runs(d, iov, runs, n_runs, refs, write);
+        pthread_mutex_unlock(&d->queue->lock);
+    }
+    else
+    {
+        for (i = 0; i < n_runs; i++)
+        {
+            int run_err = raw_transfer(d, (off_t) refs[runs[i]].bNum * d->blockSize, \
+                &iov[runs[i]], runs[i + 1] - runs[i], write);
+            if (run_err < 0)
+                err = run_err; // keep going, report the error
+        }
+    }
+
+    free(iov);
+    free(runs);
+    return err;
+}
+
+// user_data of a ring_transfer_runs request, request slots of the queue
+// are numbered from 0
+#define RUN_TAG ((uint64_t) 1 << 63)
+
+// move every run with a readv or writev through the ring, as many in
+// flight as the queue depth allows. short transfers are finished with
+// the synchronous path. the queue is locked
+static int ring_transfer_runs(Disk *d, struct iovec *iov, int *runs, int n_runs, \
+    Block_ref *refs, int write)
+{
+    Block_queue *queue = d->queue;
+    int err = 0;
+    int next = 0;
+    int active = 0;
+    while (next < n_runs || active > 0)
+    {
+        // fill the ring, leaving completion space for queued block requests
+        while (next < n_runs && active + queue->depth - queue->n_free < queue->depth && \
+            uring_prep(queue->ring, write, d->fd, &iov[runs[next]], \
+                runs[next + 1] - runs[next], (off_t) refs[runs[next]].bNum * d->blockSize, \
+                RUN_TAG | (uint64_t) next) == 0)
+        {
+            next++;
+            active++;
+        }
+        if (uring_submit(queue->ring, 1) < 0)
+            return write ? WRITE_ERR : READ_ERR; // the ring failed
+
+        uint64_t user_data;
+        int res;
+        while (uring_reap(queue->ring, &user_data, &res))
+        {
+            if (!(user_data & RUN_TAG))
+            {
+                finish_request(d, (int) user_data, res);
+                continue;
+            }
+            active--;
+            if (res > 0)
+                stat_add(write ? STAT_BYTES_WRITTEN : STAT_BYTES_READ, res);
+            int run = (int) (user_data & ~RUN_TAG);
+            struct iovec *run_iov = &iov[runs[run]];
+            int count = runs[run + 1] - runs[run];
+            off_t offset = (off_t) refs[runs[run]].bNum * d->blockSize;
+            if (res == (int) ((size_t) count * d->blockSize))
+                continue; // done
+            if (res < 0 && res != -EINTR && res != -EAGAIN)
+            {
+                err = write ? WRITE_ERR : READ_ERR; // keep going, report the error
+                continue;
+            }
+
+            // skip what was transferred and do the rest synchronously
+            offset += res > 0 ? res : 0;
+            while (res > 0 && (size_t) res >= run_iov->iov_len)
+            {
+                res -= run_iov->iov_len;
+                run_iov++;
+                count--;
+            }
+            if (res > 0)
+            {
+                run_iov->iov_base = (uint8_t *) run_iov->iov_base + res;
+                run_iov->iov_len -= res;
+            }
+            int run_err = raw_transfer(d, offset, run_iov, count, write);
+            if (run_err < 0)
+                err = run_err; // keep going, report the error
+        }
+    }
+    return err;
+}
+
+// write a cached frame back to disk if it is dirty. the frame is copied
+// out and marked busy, then written with the cache unlocked. the cache is
+// locked again on return
+static int flush_frame(Disk *d, int frame)
+{
+    Block_cache *cache = d->cache;
+    Cache_frame *f = &cache->frames[frame];
+    while (f->busy)
+        pthread_cond_wait(&cache->written, &d->lock);
+    if (f->bNum < 0 || !f->dirty)
+        return 0;
+    uint8_t *copy = (uint8_t *) malloc(d->blockSize);
+    if (copy == NULL)
+        return MALLOC_ERR; // malloc error
+    memcpy(copy, &cache->data[(size_t) frame * d->blockSize], d->blockSize);
+    int bNum = f->bNum;
+    f->dirty = 0;
+    f->busy = 1;
+    cache->n_busy++;
+
+    pthread_mutex_unlock(&d->lock);
+    int err = raw_write(d, bNum, copy);
+    pthread_mutex_lock(&d->lock);
+    end_write_back(cache, frame, err);
+    free(copy);
+    return err;
+}
+
+// a write back of a busy frame has finished, the frame is dirty again if
+// it failed. the cache is locked
+static void end_write_back(Block_cache *cache, int frame, int err)
+{
+    if (err < 0)
+        cache->frames[frame].dirty = 1;
+    cache->frames[frame].busy = 0;
+    cache->n_busy--;
+    pthread_cond_broadcast(&cache->written);
+}
+
+// allocate a queue with depth request slots, with an io_uring instance if
+// use_ring is set and io_uring is available
+static Block_queue *create_queue(int depth, int use_ring)
+{
+    Block_queue *queue = (Block_queue *) malloc(sizeof(Block_queue));
+    if (queue == NULL)
+        return NULL;
+
+    pthread_mutex_init(&queue->lock, NULL);
+    queue->ring = NULL;
+    queue->depth = depth;
+    queue->n_free = depth;
+    queue->n_ready = 0;
+    queue->ready_capacity = depth;
+    queue->requests = (Block_request *) malloc(depth * sizeof(Block_request));
+    queue->free_slots = (int *) malloc(depth * sizeof(int));
+    queue->ready = (Block_completion *) malloc(depth * sizeof(Block_completion));
+    if (queue->requests == NULL || queue->free_slots == NULL || queue->ready == NULL)
+    {
+        free_queue(queue);
+        return NULL;
+    }
+    int i;
+    for (i = 0; i < depth; i++)
+        queue->free_slots[i] = depth - 1 - i;
+
+    if (use_ring)
+        queue->ring = create_uring((unsigned) depth);
+    return queue;
+}
+
+static void free_queue(Block_queue *queue)
+{
+    if (queue == NULL)
+        return;
+    pthread_mutex_destroy(&queue->lock);
+    free_uring(queue->ring);
+    free(queue->requests);
+    free(queue->free_slots);
+    free(queue->ready);
+    free(queue);
+}
+
+// returns the queue of a disk, a disk without io_uring gets one on its
+// first asynchronous request
+static Block_queue *get_queue(Disk *d)
+{
+    if (d->queue == NULL)
+        d->queue = create_queue(DEFAULT_QUEUE_DEPTH, 0);
+    return d->queue;
+}
+
+// make room for one more completion than could be pending, so finishing a
+// request never has to allocate
+static int reserve_completion(Block_queue *queue)
+{
+    int needed = queue->n_ready + (queue->depth - queue->n_free) + 1;
+    if (needed <= queue->ready_capacity)
+        return 0;
+    int capacity = queue->ready_capacity * 2;
+    if (capacity < needed)
+        capacity = needed;
+    Block_completion *ready = (Block_completion *) realloc(queue->ready, \
+        capacity * sizeof(Block_completion));
+    if (ready == NULL)
+        return MALLOC_ERR; // malloc error
+    queue->ready = ready;
+    queue->ready_capacity = capacity;
+    return 0;
+}
+
+// append a completion, space was reserved by reserve_completion
+static void push_completion(Block_queue *queue, void *tag, int result)
+{
+    queue->ready[queue->n_ready].tag = tag;
+    queue->ready[queue->n_ready].result = result;
+    queue->n_ready++;
+}
+
+// submit every queued request and wait for at least one to finish, with
+// the queue locked
+static int wait_queue(Disk *d)
+{
+    Block_queue *queue = d->queue;
+    if (uring_submit(queue->ring, 1) < 0)
+        return READ_ERR; // the ring failed
+    uint64_t user_data;
+    int res;
+    while (uring_reap(queue->ring, &user_data, &res))
+        finish_request(d, (int) user_data, res);
+    return 0;
+}
+
+// record the result of the request in slot and free the slot. a short or
+// interrupted transfer is finished synchronously. the queue is locked
+static void finish_request(Disk *d, int slot, int res)
+{
+    Block_queue *queue = d->queue;
+    Block_request *request = &queue->requests[slot];
+    int err = 0;
+    if (res > 0)
+        stat_add(request->write ? STAT_BYTES_WRITTEN : STAT_BYTES_READ, res);
+    if (res < 0 && res != -EINTR && res != -EAGAIN)
+        err = request->write ? WRITE_ERR : READ_ERR; // transfer error
+    else if (res < (int) request->iov.iov_len)
+    {
+        if (res > 0)
+        {
+            request->iov.iov_base = (uint8_t *) request->iov.iov_base + res;
+            request->iov.iov_len -= res;
+        }
+        off_t offset = (off_t) request->bNum * d->blockSize + \
+            ((uint8_t *) request->iov.iov_base - request->block);
+        err = raw_transfer(d, offset, &request->iov, 1, request->write);
+    }
+    push_completion(queue, request->tag, err);
+    queue->free_slots[queue->n_free++] = slot;
+}
+
+// submitRead and submitWrite. without io_uring the transfer is done now
+// and only its completion is queued
+static int submit_block(int disk, int bNum, void *block, void *tag, int write)
+{
+    Disk *d = get_disk(disk);
+    if (d == NULL)
+        return INVALID_OP; // disk not open
+    if (bNum < 0 || bNum >= d->nBlocks)
+        return INVALID_OP; // invalid number of blocks
+
+    // a block the cache holds is read from the cache, the newest copy of
+    // a dirty block is there
+    pthread_mutex_lock(&d->lock);
+    Block_queue *queue = get_queue(d);
+    Block_cache *cache = d->cache;
+    int frame = cache == NULL ? -1 : cache_lookup(cache, bNum);
+    if (queue != NULL && queue->ring != NULL && frame >= 0 && !write)
+    {
+        cache->frames[frame].ref = 1;
+        memcpy(block, &cache->data[(size_t) frame * d->blockSize], d->blockSize);
+    }
+    pthread_mutex_unlock(&d->lock);
+    if (queue == NULL)
+        return MALLOC_ERR; // malloc error
+    if (queue->ring == NULL || (frame >= 0 && !write))
+    {
+        int err = 0;
+        if (queue->ring == NULL)
+            err = write ? writeBlock(disk, bNum, block) : readBlock(disk, bNum, block);
+        if (err < 0)
+            return err; // nothing was queued
+        pthread_mutex_lock(&queue->lock);
+        err = reserve_completion(queue);
+        if (err == 0)
+            push_completion(queue, tag, 0);
+        pthread_mutex_unlock(&queue->lock);
+        return err;
+    }
+
+    // wait for a free slot
+    pthread_mutex_lock(&queue->lock);
+    int err = reserve_completion(queue);
+    while (err == 0 && queue->n_free == 0)
+        if (wait_queue(d) < 0)
+            err = write ? WRITE_ERR : READ_ERR; // the ring failed
+    if (err < 0)
+    {
+        pthread_mutex_unlock(&queue->lock);
+        return err;
+    }
+    int slot = queue->free_slots[--queue->n_free];
+    Block_request *request = &queue->requests[slot];
+    request->write = write;
+    request->bNum = bNum;
+    request->block = (uint8_t *) block;
+    request->iov.iov_base = block;
+    request->iov.iov_len = d->blockSize;
+    request->tag = tag;
+
+    // queue it, the kernel sees it at the next submit
+    while (uring_prep(queue->ring, write, d->fd, &request->iov, 1, \
+        (off_t) bNum * d->blockSize, (uint64_t) slot) < 0)
+        if (uring_submit(queue->ring, 0) < 0)
+        {
+            queue->free_slots[queue->n_free++] = slot;
+            pthread_mutex_unlock(&queue->lock);
+            return write ? WRITE_ERR : READ_ERR; // the ring failed
+        }
+    pthread_mutex_unlock(&queue->lock);
+
+    // a cached copy of a written block gets the new contents. a dirty copy
+    // stays dirty, it could be written back before this write lands. a copy
+    // being written back is older, it is made dirty to be written again
+    if (write && frame >= 0)
+    {
+        pthread_mutex_lock(&d->lock);
+        frame = cache_lookup(cache, bNum);
+        if (frame >= 0)
+        {
+            memcpy(&cache->data[(size_t) frame * d->blockSize], block, d->blockSize);
+            cache->frames[frame].ref = 1;
+            if (cache->frames[frame].busy)
+                cache->frames[frame].dirty = 1;
+        }
+        pthread_mutex_unlock(&d->lock);
+    }
+
+    // successful return
+    return 0;
+}
@@ -4,18 +4,160 @@
 #include <fcntl.h>
 #include <stdint.h>
 #include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 
 #include "errorCode.h"
+#include "uring.h"
 
+// default block size, openDiskBlockSize takes any power of two between
+// MIN_BLOCKSIZE and MAX_BLOCKSIZE
 #define BLOCKSIZE 256
-#define MAX_DISK_SIZE 520192 //  256 * 254 * 8
+#define MIN_BLOCKSIZE 256
+#define MAX_BLOCKSIZE 65536
 
-int openDisk(char *filename, int nBytes);
+// block numbers are 32-bit, byte offsets into the disk are 64-bit
+#define MAX_DISK_BLOCKS INT32_MAX
+#define MAX_DISK_SIZE ((int64_t) MAX_DISK_BLOCKS * BLOCKSIZE)
+
+#define MAX_OPEN_DISKS 64
+#define DEFAULT_CACHE_FRAMES 64
+
+// buffers passed to one preadv or pwritev, within IOV_MAX everywhere
+#define MAX_IOV_BLOCKS 1024
+
+// disk backends selectable with openDiskMode
+#define DISK_MODE_FD 0      // pread/pwrite behind the block cache
+#define DISK_MODE_MMAP 1    // whole disk image mapped into memory
+#define DISK_MODE_URING 2   // like DISK_MODE_FD, uncached I/O through io_uring
+
+// requests in flight per disk for submitRead and submitWrite
+#define DEFAULT_QUEUE_DEPTH 64
+#define MAX_QUEUE_DEPTH 4096
+
+// one frame of the block cache
+typedef struct Cache_frame
+{
+    int bNum;   // block held by this frame, -1 if empty
+    int dirty;  // 1 if the frame must be written back before reuse
+    int ref;    // CLOCK reference bit
+    int busy;   // 1 while a copy is written back with the cache unlocked
+    int next;   // next frame in the same hash chain, -1 if last
+} Cache_frame;
+
+// write-back block cache with CLOCK eviction
+typedef struct Block_cache
+{
+    int nFrames;
+    int hand;       // CLOCK hand, next frame considered for eviction
+    int nBuckets;   // power of two
+    int *buckets;   // first frame of each hash chain, -1 if empty
+    Cache_frame *frames;
+    uint8_t *data;  // nFrames * block size bytes of block data
+    int n_busy;     // frames being written back
+    pthread_cond_t written; // signalled when a write back finishes
+} Block_cache;
+
+// one block of a vectored transfer, sorted by block number so adjacent
+// blocks can be moved with a single preadv or pwritev
+typedef struct Block_ref
+{
+    int bNum;
+    int index;  // position in the caller's list
+} Block_ref;
+
+// a finished submitRead or submitWrite
+typedef struct Block_completion
+{
+    void *tag;      // as passed to submitRead or submitWrite
+    int result;     // 0, or READ_ERR or WRITE_ERR
+} Block_completion;
+
+// one block read or write in flight through io_uring
+typedef struct Block_request
+{
+    int write;
+    int bNum;
+    uint8_t *block;
+    struct iovec iov;   // the part of the block not yet transferred
+    void *tag;
+} Block_request;
+
+// asynchronous block I/O of a disk. without a ring every request is done
+// synchronously when it is submitted and only its completion is queued
+typedef struct Block_queue
+{
+    pthread_mutex_t lock;       // held while the ring or the slots are used
+    Uring *ring;                // NULL if io_uring is not used
+    int depth;                  // request slots
+    Block_request *requests;
+    int *free_slots;            // stack of unused request slots
+    int n_free;
+    Block_completion *ready;    // completions not yet returned, oldest first
+    int n_ready;
+    int ready_capacity;
+} Block_queue;
+
+// state kept for every open disk
+//
+// any thread may read and write blocks. the cache is guarded by lock, which
+// is not held while blocks move to or from the backing file, so transfers
+// of different blocks run in parallel. dirty frames are copied out and
+// written back with the lock released, the frame stays cached and busy
+// until the write has finished. callers keep two threads from
+// writing the same block, or reading a block while it is written, at once.
+// opening, closing and resizing the cache or queue of a disk must not
+// overlap other calls on that disk
+typedef struct Disk
+{
+    pthread_mutex_t lock;   // held while the cache is used
+    int in_use;
+    int fd;
+    int nBlocks;        // disk geometry, recorded once by openDisk
+    int blockSize;      // bytes per block
+    int mode;           // DISK_MODE_FD, DISK_MODE_MMAP or DISK_MODE_URING
+    uint8_t *map;       // mapping of the whole disk in DISK_MODE_MMAP
+    Block_cache *cache; // NULL if caching is disabled
+    Block_queue *queue; // NULL until the first asynchronous request
+} Disk;
+
+int openDisk(char *filename, int64_t nBytes);
+
+int openDiskMode(char *filename, int64_t nBytes, int mode);
+
+int openDiskBlockSize(char *filename, int64_t nBytes, int mode, int blockSize);
 
 int readBlock(int disk, int bNum, void *block);
 
 int writeBlock(int disk, int bNum, void *block);
 
+int readBlocks(int disk, int nBlocks, int *bNums, void **blocks);
+
+int writeBlocks(int disk, int nBlocks, int *bNums, void **blocks);
+
+int prefetchBlocks(int disk, int nBlocks, int *bNums);
+
+int submitRead(int disk, int bNum, void *block, void *tag);
+
+int submitWrite(int disk, int bNum, void *block, void *tag);
+
+int completeBlocks(int disk, int minComplete, Block_completion *done, int maxDone);
+
+int setQueueDepth(int disk, int depth);
+
+int get_disk_mode(int disk);
+
 int closeDisk(int disk);
 
-int get_disk_size(int disk);
\ No newline at end of file
+int get_block_size(int disk);
+
+int64_t get_disk_size(int disk);
+
+int setCacheSize(int disk, int nFrames);
+
+int flushDisk(int disk);
+
+int syncDisk(int disk);
@@ -1,118 +1,362 @@
 #include "libTinyFS.h"
 
-// file descriptor of mounted file system
-fileDescriptor mounted_disk = -1;
+// table of mounted file systems, indexed by mount handle. slots are never
+// freed, so a call with a stale handle finds nothing mounted instead of
+// freed memory. DEFAULT_MOUNT is used by the calls without a handle
+static Mount mount_table[MAX_MOUNTS];
+
+// held while a mount table slot is taken or given back
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t table_once = PTHREAD_ONCE_INIT;
+
+static int make_fs(char *filename, int64_t nBytes, int blockSize);
+static int mount_fs(Mount *fs, char *filename, int mode);
+static int unmount_fs(Mount *fs);
+static int sync_fs(Mount *fs);
+static fileDescriptor open_file(Mount *fs, char *name);
+static void discard_new_file(Mount *fs, Root_inode_entry *entry);
+static int write_file(Mount *fs, Resource_table_entry *entry, char *buffer, int size);
+static int write_file_blocks(Mount *fs, Resource_table_entry *entry, File_inode *inode, \
+    char *buffer, int size);
+static int write_at(Mount *fs, fileDescriptor FD, char *buffer, int size, int offset, \
+    int append);
+static int pwrite_file(Mount *fs, Resource_table_entry *entry, char *buffer, int size, \
+    int offset);
+static int pwrite_file_blocks(Mount *fs, Resource_table_entry *entry, char *buffer, \
+    int size, int offset);
+static int delay_write(Mount *fs, Resource_table_entry *entry, File_inode *inode, \
+    int start, char *buffer, int size, int offset, int new_size);
+static int flush_delayed(Mount *fs, Resource_table_entry *entry);
+static void discard_delayed(Mount *fs, Resource_table_entry *entry);
+static int fallocate_file(Mount *fs, Resource_table_entry *entry, int size, int flags);
+static int release_prealloc(Mount *fs, Resource_table_entry *entry);
+static int delete_file(Mount *fs, Resource_table_entry *entry);
+static int read_file(Mount *fs, Resource_table_entry *entry, char *buffer, int size);
+static int read_file_blocks(Mount *fs, Resource_table_entry *entry, char *buffer, \
+    int fp, int size);
+static int read_byte(Mount *fs, Resource_table_entry *entry, char *buffer);
+static int rename_file(Mount *fs, Resource_table_entry *entry, char *new_name);
+static Resource_table_entry *lock_file(Mount *fs, fileDescriptor FD);
+static void unlock_file(Mount *fs, Resource_table_entry *entry);
+static void read_ahead(Mount *fs, Resource_table_entry *entry, File_inode *inode, \
+    int first, int last);
+static void init_mount_table(void);
+static Mount *get_mount(mountHandle m);
+static void release_mount(mountHandle m);
+static void free_open_table(Mount *fs);
+static int sync_mount(Mount *fs);
+static void copy_name(char *dest, char *name);
+
+static uint32_t get_u32(uint8_t *buf)
+{
+    uint32_t value;
+    memcpy(&value, buf, sizeof(uint32_t));
+    return value;
+}
 
-// make dynamic resource table
-LinkedList *resource_table = NULL;
+static void put_u32(uint8_t *buf, uint32_t value)
+{
+    memcpy(buf, &value, sizeof(uint32_t));
+}
 
-// make a new file system
-int tfs_mkfs(char *filename, int nBytes)
+static int64_t get_i64(uint8_t *buf)
 {
-    if (mounted_disk >= 0)
-    {
-        int err = tfs_unmount();
-        if (err < 0)
-            return err; // unmount error
-    }
+    int64_t value;
+    memcpy(&value, buf, sizeof(int64_t));
+    return value;
+}
+
+static void put_i64(uint8_t *buf, int64_t value)
+{
+    memcpy(buf, &value, sizeof(int64_t));
+}
+
+// copy a name of up to MAX_FILENAME_LEN characters into an unterminated
+// name field, padding it with null
+static void copy_name(char *dest, char *name)
+{
+    memset(dest, 0, MAX_FILENAME_LEN);
+    memcpy(dest, name, strnlen(name, MAX_FILENAME_LEN));
+}
+
+// make a new file system with the default block size
+int tfs_mkfs(char *filename, int64_t nBytes)
+{
+    return tfs_mkfs_blocksize(filename, nBytes, BLOCKSIZE);
+}
 
-    if (resource_table == NULL)
-        resource_table = create_linked_list();
+// make a new file system with blockSize bytes per block, a power of two
+// between MIN_BLOCKSIZE and MAX_BLOCKSIZE. the default mount is unmounted
+// first, other mounts are left alone so they must not be on filename
+int tfs_mkfs_blocksize(char *filename, int64_t nBytes, int blockSize)
+{
+    uint64_t start = stat_clock();
+    Mount *fs = get_mount(DEFAULT_MOUNT);
+    pthread_rwlock_wrlock(&fs->fs_lock);
+    int err = 0;
+    if (fs->disk >= 0)
+        err = unmount_fs(fs);
+    if (err >= 0)
+        err = make_fs(filename, nBytes, blockSize);
+    pthread_rwlock_unlock(&fs->fs_lock);
+    return stat_call(CALL_MKFS, start, err);
+}
 
-    // create disk
-    int disk = openDisk(filename, nBytes);
+// tfs_mkfs_blocksize, once the default mount is unmounted
+static int make_fs(char *filename, int64_t nBytes, int blockSize)
+{
+    // create disk, every block starts out null
+    int disk = openDiskBlockSize(filename, nBytes, DISK_MODE_FD, blockSize);
     if (disk < 0)
     {
         return disk; // open disk error
     }
-    
+
     // make block buffer
-    uint8_t *block = (uint8_t *) malloc(BLOCKSIZE);
+    uint8_t *block = (uint8_t *) malloc(blockSize);
     if (block == NULL)
+    {
+        closeDisk(disk);
         return MALLOC_ERR; // malloc error
+    }
+
+    // the superblock, root directory, bit array and journal are never free
+    int n_blocks = (int) (nBytes / blockSize);
+    int start = BITMAP_START;
+    int offset = 0;
+    int bitmap_blocks = (n_blocks + BITS_PER_BITMAP_BLOCK(blockSize) - 1) / \
+        BITS_PER_BITMAP_BLOCK(blockSize);
+    int first_free = BITMAP_START + bitmap_blocks;
+    if (n_blocks <= INLINE_BITMAP_BITS(blockSize))
+    {
+        start = SUPERBLOCK;
+        offset = SB_INLINE_BITMAP_INDEX;
+        bitmap_blocks = 1;
+        first_free = BITMAP_START;
+    }
+    int journal_start = 0;
+    int journal_blocks = 0;
+    if (n_blocks >= JOURNAL_MIN_FS_BLOCKS)
+    {
+        journal_start = first_free;
+        journal_blocks = n_blocks / JOURNAL_FRACTION;
+        if (journal_blocks < JOURNAL_MIN_BLOCKS)
+            journal_blocks = JOURNAL_MIN_BLOCKS;
+        if (journal_blocks > JOURNAL_MAX_BLOCKS)
+            journal_blocks = JOURNAL_MAX_BLOCKS;
+        first_free += journal_blocks;
+    }
+    if (first_free > n_blocks)
+    {
+        free(block);
+        closeDisk(disk);
+        return INVALID_OP; // no room for the bit array
+    }
 
     // make superblock
+    memset(block, 0, blockSize);
     block[MAGIC_INDEX] = MAGIC; // magic number
     block[ROOT_INODE_INDEX] = ROOT_INODE; // block of root directory inode
-    
-    // block[2] to block[255]: bit array used to track free blocks
-    // each byte in this bit array is little endian
-    // 0 bit = free, 1 bit == not free
-    memset(&block[FREE_LIST_INDEX], 0, 254);
-    unfree_block(block, SUPERBLOCK);
-    unfree_block(block, ROOT_INODE);
+    put_u32(&block[SB_BLOCKS_INDEX], n_blocks);
+    put_u32(&block[SB_BITMAP_INDEX], start);
+    put_u32(&block[SB_BITMAP_BLOCKS_INDEX], bitmap_blocks);
+    put_u32(&block[SB_BLOCKSIZE_INDEX], blockSize);
+    put_u32(&block[SB_JOURNAL_INDEX], journal_start);
+    put_u32(&block[SB_JOURNAL_BLOCKS_INDEX], journal_blocks);
+    int i, j;
+    if (start == SUPERBLOCK)
+        for (j = 0; j < first_free; j++)
+            block[offset + j / BYTE] |= (ONE << j % BYTE);
 
     // write superblock to disk
     if (writeBlock(disk, SUPERBLOCK, block) < 0)
     {
+        free(block);
+        closeDisk(disk);
         return WRITE_ERR; // write error
     }
-    // empty block for root directory inode
-    memset(block, 0, BLOCKSIZE);
 
-    // make root directory inode
-    LinkedList *root_inode = create_linked_list();
-    memcpy(block, &root_inode, sizeof(LinkedList *));
-    
+    // make root directory inode: no entries and no continuation block
+    memset(block, 0, blockSize);
+
     // write root directory inode to disk
     if (writeBlock(disk, ROOT_INODE, block) < 0)
     {
-        free_linked_list(root_inode);
+        free(block);
+        closeDisk(disk);
         return WRITE_ERR; // write error
     }
 
-    if (closeDisk(disk) < 0)
+    // write the bit array blocks that cover the blocks in use, the rest
+    // of the bit array and the journal are already null
+    for (i = 0; start != SUPERBLOCK && i * BITS_PER_BITMAP_BLOCK(blockSize) < first_free; \
+        i++)
     {
-        free_linked_list(root_inode);
-        return CLOSE_ERR; // close error
+        memset(block, 0, blockSize);
+        for (j = 0; j < BITS_PER_BITMAP_BLOCK(blockSize); j++)
+            if (i * BITS_PER_BITMAP_BLOCK(blockSize) + j < first_free)
+                block[j / BYTE] |= (ONE << j % BYTE);
+        if (writeBlock(disk, BITMAP_START + i, block) < 0)
+        {
+            free(block);
+            closeDisk(disk);
+            return WRITE_ERR; // write error
+        }
     }
 
     // free stuff
     free(block);
 
+    if (closeDisk(disk) < 0)
+        return CLOSE_ERR; // close error
+
     // successful return
     return 0;
 }
 
-// mount a file system
+// mount a file system as the default mount
 int tfs_mount(char *filename)
+{
+    return tfs_mount_mode(filename, DISK_MODE_FD);
+}
+
+// mount a file system as the default mount using the given libDisk backend
+// (DISK_MODE_FD, DISK_MODE_MMAP or DISK_MODE_URING), unmounting whatever
+// the default mount had
+int tfs_mount_mode(char *filename, int mode)
+{
+    uint64_t start = stat_clock();
+    Mount *fs = get_mount(DEFAULT_MOUNT);
+    pthread_rwlock_wrlock(&fs->fs_lock);
+    int err = mount_fs(fs, filename, mode);
+    pthread_rwlock_unlock(&fs->fs_lock);
+    return stat_call(CALL_MOUNT, start, err);
+}
+
+// mount a file system alongside the ones already mounted, with its own
+// block cache and open file table
+// returns the handle the other tfsm_ calls take
+mountHandle tfsm_mount(char *filename, int mode)
+{
+    uint64_t start = stat_clock();
+    pthread_once(&table_once, init_mount_table);
+
+    // find a free slot, DEFAULT_MOUNT is kept for tfs_mount
+    pthread_mutex_lock(&table_lock);
+    mountHandle m;
+    for (m = DEFAULT_MOUNT + 1; m < MAX_MOUNTS; m++)
+        if (!mount_table[m].in_use)
+            break;
+    if (m < MAX_MOUNTS)
+        __atomic_store_n(&mount_table[m].in_use, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&table_lock);
+    if (m == MAX_MOUNTS)
+        return stat_call(CALL_MOUNT, start, OPEN_ERR); // too many mounts
+
+    Mount *fs = &mount_table[m];
+    pthread_rwlock_wrlock(&fs->fs_lock);
+    fs->sync_interval = DEFAULT_SYNC_INTERVAL;
+    int err = mount_fs(fs, filename, mode);
+    if (err < 0)
+        free_open_table(fs);
+    pthread_rwlock_unlock(&fs->fs_lock);
+    if (err < 0)
+    {
+        release_mount(m);
+        return stat_call(CALL_MOUNT, start, err); // open disk, read error or invalid disk
+    }
+    return stat_call(CALL_MOUNT, start, m);
+}
+
+// tfs_mount_mode and tfsm_mount, with fs_lock held exclusive
+static int mount_fs(Mount *fs, char *filename, int mode)
 {
     int err;
 
     // unmount a disk if one is already mounted
-    if (mounted_disk >= 0)
+    if (fs->disk >= 0)
     {
-        err = tfs_unmount();
+        err = unmount_fs(fs);
         if (err < 0)
             return err; // unmount error
     }
 
+    // every mount has its own open file table, kept until the handle is
+    // given back so descriptors aren't reused across remounts
+    if (fs->resource_table == NULL)
+        fs->resource_table = create_resource_table();
+    if (fs->open_index == NULL)
+        fs->open_index = create_hash_index();
+    if (fs->resource_table == NULL || fs->open_index == NULL)
+        return MALLOC_ERR; // malloc error
+
     // open mounted file
-    mounted_disk = openDisk(filename, 0);
-    if (mounted_disk < 0)
-        return mounted_disk; // open disk error
+    err = openDiskMode(filename, 0, mode);
+    if (err < 0)
+        return err; // open disk error
+    fs->disk = err;
 
-    // make block buffer
-    uint8_t *block = (uint8_t *) malloc(BLOCKSIZE);
-    if (block == NULL)
+    // reopen the disk with the block size of the file system
+    err = read_block_size(fs);
+    if (err >= 0 && err != BLOCKSIZE)
+    {
+        closeDisk(fs->disk);
+        fs->disk = openDiskBlockSize(filename, 0, mode, err);
+        if (fs->disk < 0)
+        {
+            err = fs->disk;
+            fs->disk = -1;
+            return err; // open disk error
+        }
+    }
+    if (err < 0)
+    {
+        unmount_fs(fs);
+        return err; // read error or invalid disk
+    }
+    fs->block_size = err;
+
+    // pools for the directory, block maps and open files
+    fs->node_pool = create_pool(sizeof(Node));
+    fs->dir_pool = create_pool(sizeof(Root_inode_entry));
+    fs->spill_pool = create_pool(sizeof(File_inode_entry));
+    fs->open_pool = create_pool(sizeof(Resource_table_entry));
+    if (fs->node_pool == NULL || fs->dir_pool == NULL || fs->spill_pool == NULL || \
+        fs->open_pool == NULL)
+    {
+        unmount_fs(fs);
         return MALLOC_ERR; // malloc error
+    }
 
-    // check the file system is valid
-    err = readBlock(mounted_disk, SUPERBLOCK, block);
-    
+    // finish or throw away the last metadata commit before anything reads
+    // the metadata
+    err = open_journal(fs);
     if (err < 0)
     {
-        free(block);
-        return err; // read error
+        unmount_fs(fs);
+        return err; // read error or invalid journal
     }
-    if ((block[MAGIC_INDEX] != MAGIC) || (block[ROOT_INODE_INDEX] != ROOT_INODE))
+
+    // check the file system is valid and load the free block bit array
+    err = load_free_map(fs);
+    if (err < 0)
     {
-        free(block);
-        return INVALID_DISK; // Disk is invalid
+        unmount_fs(fs);
+        return err; // read error or invalid disk
     }
 
-    // free block buffer
-    free(block);
+    // load the root directory
+    err = load_directory(fs);
+    if (err < 0)
+    {
+        unmount_fs(fs);
+        return err; // read error or invalid directory
+    }
+
+    fs->dir_dirty = 0;
+    fs->delayed_blocks = 0;
+    fs->reserved_blocks = 0;
+    fs->last_sync = time(NULL);
 
     // successful return
     return 0;
@@ -120,1049 +364,2965 @@ int tfs_mount(char *filename)
 
 int tfs_unmount(void)
 {
-    if (mounted_disk >= 0)
+    return tfsm_unmount(DEFAULT_MOUNT);
+}
+
+// unmount a file system, its handle is free for the next tfsm_mount
+int tfsm_unmount(mountHandle m)
+{
+    uint64_t start = stat_clock();
+    Mount *fs = get_mount(m);
+    if (fs == NULL)
+        return stat_call(CALL_UNMOUNT, start, INVALID_OP); // invalid handle
+
+    pthread_rwlock_wrlock(&fs->fs_lock);
+    int err = unmount_fs(fs);
+    if (m != DEFAULT_MOUNT)
+        free_open_table(fs);
+    pthread_rwlock_unlock(&fs->fs_lock);
+    if (m != DEFAULT_MOUNT)
+        release_mount(m);
+    return stat_call(CALL_UNMOUNT, start, err);
+}
+
+// tfsm_unmount, with fs_lock held exclusive
+static int unmount_fs(Mount *fs)
+{
+    // the files are closed, so preallocated blocks they don't keep go back.
+    // if that fails they just stay with the file
+    if (fs->disk >= 0 && fs->resource_table != NULL)
+    {
+        int fd;
+        for (fd = 0; fd < fs->resource_table->capacity; fd++)
+            if (fs->resource_table->slots[fd] != NULL)
+                release_prealloc(fs, fs->resource_table->slots[fd]);
+    }
+
+    // write back the superblock and directory
+    int sync_err = sync_fs(fs);
+    fs->dir_dirty = 0;
+
+    // close all files open on the mounted disk
+    if (fs->resource_table != NULL)
+    {
+        int fd;
+        for (fd = 0; fd < fs->resource_table->capacity; fd++)
+            if (fs->resource_table->slots[fd] != NULL)
+                remove_resource_table_entry(fs, fs->resource_table->slots[fd]);
+    }
+
+    // drop the in memory directory
+    if (fs->root_dir != NULL)
+    {
+        free_linked_list(fs->root_dir);
+        fs->root_dir = NULL;
+    }
+    if (fs->dir_spill != NULL)
+    {
+        free_linked_list(fs->dir_spill);
+        fs->dir_spill = NULL;
+    }
+    if (fs->dir_index != NULL)
+    {
+        free_hash_index(fs->dir_index);
+        fs->dir_index = NULL;
+    }
+    free_free_map(fs->free_map);
+    fs->free_map = NULL;
+    free_journal(fs->journal);
+    fs->journal = NULL;
+    free(fs->freed_blocks);
+    fs->freed_blocks = NULL;
+    fs->n_freed = 0;
+    fs->freed_capacity = 0;
+    fs->freed_mark = 0;
+    free(fs->superblock);
+    fs->superblock = NULL;
+
+    // everything left in the pools went with the directory and open files
+    free_pool(fs->node_pool);
+    free_pool(fs->dir_pool);
+    free_pool(fs->spill_pool);
+    free_pool(fs->open_pool);
+    fs->node_pool = NULL;
+    fs->dir_pool = NULL;
+    fs->spill_pool = NULL;
+    fs->open_pool = NULL;
+
+    if (fs->disk >= 0)
     {
         // close mounted file
-        int err = closeDisk(mounted_disk);
+        int err = closeDisk(fs->disk);
+        fs->disk = -1;
         if (err < 0)
             return err; // close error
-        mounted_disk = -1;
-        
     }
+    if (sync_err < 0 && sync_err != INVALID_OP)
+        return sync_err; // write error
+
     // successful return
     return 0;
 }
 
 fileDescriptor tfs_open(char *name)
 {
-    // check if filename is valid
-    if (strlen(name) > MAX_FILENAME_LEN)
-        return INVALID_OP; // invalid filename length
+    return tfsm_open(DEFAULT_MOUNT, name);
+}
 
-    // check if the file is already open
-    Node *cur = resource_table->front;
-    while (cur->next != NULL)
-    {
-        // if file is already open
-        if (!strncmp(name, ((Resource_table_entry *) cur->next->data)->filename, MAX_FILENAME_LEN))
-            return ((Resource_table_entry *) cur->next->data)->fd; // return open file descriptor
-        cur = cur->next;
-    }
+fileDescriptor tfsm_open(mountHandle m, char *name)
+{
+    uint64_t start = stat_clock();
+    Mount *fs = get_mount(m);
+    if (fs == NULL)
+        return stat_call(CALL_OPEN, start, INVALID_OP); // invalid handle
 
-    // check if the file exists on the mounted disk
-    // make block buffer
-    uint8_t *root_inode = (uint8_t *) malloc(BLOCKSIZE);
-    if (root_inode == NULL)
-        return MALLOC_ERR; // malloc error
-    
-    // read the block containing the root directory inode
-    int err = readBlock(mounted_disk, ROOT_INODE, root_inode);
-    if (err < 0)
-    {
-        free(root_inode);
-        return err; // read error
-    }
-    // iterate through root directory inode to see if file exists
-    cur = (*((LinkedList **) root_inode))->front;
-    while (cur->next != NULL)
+    while (1)
     {
-        if (!strncmp(name, ((Root_inode_entry *) cur->next->data)->filename, MAX_FILENAME_LEN))
+        pthread_rwlock_wrlock(&fs->fs_lock);
+        fileDescriptor fd = open_file(fs, name);
+        int retry = fd == DISK_FULL && freed_blocks_waiting(fs);
+        pthread_rwlock_unlock(&fs->fs_lock);
+        if (!retry)
         {
-            free(root_inode);
-            break;
+            if (fd < 0)
+                return stat_call(CALL_OPEN, start, fd); // open error
+
+            // write back the superblock and directory if a sync is due
+            int err = sync_if_due(fs);
+            if (err < 0)
+                return stat_call(CALL_OPEN, start, err); // write error
+            return stat_call(CALL_OPEN, start, fd);
         }
-        cur = cur->next;
+
+        // blocks freed since the last sync can be used once it commits
+        int err = sync_mount(fs);
+        if (err < 0)
+            return stat_call(CALL_OPEN, start, err); // write error
     }
+}
 
-    // if file does not exist, create file
-    if (cur->next == NULL)
-    {   
-        // create buffer for superblock
-        uint8_t *superblock = (uint8_t *) malloc(BLOCKSIZE);
-        if (superblock == NULL)
-            return MALLOC_ERR; // malloc error
+// tfs_open, with fs_lock held exclusive
+static fileDescriptor open_file(Mount *fs, char *name)
+{
+    int err;
 
-        // read superblock
-        err = readBlock(mounted_disk, SUPERBLOCK, superblock);
-        if (err < 0)
-        {
-            free(root_inode);
-            free(superblock);
-            return err; // read error
-        }
+    // check a disk is mounted
+    if (fs->disk < 0)
+        return INVALID_OP; // no disk mounted
+
+    // check if filename is valid
+    if (strlen(name) > MAX_FILENAME_LEN)
+        return INVALID_OP; // invalid filename length
 
+    // check if the file is already open
+    int probes;
+    Resource_table_entry *open_entry = (Resource_table_entry *) \
+        hash_find_probes(fs->open_index, name_key(name), &probes);
+    stat_add(STAT_TABLE_LOOKUPS, 1);
+    stat_add(STAT_TABLE_SCANNED, probes);
+    if (open_entry != NULL)
+        return open_entry->fd; // return open file descriptor
+
+    // if file does not exist, create file. the free map changes are kept
+    // once the file is open, until then a failure takes the file back out
+    Root_inode_entry *root_inode_entry = find_root_inode_entry(fs, name);
+    int created = root_inode_entry == NULL;
+    int prealloc_blocks = 0;
+    if (created)
+    {
         // find a free block and unfree it
-        int new_addr = unfree_first_free_block(superblock);
+        begin_free_map(fs);
+        int new_addr = unfree_first_free_block(fs);
         if (new_addr < 0)
         {
-            free(root_inode);
-            free(superblock);
-            return new_addr; // no free blocks
+            discard_free_map(fs);
+            return new_addr; // no free blocks or malloc error
         }
 
-        // write superblock back to disk
-        err = writeBlock(mounted_disk, SUPERBLOCK, superblock);
-        if (err < 0)
-        {
-            free(root_inode);
-            free(superblock);
-            return err; // write error
-        }
-
-        // free superblock
-        free(superblock);
-
         // create new root directory inode entry
-        Root_inode_entry *root_inode_entry = (Root_inode_entry *) \
-            malloc(sizeof(Root_inode_entry));
+        root_inode_entry = (Root_inode_entry *) \
+            alloc_data(fs->root_dir, sizeof(Root_inode_entry));
         if (root_inode_entry == NULL)
         {
-            free(root_inode);
+            discard_free_map(fs);
             return MALLOC_ERR; // malloc error
         }
-        strncpy(root_inode_entry->filename, name, MAX_FILENAME_LEN);
+        copy_name(root_inode_entry->filename, name);
         root_inode_entry->addr = new_addr;
         root_inode_entry->size = 0;
 
-        // add new root inode entry to linked list
-        if (append(*((LinkedList **) root_inode), root_inode_entry) < 0)
+        // add new root inode entry to the directory
+        if (add_root_inode_entry(fs, root_inode_entry) < 0)
         {
-            free(root_inode);
+            free_data(fs->root_dir, root_inode_entry);
+            discard_free_map(fs);
             return MALLOC_ERR; // linked list malloc error
         }
-        
-        // free root inode
-        free(root_inode);
-
-        // add file inode
-        uint8_t *file_inode = (uint8_t *) malloc(BLOCKSIZE);
-        if (file_inode == NULL)
-            return MALLOC_ERR; // malloc error
-        
-        memset(file_inode, 0, BLOCKSIZE);
-        LinkedList *file_inode_entry = create_linked_list();
-        memcpy(file_inode, &file_inode_entry, sizeof(LinkedList *));
 
-        // add creation time
-        time((time_t *)&file_inode[sizeof(LinkedList *)]);
+        // the directory may need another block, it is written at the
+        // next sync
+        err = resize_chain(fs, fs->dir_spill, dir_spill_needed(fs));
+        if (err < 0)
+        {
+            discard_new_file(fs, root_inode_entry);
+            return err; // disk full or malloc error
+        }
 
-        // add access time
-        time((time_t *)&file_inode[sizeof(LinkedList *) + sizeof(time_t *)]);
+        // make file inode with an empty block map
+        File_inode file_inode;
+        err = create_file_inode(fs, &file_inode);
+        if (err < 0)
+        {
+            discard_new_file(fs, root_inode_entry);
+            return err; // malloc error
+        }
 
-        // add modification time
-        time((time_t *)&file_inode[sizeof(LinkedList *) + 2 * sizeof(time_t *)]);
+        // add creation, access and modification time
+        file_inode.ctime = time(NULL);
+        file_inode.atime = file_inode.ctime;
+        file_inode.mtime = file_inode.ctime;
 
         // write file inode entry to disk
-        err = writeBlock(mounted_disk, new_addr, file_inode);
+        err = write_file_inode(fs, new_addr, &file_inode);
+        free_file_inode(&file_inode);
         if (err < 0)
         {
-            free(file_inode);
-            return err; // write error
+            discard_new_file(fs, root_inode_entry);
+            return err; // malloc or write error
         }
-
-        // free block
-        free(file_inode);
     }
-    
+    else
+    {
+        // blocks past the end of the file were kept by a tfs_fallocate
+        File_inode file_inode;
+        err = read_file_inode(fs, root_inode_entry->addr, &file_inode);
+        if (err < 0)
+            return err; // read error
+        prealloc_blocks = file_inode.n_blocks;
+        free_file_inode(&file_inode);
+        if ((int64_t) prealloc_blocks * fs->block_size < root_inode_entry->size + \
+            (int64_t) fs->block_size)
+            prealloc_blocks = 0; // none past the last block
+    }
+
     // create new entry for resource table
     Resource_table_entry *resource_table_entry = (Resource_table_entry *) \
-        malloc(sizeof(Resource_table_entry));
+        pool_alloc(fs->open_pool);
     if (resource_table_entry == NULL)
-        return MALLOC_ERR; // malloc error
-    strncpy(resource_table_entry->filename, name, MAX_FILENAME_LEN);
-
-    if (resource_table->size == 0)
-        resource_table_entry->fd = 0;
-    else
     {
-        resource_table_entry->fd = \
-            (((Resource_table_entry *) resource_table->back->data)->fd) + 1;
+        if (created)
+            discard_new_file(fs, root_inode_entry);
+        return MALLOC_ERR; // malloc error
     }
+    copy_name(resource_table_entry->filename, name);
+    pthread_mutex_init(&resource_table_entry->lock, NULL);
     resource_table_entry->fp = 0;
-    
+    resource_table_entry->ra_next = 0;
+    resource_table_entry->ra_window = 0;
+    resource_table_entry->ra_end = 0;
+    resource_table_entry->read_block = NULL;
+    resource_table_entry->read_index = -1;
+    resource_table_entry->delay_data = NULL;
+    resource_table_entry->delay_block = -1;
+    resource_table_entry->delay_count = 0;
+    resource_table_entry->delay_capacity = 0;
+    resource_table_entry->delay_reserved = 0;
+    resource_table_entry->prealloc_blocks = prealloc_blocks;
+    resource_table_entry->prealloc_keep = prealloc_blocks > 0;
+    resource_table_entry->inode_addr = root_inode_entry->addr;
+    resource_table_entry->size = root_inode_entry->size;
+
+    // add new entry to the resource table, this picks its descriptor
+    err = add_resource_table_entry(fs, resource_table_entry);
+    if (err < 0)
+    {
+        pthread_mutex_destroy(&resource_table_entry->lock);
+        pool_free(fs->open_pool, resource_table_entry);
+        if (created)
+            discard_new_file(fs, root_inode_entry);
+        return err; // malloc error
+    }
 
-    // append new entry to resource table linked list
-    if (append(resource_table, resource_table_entry) < 0)
-        return MALLOC_ERR; // linked list malloc error
+    // the new file is open, keep it
+    if (created)
+    {
+        end_free_map(fs);
+        fs->dir_dirty = 1;
+    }
 
     // successful return
     return resource_table_entry->fd;
 }
 
+// take a file open_file is creating back out of the directory, with any
+// directory block it needed, and undo its allocations. the journal drops
+// the inode written to its block, which can go to another file now
+static void discard_new_file(Mount *fs, Root_inode_entry *root_inode_entry)
+{
+    if (fs->journal != NULL)
+    {
+        pthread_mutex_lock(&fs->meta_lock);
+        journal_forget(fs->journal, root_inode_entry->addr);
+        pthread_mutex_unlock(&fs->meta_lock);
+    }
+    remove_root_inode_entry(fs, root_inode_entry);
+    trim_chain(fs->dir_spill, dir_spill_needed(fs));
+    discard_free_map(fs);
+}
+
 int tfs_close(fileDescriptor FD)
 {
-    // find entry in resource table
-    Node *cur = resource_table->front;
-    while (cur != NULL && cur->next != NULL)
+    return tfsm_close(DEFAULT_MOUNT, FD);
+}
+
+int tfsm_close(mountHandle m, fileDescriptor FD)
+{
+    uint64_t start = stat_clock();
+    Mount *fs = get_mount(m);
+    if (fs == NULL)
+        return stat_call(CALL_CLOSE, start, INVALID_OP); // invalid handle
+
+    // find entry in resource table, the file stays open if its delayed
+    // blocks can't be written
+    pthread_rwlock_wrlock(&fs->fs_lock);
+    Resource_table_entry *entry = get_resource_table_entry(fs, FD);
+    int err = entry == NULL ? NO_FD : flush_delayed(fs, entry);
+    if (err >= 0)
+        err = release_prealloc(fs, entry);
+    if (err >= 0)
+        remove_resource_table_entry(fs, entry);
+    pthread_rwlock_unlock(&fs->fs_lock);
+    if (err < 0)
+        return stat_call(CALL_CLOSE, start, err); // not open, disk full or I/O error
+    return stat_call(CALL_CLOSE, start, 0);
+}
+
+int tfs_write(fileDescriptor FD, char *buffer, int size)
+{
+    return tfsm_write(DEFAULT_MOUNT, FD, buffer, size);
+}
+
+int tfsm_write(mountHandle m, fileDescriptor FD, char *buffer, int size)
+{
+    uint64_t start = stat_clock();
+    Mount *fs = get_mount(m);
+    if (fs == NULL)
+        return stat_call(CALL_WRITE, start, INVALID_OP); // invalid handle
+
+    while (1)
     {
-        if (((Resource_table_entry *) cur->next->data)->fd == FD)
+        // check if file exists and is open
+        Resource_table_entry *entry = lock_file(fs, FD);
+        if (entry == NULL)
+            return stat_call(CALL_WRITE, start, NO_FD); // file not open or doesn't exist
+        int err = write_file(fs, entry, buffer, size);
+        int retry = err == DISK_FULL && freed_blocks_waiting(fs);
+        unlock_file(fs, entry);
+        if (!retry)
         {
-            delete(resource_table, cur);
-            return 0;
+            if (err < 0)
+                return stat_call(CALL_WRITE, start, err); // full, malloc or write error
+
+            // write back the superblock and directory if a sync is due
+            return stat_call(CALL_WRITE, start, sync_if_due(fs));
         }
-        cur = cur->next;
+
+        // blocks freed since the last sync can be used once it commits
+        err = sync_mount(fs);
+        if (err < 0)
+            return stat_call(CALL_WRITE, start, err); // write error
     }
-    return NO_FD; // file not open or doesn't exist
 }
 
-int tfs_write(fileDescriptor FD, char *buffer, int size)
+// tfs_write, with the file locked
+static int write_file(Mount *fs, Resource_table_entry *resource_table_entry, \
+    char *buffer, int size)
 {
     int err;
-    // create buffer for file name
-    char *filename = (char *) malloc(MAX_FILENAME_LEN);
-    if (filename == NULL)
-        return MALLOC_ERR; // malloc error
+    int file_inode_addr = resource_table_entry->inode_addr;
 
-    // check if file exists and is open
-    err = get_filename(FD, filename);
+    // read the file inode
+    File_inode file_inode;
+    err = read_file_inode(fs, file_inode_addr, &file_inode);
     if (err < 0)
-    {
-        free(filename);
-        return err; // file not open or doesn't exist
-    }
+        return err; // read error
 
-    // create superblock buffer
-    uint8_t *superblock = (uint8_t *) malloc(BLOCKSIZE);
-    if (superblock == NULL)
-    {
-        free(filename);
-        return MALLOC_ERR; // malloc error
-    }
+    // a file small enough is kept in memory until it is flushed, the blocks
+    // it has on disk stay with it until then
+    int n_blocks = (int) (((int64_t) size + fs->block_size - 1) / fs->block_size);
+    if (n_blocks <= DELAY_FILE_BYTES / fs->block_size)
+        err = delay_write(fs, resource_table_entry, &file_inode, 0, buffer, size, 0, \
+            size);
+    else
+        err = 1; // too big to keep in memory
+    if (err == 1)
+        err = write_file_blocks(fs, resource_table_entry, &file_inode, buffer, size);
+    free_file_inode(&file_inode);
+    if (err < 0)
+        return err; // disk full, malloc or write error
+
+    // update number of bytes written to, other files are written under the
+    // shared fs_lock at the same time so the directory entry changes under
+    // meta_lock
+    Root_inode_entry *root_inode_entry = \
+        find_root_inode_entry(fs, resource_table_entry->filename);
+    resource_table_entry->size = size;
+    pthread_mutex_lock(&fs->meta_lock);
+    root_inode_entry->size = size;
+    fs->dir_dirty = 1;
+    pthread_mutex_unlock(&fs->meta_lock);
+
+    // move file pointer to front, the block kept for tfs_readByte and the
+    // blocks read ahead may have moved
+    resource_table_entry->fp = 0;
+    resource_table_entry->read_index = -1;
+    resource_table_entry->ra_next = 0;
+    resource_table_entry->ra_window = 0;
+    resource_table_entry->ra_end = 0;
+
+    // successful return
+    return 0;
+}
 
-    // read superblock
-    err = readBlock(mounted_disk, SUPERBLOCK, superblock);
+// write the whole file straight to its blocks, dropping any delayed blocks
+static int write_file_blocks(Mount *fs, Resource_table_entry *resource_table_entry, \
+    File_inode *file_inode, char *buffer, int size)
+{
+    int err;
+    discard_delayed(fs, resource_table_entry);
+
+    // update modification time
+    file_inode->mtime = time(NULL);
+
+    // free or allocate blocks so the file has exactly the blocks it needs,
+    // and those of a tfs_fallocate. new blocks are taken in runs
+    begin_free_map(fs);
+    int n_blocks = (int) (((int64_t) size + fs->block_size - 1) / fs->block_size);
+    err = truncate_file_blocks(fs, file_inode, n_blocks > \
+        resource_table_entry->prealloc_blocks ? n_blocks : \
+        resource_table_entry->prealloc_blocks);
+    if (err >= 0)
+        err = grow_file_blocks(fs, file_inode, n_blocks);
     if (err < 0)
     {
-        free(filename);
-        free(superblock);
-        return err; // read error
+        discard_free_map(fs);
+        return err; // disk full or malloc error
     }
 
-    // create root directory inode buffer
-    uint8_t *root_inode = (uint8_t *) malloc(BLOCKSIZE);
-    if (root_inode == NULL)
+    // list the blocks to write, full blocks come straight from the
+    // caller's buffer and a partial last block is filled in with null
+    int *addrs = (int *) malloc((n_blocks + 1) * sizeof(int));
+    void **blocks = (void **) malloc((n_blocks + 1) * sizeof(void *));
+    uint8_t *temp = NULL;
+    if (size % fs->block_size != 0)
+        temp = (uint8_t *) calloc(fs->block_size, 1);
+    if (addrs == NULL || blocks == NULL || (size % fs->block_size != 0 && temp == NULL))
     {
-        free(filename);
-        free(superblock);
+        free(addrs);
+        free(blocks);
+        free(temp);
+        discard_free_map(fs);
         return MALLOC_ERR; // malloc error
     }
-    
-    // read the block containing the root directory inode
-    err = readBlock(mounted_disk, ROOT_INODE, root_inode);
-    if (err < 0)
-    {
-        free(filename);
-        free(superblock);
-        free(root_inode);
-        return err; // read error
-    }
-
-    // find block with file inode
-    int file_inode_addr = 0;
-    Node *root_inode_entry = (*((LinkedList **) root_inode))->front;
-    while (root_inode_entry->next != NULL)
+    int bytes_written = 0;
+    int n = 0;
+    int i, j;
+    for (i = 0; i < file_inode->n_extents; i++)
     {
-        if (!strncmp(((Root_inode_entry *) \
-            root_inode_entry->next->data)->filename, filename, \
-            MAX_FILENAME_LEN))
+        for (j = 0; j < file_inode->extents[i].length; j++)
         {
-            file_inode_addr = \
-                ((Root_inode_entry *) root_inode_entry->next->data)->addr;
-            root_inode_entry = root_inode_entry->next;
-            break;
+            addrs[n] = file_inode->extents[i].start + j;
+            if (size - bytes_written >= fs->block_size)
+            {
+                blocks[n] = &buffer[bytes_written];
+                bytes_written += fs->block_size;
+            }
+            else
+            {
+                memcpy(temp, &buffer[bytes_written], size - bytes_written);
+                blocks[n] = temp;
+                bytes_written = size;
+            }
+            n++;
         }
-        root_inode_entry = root_inode_entry->next;
     }
 
-    // free stuff
-    free(filename);
-    free(root_inode);
+    // write the data, adjacent blocks go out in a single call
+    err = writeBlocks(fs->disk, n, addrs, blocks);
+    free(addrs);
+    free(blocks);
+    free(temp);
+    if (err < 0)
+    {
+        discard_free_map(fs);
+        return err; // write error
+    }
 
-    // create file inode buffer
-    uint8_t *file_inode = (uint8_t *) malloc(BLOCKSIZE);
-    if (file_inode == NULL)
-        return MALLOC_ERR; // malloc error
-    
-    // read the block containing the file inode
-    err = readBlock(mounted_disk, file_inode_addr, file_inode);
+    // write the file inode, the block map may have grown or shrunk
+    err = write_file_inode(fs, resource_table_entry->inode_addr, file_inode);
     if (err < 0)
     {
-        free(superblock);
-        free(file_inode);
-        return err; // read error
+        discard_free_map(fs);
+        return err; // disk full or write error
     }
+    end_free_map(fs);
 
-    // update modification time
-    time((time_t *)&file_inode[sizeof(LinkedList *) + 2 * sizeof(time_t *)]);
+    // successful return
+    return 0;
+}
 
-    // compare new size to old size
-    int bytes_written = 0;
-    int new_free_block_addr = 0;
-    Node *cur = (*((LinkedList **) file_inode))->front;
+// write size bytes from buffer at offset without touching the rest of the
+// file. blocks are only allocated past EOF and the file pointer is unchanged
+int tfs_pwrite(fileDescriptor FD, char *buffer, int size, int offset)
+{
+    return tfsm_pwrite(DEFAULT_MOUNT, FD, buffer, size, offset);
+}
+
+int tfsm_pwrite(mountHandle m, fileDescriptor FD, char *buffer, int size, int offset)
+{
+    uint64_t start = stat_clock();
+    Mount *fs = get_mount(m);
+    if (fs == NULL)
+        return stat_call(CALL_PWRITE, start, INVALID_OP); // invalid handle
+    return stat_call(CALL_PWRITE, start, write_at(fs, FD, buffer, size, offset, 0));
+}
+
+// tfs_pwrite, or tfs_append if append is set. the end of the file is
+// found with the file locked, so appends from several threads don't
+// overwrite each other
+static int write_at(Mount *fs, fileDescriptor FD, char *buffer, int size, int offset, \
+    int append)
+{
     while (1)
     {
-        // if there are no more blocks allocated for the file
-        if (cur->next == NULL)
+        // check if file exists and is open
+        Resource_table_entry *entry = lock_file(fs, FD);
+        if (entry == NULL)
+            return NO_FD; // file not open or doesn't exist
+        int err = pwrite_file(fs, entry, buffer, size, append ? entry->size : offset);
+        int retry = err == DISK_FULL && freed_blocks_waiting(fs);
+        unlock_file(fs, entry);
+        if (!retry)
         {
-            // allocate a new free block to the file
-            new_free_block_addr = unfree_first_free_block(superblock);
-            if (new_free_block_addr < 0)
-            {
-                free(superblock);
-                free(file_inode);
-                return DISK_FULL; // no more disk space
-            }
-            // add a file inode entry
-            File_inode_entry *file_inode_entry = (File_inode_entry *) \
-                malloc(sizeof(File_inode_entry));
-            if (file_inode_entry == NULL)
-            {
-                free(superblock);
-                free(file_inode);
-                return MALLOC_ERR; // malloc error
-            }
-            file_inode_entry->addr = new_free_block_addr;
-            if (append(*((LinkedList **) file_inode), file_inode_entry) < 0)
-            {
-                free(superblock);
-                free(file_inode);
-                return MALLOC_ERR; // linked list malloc error
-            }
-        }
-
-        // write a full block
-        if (size - bytes_written >= BLOCKSIZE)
-        {
-            err = writeBlock(mounted_disk, ((File_inode_entry *) \
-                cur->next->data)->addr, &buffer[bytes_written]);
-            if (err < 0)
-            {
-                free(superblock);
-                free(file_inode);
-                return err; // write error
-            }
-            bytes_written += BLOCKSIZE;
-            cur = cur->next;
-        }
-        // write a partial block, then fill in rest of block with null
-        else if (size - bytes_written > 0)
-        {
-            uint8_t *temp = (uint8_t *) calloc(BLOCKSIZE, 1);
-            if (temp == NULL)
-            {
-                free(superblock);
-                free(file_inode);
-                return MALLOC_ERR; // calloc error
-            }
-            memcpy(temp, &buffer[bytes_written], size - bytes_written);
-            err = writeBlock(mounted_disk, ((File_inode_entry *) \
-                cur->next->data)->addr, &buffer[bytes_written]);
             if (err < 0)
-            {
-                free(temp);
-                free(superblock);
-                free(file_inode);
-                return err; // write error
-            }
-            free(temp);
-            bytes_written = size;
-            cur = cur->next;
-        }
+                return err; // invalid range, disk full or write error
 
-        // done writing
-        if (bytes_written == size)
-        {
-            while (cur->next != NULL)
-            {
-                free_block(superblock, \
-                    ((File_inode_entry *) cur->next->data)->addr);
-                delete(*((LinkedList **) file_inode), cur);
-            }
-            break;
+            // write back the superblock and directory if a sync is due
+            return sync_if_due(fs);
         }
+
+        // blocks freed since the last sync can be used once it commits
+        err = sync_mount(fs);
+        if (err < 0)
+            return err; // write error
     }
+}
 
-    free(file_inode);
-    err = writeBlock(mounted_disk, SUPERBLOCK, superblock);
-    if (err < 0)
+// tfs_pwrite, with the file locked
+static int pwrite_file(Mount *fs, Resource_table_entry *resource_table_entry, \
+    char *buffer, int size, int offset)
+{
+    int err;
+
+    // writes may extend the file but not leave a hole past EOF
+    if (size < 0 || offset < 0 || offset > resource_table_entry->size)
+        return INVALID_OP; // invalid size or offset
+    if (size > INT32_MAX - offset)
+        return INVALID_OP; // file would be too large
+    if (size == 0)
+        return 0; // nothing to write
+
+    // drop the block kept for tfs_readByte if the range covers it
+    int read_index = resource_table_entry->read_index;
+    if (read_index >= offset / fs->block_size && \
+        read_index <= (int) (((int64_t) offset + size - 1) / fs->block_size))
+        resource_table_entry->read_index = -1;
+
+    // a write in or after the last block of the file goes to the delayed
+    // blocks, which then run from the block it starts in to the end of the
+    // file. delayed blocks before the write are flushed first
+    int first = offset / fs->block_size;
+    int new_size = offset + size > resource_table_entry->size ? \
+        offset + size : resource_table_entry->size;
+    int file_blocks = (int) (((int64_t) resource_table_entry->size + \
+        fs->block_size - 1) / fs->block_size);
+    int new_blocks = (int) (((int64_t) new_size + fs->block_size - 1) / fs->block_size);
+    int delay_limit = DELAY_FILE_BYTES / fs->block_size;
+    if (resource_table_entry->delay_block >= 0 && \
+        (first < resource_table_entry->delay_block || \
+        new_blocks - resource_table_entry->delay_block > delay_limit))
+    {
+        err = flush_delayed(fs, resource_table_entry);
+        if (err < 0)
+            return err; // disk full, malloc or write error
+    }
+    int start = resource_table_entry->delay_block >= 0 ? \
+        resource_table_entry->delay_block : first;
+    err = 1;
+    if ((resource_table_entry->delay_block >= 0 || first >= file_blocks - 1) && \
+        new_blocks - start <= delay_limit)
     {
-        free(superblock);
-        return err; // write error
+        File_inode file_inode;
+        err = read_file_inode(fs, resource_table_entry->inode_addr, &file_inode);
+        if (err < 0)
+            return err; // read error
+        err = delay_write(fs, resource_table_entry, &file_inode, start, buffer, size, \
+            offset, new_size);
+        free_file_inode(&file_inode);
+        if (err < 0)
+            return err; // disk full, malloc or read error
     }
 
-    // free superblock
-    free(superblock);
+    // otherwise the range is written to its blocks, after the delayed
+    // blocks if the mount had no room for more
+    if (err == 1)
+    {
+        err = flush_delayed(fs, resource_table_entry);
+        if (err >= 0)
+            err = pwrite_file_blocks(fs, resource_table_entry, buffer, size, offset);
+        if (err < 0)
+            return err; // disk full, malloc, read or write error
+    }
 
-    // update number of bytes written to 
-    ((Root_inode_entry *) root_inode_entry->data)->size = bytes_written;
-    
-    // move file pointer to front
-    cur = resource_table->front;
-    while (cur->next != NULL)
+    // update the size if the file grew
+    if (new_size > resource_table_entry->size)
     {
-        if (((Resource_table_entry *) cur->next->data)->fd == FD)
-        {
-            ((Resource_table_entry *) cur->next->data)->fp = 0;
-            break;
-        }
-        cur = cur->next;
+        Root_inode_entry *root_inode_entry = \
+            find_root_inode_entry(fs, resource_table_entry->filename);
+        resource_table_entry->size = new_size;
+        pthread_mutex_lock(&fs->meta_lock);
+        root_inode_entry->size = new_size;
+        fs->dir_dirty = 1;
+        pthread_mutex_unlock(&fs->meta_lock);
     }
 
     // successful return
     return 0;
 }
 
-int tfs_delete(fileDescriptor FD)
+// tfs_pwrite straight to the blocks of a file with no delayed blocks
+static int pwrite_file_blocks(Mount *fs, Resource_table_entry *resource_table_entry, \
+    char *buffer, int size, int offset)
 {
     int err;
-    // create buffer for file name
-    char *filename = (char *) malloc(MAX_FILENAME_LEN);
-    if (filename == NULL)
-        return MALLOC_ERR; // malloc error
 
-    // check if file exists and is open
-    err = get_filename(FD, filename);
+    // read the file inode
+    int file_inode_addr = resource_table_entry->inode_addr;
+    File_inode file_inode;
+    err = read_file_inode(fs, file_inode_addr, &file_inode);
     if (err < 0)
-    {
-        free(filename);
-        return err; // file not open or doesn't exist
-    }
+        return err; // read error
+
+    // update modification time
+    file_inode.mtime = time(NULL);
 
-    // create superblock buffer
-    uint8_t *superblock = (uint8_t *) malloc(BLOCKSIZE);
-    if (superblock == NULL)
+    // allocate blocks past EOF, writes inside the file leave the free map
+    // alone and don't take its lock
+    int old_n_blocks = file_inode.n_blocks;
+    int n_blocks = (int) (((int64_t) offset + size + fs->block_size - 1) / fs->block_size);
+    int allocating = n_blocks > old_n_blocks;
+    if (allocating)
     {
-        free(filename);
-        return MALLOC_ERR; // malloc error
+        begin_free_map(fs);
+        err = grow_file_blocks(fs, &file_inode, n_blocks);
+        if (err < 0)
+        {
+            discard_free_map(fs);
+            free_file_inode(&file_inode);
+            return err; // disk full or malloc error
+        }
     }
 
-    // read superblock
-    err = readBlock(mounted_disk, SUPERBLOCK, superblock);
-    if (err < 0)
+    // find the extent holding the first block
+    int index = offset / fs->block_size;
+    int extent = find_extent(&file_inode, index);
+    if (extent < 0)
     {
-        free(filename);
-        free(superblock);
-        return err; // read error
+        if (allocating)
+            discard_free_map(fs);
+        free_file_inode(&file_inode);
+        return READ_ERR; // the inode lists fewer blocks than the file size
     }
+    int block = index - file_inode.extents[extent].logical;
 
-    // create root directory inode buffer
-    uint8_t *root_inode = (uint8_t *) malloc(BLOCKSIZE);
-    if (root_inode == NULL)
+    // list of the whole blocks in the range
+    int max_whole = size / fs->block_size + 1;
+    int *addrs = (int *) malloc(max_whole * sizeof(int));
+    void **blocks = (void **) malloc(max_whole * sizeof(void *));
+    if (addrs == NULL || blocks == NULL)
     {
-        free(filename);
-        free(superblock);
+        free(addrs);
+        free(blocks);
+        if (allocating)
+            discard_free_map(fs);
+        free_file_inode(&file_inode);
         return MALLOC_ERR; // malloc error
     }
-    
-    // read the block containing the root directory inode
-    err = readBlock(mounted_disk, ROOT_INODE, root_inode);
-    if (err < 0)
-    {
-        free(filename);
-        free(superblock);
-        free(root_inode);
-        return err; // read error
-    }
+    int n_whole = 0;
 
-    // find block with file inode
-    int file_inode_addr = 0;
-    Node *cur = (*((LinkedList **) root_inode))->front;
-    while (cur->next != NULL)
+    // write only the blocks covered by the range
+    uint8_t *data_block = NULL;
+    int bytes_written = 0;
+    while (bytes_written < size)
     {
-        if (!strncmp(((Root_inode_entry *) cur->next->data)->filename, \
-            filename, MAX_FILENAME_LEN))
-        {
-            // set address of file inode
-            file_inode_addr = ((Root_inode_entry *) cur->next->data)->addr;
+        int addr = file_inode.extents[extent].start + block;
+        int block_offset = (offset + bytes_written) % fs->block_size;
+        int length = fs->block_size - block_offset;
+        if (length > size - bytes_written)
+            length = size - bytes_written;
 
-            // delete file inode
-            delete(*((LinkedList **) root_inode), cur);
-            break;
+        // whole blocks go straight from the caller's buffer, all at once
+        // after the loop
+        if (length == fs->block_size)
+        {
+            addrs[n_whole] = addr;
+            blocks[n_whole] = &buffer[bytes_written];
+            n_whole++;
+            err = 0;
+        }
+        // partial blocks keep the old data around the range, new and
+        // preallocated blocks are filled in with null
+        else
+        {
+            if (data_block == NULL)
+                data_block = (uint8_t *) malloc(fs->block_size);
+            if (data_block == NULL)
+                err = MALLOC_ERR; // malloc error
+            else if (index < old_n_blocks && \
+                (int64_t) index * fs->block_size < resource_table_entry->size)
+                err = readBlock(fs->disk, addr, data_block);
+            else
+            {
+                memset(data_block, 0, fs->block_size);
+                err = 0;
+            }
+            if (err >= 0)
+            {
+                memcpy(&data_block[block_offset], &buffer[bytes_written], length);
+                err = writeBlock(fs->disk, addr, data_block);
+            }
+        }
+        if (err < 0)
+        {
+            free(addrs);
+            free(blocks);
+            free(data_block);
+            if (allocating)
+                discard_free_map(fs);
+            free_file_inode(&file_inode);
+            return err; // read or write error
         }
-        cur = cur->next;
-    }
 
-    // free stuff
-    free(filename);
-    free(root_inode);
+        bytes_written += length;
 
-    // create file inode buffer
-    uint8_t *file_inode = (uint8_t *) malloc(BLOCKSIZE);
-    if (file_inode == NULL)
-        return MALLOC_ERR; // malloc error
-    
-    // read the block containing the file inode
-    err = readBlock(mounted_disk, file_inode_addr, file_inode);
-    if (err < 0)
-    {
-        free(superblock);
-        free(file_inode);
-        return err; // read error
+        // move to the next block, possibly in the next extent
+        index++;
+        block++;
+        if (block == file_inode.extents[extent].length)
+        {
+            extent++;
+            block = 0;
+        }
     }
+    free(data_block);
 
-    // free the block containing the file inode
-    free_block(superblock, file_inode_addr);
-
-    // set data blocks free
-    cur = (*((LinkedList **) file_inode))->front;
-    while (cur->next != NULL)
+    // write the whole blocks, adjacent blocks go out in a single call
+    err = writeBlocks(fs->disk, n_whole, addrs, blocks);
+    free(addrs);
+    free(blocks);
+    if (err < 0)
     {
-        free_block(superblock, ((File_inode_entry *) cur->next->data)->addr);
-        cur = cur->next;
+        if (allocating)
+            discard_free_map(fs);
+        free_file_inode(&file_inode);
+        return err; // write error
     }
 
-    // write superblock back to disk
-    err = writeBlock(mounted_disk, SUPERBLOCK, superblock);
+    // write the file inode, the block map may have grown
+    err = write_file_inode(fs, file_inode_addr, &file_inode);
+    free_file_inode(&file_inode);
     if (err < 0)
     {
-        free_linked_list(*((LinkedList **) file_inode));
-        free(superblock);
-        free(file_inode);
-        return err; // write error
+        if (allocating)
+            discard_free_map(fs);
+        return err; // disk full or write error
     }
+    if (allocating)
+        end_free_map(fs);
 
-    // free stuff
-    free_linked_list(*((LinkedList **) file_inode));
-    free(superblock);
-    free(file_inode);
-
-    // remove file from resource table and return
-    return tfs_close(FD);
+    // successful return
+    return 0;
 }
 
-int tfs_readByte(fileDescriptor FD, char *buffer)
+// put size bytes from buffer at offset in the delayed blocks of the file,
+// which start at block start and are made to hold new_size bytes. start
+// must be the first delayed block if the file has any, unless the write
+// replaces the whole file. if it has none yet, the blocks of the old data
+// that the write only partly covers are read from disk first
+// returns 0 if successful, 1 if the mount has no room for more delayed
+// blocks, DISK_FULL if the blocks can't be reserved
+static int delay_write(Mount *fs, Resource_table_entry *resource_table_entry, \
+    File_inode *file_inode, int start, char *buffer, int size, int offset, int new_size)
 {
     int err;
-    // create buffer for file name
-    char *filename = (char *) malloc(MAX_FILENAME_LEN);
-    if (filename == NULL)
-        return MALLOC_ERR; // malloc error
-
-    // check if file exists and is open
-    err = get_filename(FD, filename);
-    if (err < 0)
-    {
-        free(filename);
-        return err; // file not open or doesn't exist
-    }
+    int bs = fs->block_size;
+    int count = (int) (((int64_t) new_size + bs - 1) / bs) - start;
+    int old_count = resource_table_entry->delay_block >= 0 ? \
+        resource_table_entry->delay_count : 0;
 
-    // create root directory inode buffer
-    uint8_t *root_inode = (uint8_t *) malloc(BLOCKSIZE);
-    if (root_inode == NULL)
-    {
-        free(filename);
-        return MALLOC_ERR; // malloc error
-    }
-    
-    // read the block containing the root directory inode
-    err = readBlock(mounted_disk, ROOT_INODE, root_inode);
-    if (err < 0)
+    // make room, what is already delayed stays as it is
+    if (count > resource_table_entry->delay_capacity)
     {
-        free(filename);
-        free(root_inode);
-        return err; // read error
+        uint8_t *grown = (uint8_t *) realloc(resource_table_entry->delay_data, \
+            (size_t) count * bs);
+        if (grown == NULL)
+            return MALLOC_ERR; // malloc error
+        resource_table_entry->delay_data = grown;
+        resource_table_entry->delay_capacity = count;
     }
 
-    // find block with file inode
-    int file_inode_addr = 0;
-    int size = 0;
-    Node *cur = (*((LinkedList **) root_inode))->front;
-    while (cur->next != NULL)
+    // read the blocks on disk the write only covers part of
+    if (resource_table_entry->delay_block < 0)
     {
-        if (!strncmp(((Root_inode_entry *) cur->next->data)->filename, \
-            filename, MAX_FILENAME_LEN))
+        int64_t old_end = resource_table_entry->size < new_size ? \
+            resource_table_entry->size : new_size;
+        int i;
+        for (i = 0; i < count && (int64_t) (start + i) * bs < old_end; i++)
         {
-            file_inode_addr = ((Root_inode_entry *) cur->next->data)->addr;
-            size = ((Root_inode_entry *) cur->next->data)->size;
-            break;
+            int64_t low = (int64_t) (start + i) * bs;
+            int64_t high = low + bs < old_end ? low + bs : old_end;
+            if (low >= offset && high <= (int64_t) offset + size)
+                continue; // all overwritten
+            err = readBlock(fs->disk, get_file_block(file_inode, start + i), \
+                &resource_table_entry->delay_data[(size_t) i * bs]);
+            if (err < 0)
+                return err; // read error
         }
-        cur = cur->next;
-    }
-
-    // free filename
-    free(filename);
-
-    // create file inode buffer
-    uint8_t *file_inode = (uint8_t *) malloc(BLOCKSIZE);
-    if (file_inode == NULL)
-        return MALLOC_ERR; // malloc error
-    
-    // read the block containing the file inode
-    err = readBlock(mounted_disk, file_inode_addr, file_inode);
-    if (err < 0)
-    {
-        free(root_inode);
-        free(file_inode);
-        return err; // read error
     }
 
-    // get offset
-    cur = ((LinkedList *) resource_table)->front;
-    int fp;
-    while (cur->next != NULL)
+    // reserve a free block for each delayed block past the block map
+    int reserved = start + count - (start > file_inode->n_blocks ? start : \
+        file_inode->n_blocks);
+    if (reserved < 0)
+        reserved = 0;
+    pthread_mutex_lock(&fs->alloc_lock);
+    if (fs->delayed_blocks - old_count + count > DELAY_MOUNT_BYTES / bs)
     {
-        if (((Resource_table_entry *) cur->next->data)->fd == FD)
-        {
-            fp = ((Resource_table_entry *) cur->next->data)->fp;
-            break;
-        }
-        cur = cur->next;
+        pthread_mutex_unlock(&fs->alloc_lock);
+        return 1; // too many delayed blocks
     }
-
-    // make sure file pointer isn't at EOF
-    if (fp >= size)
+    if (reserved > resource_table_entry->delay_reserved && (fs->free_map == NULL || \
+        fs->free_map->n_free - fs->reserved_blocks < \
+            reserved - resource_table_entry->delay_reserved))
     {
-        free(root_inode);
-        free(file_inode);
-        return EOF_ERR; // no bytes left to read
+        pthread_mutex_unlock(&fs->alloc_lock);
+        return DISK_FULL; // no more disk space
     }
-    else // increment file pointer
-        ((Resource_table_entry *) cur->next->data)->fp += 1;
-
-    // iterate to correct file inode entry
-    cur = (*((LinkedList **) file_inode))->front;
-    int i;
-    for (i = 0; i < fp / BLOCKSIZE; i++)
-        cur = cur->next;
-
-    // get address of block
-    int addr = ((File_inode_entry *) cur->next->data)->addr;
-
-    // free stuff
-    free(root_inode);
-    free(file_inode);
+    fs->delayed_blocks += count - old_count;
+    fs->reserved_blocks += reserved - resource_table_entry->delay_reserved;
+    pthread_mutex_unlock(&fs->alloc_lock);
 
-    // get data block buffer
-    uint8_t *data_block = (uint8_t *) malloc(BLOCKSIZE);
-    if (data_block == NULL)
-        return MALLOC_ERR; // malloc error
-    
-    // read the block containing the file inode
-    err = readBlock(mounted_disk, addr, data_block);
-    if (err < 0)
+    // copy the data in, the rest of the last block is null
+    uint8_t *data = resource_table_entry->delay_data;
+    if (count > 0)
     {
-        free(data_block);
-        return err; // read error
+        memcpy(&data[offset - (int64_t) start * bs], buffer, size);
+        memset(&data[new_size - (int64_t) start * bs], 0, \
+            (size_t) (start + count) * bs - new_size);
     }
-
-    // copy byte into buffer
-    memcpy(buffer, &data_block[fp % BLOCKSIZE], 1);
-
-    // free data block
-    free(data_block);
-
-    // successful return
+    resource_table_entry->delay_block = start;
+    resource_table_entry->delay_count = count;
+    resource_table_entry->delay_reserved = reserved;
+    resource_table_entry->delay_mtime = time(NULL);
     return 0;
 }
 
-int tfs_seek(fileDescriptor FD, int offset)
+// give the delayed blocks of a file their place on disk and write them,
+// with the file locked or fs_lock held exclusive. blocks past the end of
+// the block map are allocated together, as one run if the free map has one
+static int flush_delayed(Mount *fs, Resource_table_entry *resource_table_entry)
 {
     int err;
-    // create buffer for file name
-    char *filename = (char *) malloc(MAX_FILENAME_LEN);
-    if (filename == NULL)
-        return MALLOC_ERR; // malloc error
+    if (resource_table_entry->delay_block < 0)
+        return 0; // nothing delayed
 
-    // check if file exists and is open
-    err = get_filename(FD, filename);
+    // read the file inode
+    File_inode file_inode;
+    err = read_file_inode(fs, resource_table_entry->inode_addr, &file_inode);
     if (err < 0)
-    {
-        free(filename);
-        return err; // file not open or doesn't exist
-    }
+        return err; // read error
 
-    // create root directory inode buffer
-    uint8_t *root_inode = (uint8_t *) malloc(BLOCKSIZE);
-    if (root_inode == NULL)
+    int start = resource_table_entry->delay_block;
+    int count = resource_table_entry->delay_count;
+    int *addrs = (int *) malloc(count * sizeof(int));
+    void **blocks = (void **) malloc(count * sizeof(void *));
+    if (addrs == NULL || blocks == NULL)
     {
-        free(filename);
+        free(addrs);
+        free(blocks);
+        free_file_inode(&file_inode);
         return MALLOC_ERR; // malloc error
     }
-    
-    // read the block containing the root directory inode
-    err = readBlock(mounted_disk, ROOT_INODE, root_inode);
-    if (err < 0)
-    {
-        free(filename);
-        free(root_inode);
-        return err; // read error
-    }
 
-    // iterate through root directory inode to get size
-    Node *cur = (*((LinkedList **) root_inode))->front;
-    int size = 0;
-    while (cur->next != NULL)
+    // the file gets exactly the blocks it needs, and those of a
+    // tfs_fallocate. the reserved blocks are the ones allocated here
+    begin_free_map(fs);
+    fs->reserved_blocks -= resource_table_entry->delay_reserved;
+    err = truncate_file_blocks(fs, &file_inode, start + count > \
+        resource_table_entry->prealloc_blocks ? start + count : \
+        resource_table_entry->prealloc_blocks);
+    if (err >= 0)
+        err = grow_file_blocks(fs, &file_inode, start + count);
+
+    // write the data, adjacent blocks go out in a single call
+    if (err >= 0)
     {
-        if (!strncmp(((Root_inode_entry *) cur->next->data)->filename, \
-            filename, MAX_FILENAME_LEN))
+        int i;
+        for (i = 0; i < count; i++)
         {
-            size = ((Root_inode_entry *) cur->next->data)->size;
-            break;
+            addrs[i] = get_file_block(&file_inode, start + i);
+            blocks[i] = &resource_table_entry->delay_data[(size_t) i * fs->block_size];
         }
-        cur = cur->next;
+        err = writeBlocks(fs->disk, count, addrs, blocks);
     }
 
-    // free stuff
-    free(filename);
-    free(root_inode);
-
-    // check if offset is invalid
-    if (offset < 0 || offset > size)
-        return INVALID_OP; // invalid offset
-
-    // seek file pointer
-    cur = ((LinkedList *) resource_table)->front;
-    while (cur->next != NULL)
+    // write the file inode, the block map may have grown or shrunk
+    if (err >= 0)
     {
-
-        if (((Resource_table_entry *) cur->next->data)->fd == FD)
-        {       
-            ((Resource_table_entry *) cur->next->data)->fp = offset;
-            break;
-        }
-        cur = cur->next;
+        file_inode.mtime = resource_table_entry->delay_mtime;
+        err = write_file_inode(fs, resource_table_entry->inode_addr, &file_inode);
     }
+    free(addrs);
+    free(blocks);
+    free_file_inode(&file_inode);
+    if (err < 0)
+    {
+        fs->reserved_blocks += resource_table_entry->delay_reserved;
+        discard_free_map(fs);
+        return err; // disk full, malloc or write error
+    }
+    fs->delayed_blocks -= count;
+    end_free_map(fs);
+    resource_table_entry->delay_block = -1;
+    resource_table_entry->delay_count = 0;
+    resource_table_entry->delay_reserved = 0;
+
+    // successful return
     return 0;
 }
 
-int tfs_rename(fileDescriptor FD, char *new_name)
+// forget the delayed blocks of a file without writing them
+static void discard_delayed(Mount *fs, Resource_table_entry *resource_table_entry)
 {
-    int err;
+    if (resource_table_entry->delay_block < 0)
+        return; // nothing delayed
+    pthread_mutex_lock(&fs->alloc_lock);
+    fs->delayed_blocks -= resource_table_entry->delay_count;
+    fs->reserved_blocks -= resource_table_entry->delay_reserved;
+    pthread_mutex_unlock(&fs->alloc_lock);
+    resource_table_entry->delay_block = -1;
+    resource_table_entry->delay_count = 0;
+    resource_table_entry->delay_reserved = 0;
+}
 
-    if (strlen(new_name) > MAX_FILENAME_LEN)
-        return INVALID_OP; // invalid filename length
+// write size bytes from buffer at the end of the file
+int tfs_append(fileDescriptor FD, char *buffer, int size)
+{
+    return tfsm_append(DEFAULT_MOUNT, FD, buffer, size);
+}
 
-    // create buffer for file name
-    char *filename = (char *) malloc(MAX_FILENAME_LEN);
-    if (filename == NULL)
-        return MALLOC_ERR; // malloc error
+int tfsm_append(mountHandle m, fileDescriptor FD, char *buffer, int size)
+{
+    uint64_t start = stat_clock();
+    Mount *fs = get_mount(m);
+    if (fs == NULL)
+        return stat_call(CALL_APPEND, start, INVALID_OP); // invalid handle
+    return stat_call(CALL_APPEND, start, write_at(fs, FD, buffer, size, 0, 1));
+}
 
-    // check if file exists and is open
-    err = get_filename(FD, filename);
-    if (err < 0)
-    {
-        free(filename);
-        return err; // file not open or doesn't exist
-    }
+// make sure the file has blocks for its first size bytes, without changing
+// its size or data. blocks past the end of the file are taken as one run
+// if the disk has one, so later writes fill them in without allocating.
+// with FALLOC_KEEP in flags they stay with the file when it is closed,
+// otherwise closing gives them back
+int tfs_fallocate(fileDescriptor FD, int size, int flags)
+{
+    return tfsm_fallocate(DEFAULT_MOUNT, FD, size, flags);
+}
 
-    // create root directory inode buffer
-    uint8_t *root_inode = (uint8_t *) malloc(BLOCKSIZE);
-    if (root_inode == NULL)
-    {
-        free(filename);
-        return MALLOC_ERR; // malloc error
-    }
-    
-    // read the block containing the root directory inode
-    err = readBlock(mounted_disk, ROOT_INODE, root_inode);
-    if (err < 0)
-    {
-        free(filename);
-        free(root_inode);
-        return err; // read error
-    }
+int tfsm_fallocate(mountHandle m, fileDescriptor FD, int size, int flags)
+{
+    uint64_t start = stat_clock();
+    Mount *fs = get_mount(m);
+    if (fs == NULL)
+        return stat_call(CALL_FALLOCATE, start, INVALID_OP); // invalid handle
 
-    // iterate through root directory inode to get filename
-    Node *cur = (*((LinkedList **) root_inode))->front;
-    while (cur->next != NULL)
+    while (1)
     {
-        if (!strncmp(((Root_inode_entry *) cur->next->data)->filename, \
-            filename, MAX_FILENAME_LEN))
+        // check if file exists and is open
+        Resource_table_entry *entry = lock_file(fs, FD);
+        if (entry == NULL)
+            return stat_call(CALL_FALLOCATE, start, NO_FD); // file not open
+        int err = fallocate_file(fs, entry, size, flags);
+        int retry = err == DISK_FULL && freed_blocks_waiting(fs);
+        unlock_file(fs, entry);
+        if (!retry)
         {
-            strncpy(((Root_inode_entry *) cur->next->data)->filename, \
-                new_name, MAX_FILENAME_LEN);
-            break;
-        }
-        cur = cur->next;
-    }
+            if (err < 0)
+                return stat_call(CALL_FALLOCATE, start, err); // disk full or I/O error
 
-    // find block with file inode
-    int file_inode_addr = 0;
-    cur = (*((LinkedList **) root_inode))->front;
-    while (cur->next != NULL)
-    {
-        if (!strncmp(((Root_inode_entry *) cur->next->data)->filename, \
-            filename, MAX_FILENAME_LEN))
-        {
-            file_inode_addr = ((Root_inode_entry *) cur->next->data)->addr;
-            break;
+            // write back the superblock and directory if a sync is due
+            return stat_call(CALL_FALLOCATE, start, sync_if_due(fs));
         }
-        cur = cur->next;
+
+        // blocks freed since the last sync can be used once it commits
+        err = sync_mount(fs);
+        if (err < 0)
+            return stat_call(CALL_FALLOCATE, start, err); // write error
     }
+}
 
-    // free filename
-    free(filename);
-    free(root_inode);
+// tfs_fallocate, with the file locked
+static int fallocate_file(Mount *fs, Resource_table_entry *resource_table_entry, \
+    int size, int flags)
+{
+    int err;
+    if (size < 0 || (flags & ~FALLOC_KEEP) != 0)
+        return INVALID_OP; // invalid size or flags
 
-    // create file inode buffer
-    uint8_t *file_inode = (uint8_t *) malloc(BLOCKSIZE);
-    if (file_inode == NULL)
-        return MALLOC_ERR; // malloc error
-    
-    // read the block containing the file inode
-    err = readBlock(mounted_disk, file_inode_addr, file_inode);
+    // delayed blocks go first, so the new blocks follow theirs
+    err = flush_delayed(fs, resource_table_entry);
+    if (err < 0)
+        return err; // disk full, malloc or write error
+
+    // read the file inode
+    File_inode file_inode;
+    err = read_file_inode(fs, resource_table_entry->inode_addr, &file_inode);
     if (err < 0)
-    {
-        free(file_inode);
         return err; // read error
-    }
 
-    cur = resource_table->front;
-    while (cur->next != NULL)
+    // allocate the missing blocks
+    int n_blocks = (int) (((int64_t) size + fs->block_size - 1) / fs->block_size);
+    if (n_blocks > file_inode.n_blocks)
     {
-        if (((Resource_table_entry *) cur->next->data)->fd == FD)
+        begin_free_map(fs);
+        err = grow_file_blocks(fs, &file_inode, n_blocks);
+        if (err >= 0)
+            err = write_file_inode(fs, resource_table_entry->inode_addr, &file_inode);
+        if (err < 0)
         {
-            strncpy(((Resource_table_entry *) cur->next->data)->filename, \
-                new_name, MAX_FILENAME_LEN);
-            break;
+            discard_free_map(fs);
+            free_file_inode(&file_inode);
+            return err; // disk full, malloc or write error
         }
-        cur = cur->next;
-    }
-
-    // update modification time
-    time((time_t *)&file_inode[sizeof(LinkedList *) + 2 * sizeof(time_t *)]);
-
-    // write file inode entry to disk
-    err = writeBlock(mounted_disk, file_inode_addr, file_inode);
-    if (err < 0)
-    {
-        free(file_inode);
-        return err; // write error
+        end_free_map(fs);
     }
+    free_file_inode(&file_inode);
 
-    // free filename
-    free(file_inode);
+    if (n_blocks > resource_table_entry->prealloc_blocks)
+        resource_table_entry->prealloc_blocks = n_blocks;
+    resource_table_entry->prealloc_keep = (flags & FALLOC_KEEP) != 0;
 
     // successful return
     return 0;
 }
 
-int tfs_readdir()
+// give back the blocks past the end of the file that a tfs_fallocate set
+// aside, unless they are kept
+static int release_prealloc(Mount *fs, Resource_table_entry *resource_table_entry)
 {
     int err;
-    // create root directory inode buffer
-    uint8_t *root_inode = (uint8_t *) malloc(BLOCKSIZE);
-    if (root_inode == NULL)
-        return MALLOC_ERR; // malloc error
-    
-    // read the block containing the root directory inode
-    err = readBlock(mounted_disk, ROOT_INODE, root_inode);
+    int n_blocks = (int) (((int64_t) resource_table_entry->size + fs->block_size - 1) / \
+        fs->block_size);
+    if (resource_table_entry->prealloc_keep || \
+        resource_table_entry->prealloc_blocks <= n_blocks)
+        return 0; // nothing to give back
+
+    // read the file inode
+    File_inode file_inode;
+    err = read_file_inode(fs, resource_table_entry->inode_addr, &file_inode);
     if (err < 0)
-    {
-        free(root_inode);
         return err; // read error
-    }
 
-    // iterate through root directory inode to get filename
-    Node *cur = (*((LinkedList **) root_inode))->front;
-    while (cur->next != NULL)
+    // cut the block map down and write it back
+    begin_free_map(fs);
+    err = truncate_file_blocks(fs, &file_inode, n_blocks);
+    if (err >= 0)
+        err = write_file_inode(fs, resource_table_entry->inode_addr, &file_inode);
+    free_file_inode(&file_inode);
+    if (err < 0)
     {
-        printf("%s\n", ((Root_inode_entry *) cur->next->data)->filename);
-        cur = cur->next;
+        discard_free_map(fs);
+        return err; // malloc or write error
     }
-
-    // free stuff
-    free(root_inode);
+    end_free_map(fs);
+    resource_table_entry->prealloc_blocks = 0;
 
     // successful return
     return 0;
 }
 
-int tfs_stat(fileDescriptor FD, struct tm *creation_time, \
-    struct tm *access_time, struct tm *modification_time)
+int tfs_delete(fileDescriptor FD)
 {
-    int err;
-    // create buffer for file name
-    char *filename = (char *) malloc(MAX_FILENAME_LEN);
-    if (filename == NULL)
-        return MALLOC_ERR; // malloc error
+    return tfsm_delete(DEFAULT_MOUNT, FD);
+}
+
+int tfsm_delete(mountHandle m, fileDescriptor FD)
+{
+    uint64_t start = stat_clock();
+    Mount *fs = get_mount(m);
+    if (fs == NULL)
+        return stat_call(CALL_DELETE, start, INVALID_OP); // invalid handle
 
     // check if file exists and is open
-    err = get_filename(FD, filename);
+    pthread_rwlock_wrlock(&fs->fs_lock);
+    Resource_table_entry *entry = get_resource_table_entry(fs, FD);
+    int err = entry == NULL ? NO_FD : delete_file(fs, entry);
+    pthread_rwlock_unlock(&fs->fs_lock);
     if (err < 0)
-    {
-        free(filename);
-        return err; // file not open or doesn't exist
+        return stat_call(CALL_DELETE, start, err); // file not open or read error
+
+    // write back the superblock and directory if a sync is due
+    return stat_call(CALL_DELETE, start, sync_if_due(fs));
+}
+
+// tfs_delete, with fs_lock held exclusive
+static int delete_file(Mount *fs, Resource_table_entry *resource_table_entry)
+{
+    int err;
+
+    // find block with file inode
+    Root_inode_entry *root_inode_entry = \
+        find_root_inode_entry(fs, resource_table_entry->filename);
+    int file_inode_addr = resource_table_entry->inode_addr;
+
+    // read the file inode
+    File_inode file_inode;
+    err = read_file_inode(fs, file_inode_addr, &file_inode);
+    if (err < 0)
+        return err; // read error
+
+    // free the block containing the file inode
+    begin_free_map(fs);
+    err = free_block(fs, file_inode_addr);
+
+    // set block map continuation blocks free
+    Node *cur = file_inode.spill->front;
+    while (err >= 0 && cur->next != NULL)
+    {
+        err = free_block(fs, ((File_inode_entry *) cur->next->data)->addr);
+        cur = cur->next;
+    }
+
+    // set data blocks free
+    if (err >= 0)
+        err = truncate_file_blocks(fs, &file_inode, 0);
+    free_file_inode(&file_inode);
+
+    // the directory may need a block less without the entry, it is freed
+    // before the entry is taken out so a failure leaves the file whole
+    if (err >= 0)
+        err = resize_chain(fs, fs->dir_spill, \
+            dir_spill_blocks(fs, fs->root_dir->size - 1));
+    if (err < 0)
+    {
+        discard_free_map(fs);
+        return err; // malloc error
+    }
+
+    // delete directory entry, the directory is written at the next sync
+    remove_root_inode_entry(fs, root_inode_entry);
+    end_free_map(fs);
+    fs->dir_dirty = 1;
+
+    // delayed blocks never get written
+    discard_delayed(fs, resource_table_entry);
+
+    // remove file from resource table
+    remove_resource_table_entry(fs, resource_table_entry);
+
+    // successful return
+    return 0;
+}
+
+int tfs_readByte(fileDescriptor FD, char *buffer)
+{
+    return tfsm_readByte(DEFAULT_MOUNT, FD, buffer);
+}
+
+int tfsm_readByte(mountHandle m, fileDescriptor FD, char *buffer)
+{
+    uint64_t start = stat_clock();
+    Mount *fs = get_mount(m);
+    if (fs == NULL)
+        return stat_call(CALL_READBYTE, start, INVALID_OP); // invalid handle
+
+    // check if file exists and is open
+    Resource_table_entry *entry = lock_file(fs, FD);
+    if (entry == NULL)
+        return stat_call(CALL_READBYTE, start, NO_FD); // file not open or doesn't exist
+    int err = read_byte(fs, entry, buffer);
+    unlock_file(fs, entry);
+    return stat_call(CALL_READBYTE, start, err);
+}
+
+// tfs_readByte, with the file locked. the data block under the file
+// pointer is kept with the open file, so only the first byte read from
+// each block looks up the block map and reads the block
+static int read_byte(Mount *fs, Resource_table_entry *resource_table_entry, char *buffer)
+{
+    int err;
+    int fp = resource_table_entry->fp;
+    if (fp >= resource_table_entry->size)
+        return EOF_ERR; // no bytes left to read
+    int index = fp / fs->block_size;
+
+    // delayed blocks are read from memory
+    if (resource_table_entry->delay_block >= 0 && \
+        index >= resource_table_entry->delay_block)
+    {
+        *buffer = (char) resource_table_entry->delay_data[fp - \
+            (int64_t) resource_table_entry->delay_block * fs->block_size];
+        resource_table_entry->fp += 1;
+        return 0;
+    }
+
+    // load the block under the file pointer
+    if (resource_table_entry->read_index != index)
+    {
+        if (resource_table_entry->read_block == NULL)
+            resource_table_entry->read_block = (uint8_t *) malloc(fs->block_size);
+        if (resource_table_entry->read_block == NULL)
+            return MALLOC_ERR; // malloc error
+
+        // read the file inode
+        File_inode file_inode;
+        err = read_file_inode(fs, resource_table_entry->inode_addr, &file_inode);
+        if (err < 0)
+            return err; // read error
+
+        resource_table_entry->read_index = -1;
+        err = readBlock(fs->disk, get_file_block(&file_inode, index), \
+            resource_table_entry->read_block);
+        if (err >= 0)
+            read_ahead(fs, resource_table_entry, &file_inode, index, index);
+        free_file_inode(&file_inode);
+        if (err < 0)
+            return err; // read error
+        resource_table_entry->read_index = index;
+    }
+
+    *buffer = (char) resource_table_entry->read_block[fp % fs->block_size];
+    resource_table_entry->fp += 1;
+
+    // successful return
+    return 0;
+}
+
+// read up to size bytes from the file pointer into buffer
+// returns the number of bytes read, EOF_ERR if the file pointer is at EOF
+int tfs_read(fileDescriptor FD, char *buffer, int size)
+{
+    return tfsm_read(DEFAULT_MOUNT, FD, buffer, size);
+}
+
+int tfsm_read(mountHandle m, fileDescriptor FD, char *buffer, int size)
+{
+    uint64_t start = stat_clock();
+    Mount *fs = get_mount(m);
+    if (fs == NULL)
+        return stat_call(CALL_READ, start, INVALID_OP); // invalid handle
+
+    // check if file exists and is open
+    Resource_table_entry *entry = lock_file(fs, FD);
+    if (entry == NULL)
+        return stat_call(CALL_READ, start, NO_FD); // file not open or doesn't exist
+    int err = read_file(fs, entry, buffer, size);
+    unlock_file(fs, entry);
+    return stat_call(CALL_READ, start, err);
+}
+
+// tfs_read, with the file locked
+static int read_file(Mount *fs, Resource_table_entry *resource_table_entry, \
+    char *buffer, int size)
+{
+    int err;
+    if (size < 0)
+        return INVALID_OP; // invalid size
+    if (size == 0)
+        return 0; // nothing to read
+
+    // get the file pointer
+    int fp = resource_table_entry->fp;
+
+    // make sure file pointer isn't at EOF
+    if (fp >= resource_table_entry->size)
+        return EOF_ERR; // no bytes left to read
+    if (size > resource_table_entry->size - fp)
+        size = resource_table_entry->size - fp;
+
+    // the part of the range in delayed blocks is copied from memory, the
+    // rest is read from disk
+    int delayed = 0;
+    int64_t delay_start = (int64_t) resource_table_entry->delay_block * fs->block_size;
+    if (resource_table_entry->delay_block >= 0 && fp + size > delay_start)
+        delayed = fp >= delay_start ? size : (int) (fp + size - delay_start);
+    if (delayed < size)
+    {
+        err = read_file_blocks(fs, resource_table_entry, buffer, fp, size - delayed);
+        if (err < 0)
+            return err; // read error
+    }
+    if (delayed > 0)
+        memcpy(&buffer[size - delayed], \
+            &resource_table_entry->delay_data[fp + size - delayed - delay_start], delayed);
+
+    // advance file pointer past the bytes read
+    resource_table_entry->fp += size;
+
+    // successful return
+    return size;
+}
+
+// read size bytes at fp from the blocks of the file into buffer
+static int read_file_blocks(Mount *fs, Resource_table_entry *resource_table_entry, \
+    char *buffer, int fp, int size)
+{
+    int err;
+
+    // read the file inode
+    File_inode file_inode;
+    err = read_file_inode(fs, resource_table_entry->inode_addr, &file_inode);
+    if (err < 0)
+        return err; // read error
+
+    // find the extent holding the first block
+    int index = fp / fs->block_size;
+    int extent = find_extent(&file_inode, index);
+    if (extent < 0)
+    {
+        free_file_inode(&file_inode);
+        return READ_ERR; // the inode lists fewer blocks than the file size
+    }
+    int block = index - file_inode.extents[extent].logical;
+
+    // list of the whole blocks in the range
+    int max_whole = size / fs->block_size + 1;
+    int *addrs = (int *) malloc(max_whole * sizeof(int));
+    void **blocks = (void **) malloc(max_whole * sizeof(void *));
+    if (addrs == NULL || blocks == NULL)
+    {
+        free(addrs);
+        free(blocks);
+        free_file_inode(&file_inode);
+        return MALLOC_ERR; // malloc error
+    }
+    int n_whole = 0;
+
+    // get data block buffer for partial blocks
+    uint8_t *data_block = NULL;
+    int bytes_read = 0;
+    while (bytes_read < size)
+    {
+        int addr = file_inode.extents[extent].start + block;
+        int offset = (fp + bytes_read) % fs->block_size;
+        int length = fs->block_size - offset;
+        if (length > size - bytes_read)
+            length = size - bytes_read;
+
+        // whole blocks go straight into the caller's buffer, all at once
+        // after the loop
+        if (length == fs->block_size)
+        {
+            addrs[n_whole] = addr;
+            blocks[n_whole] = &buffer[bytes_read];
+            n_whole++;
+            err = 0;
+        }
+        else
+        {
+            if (data_block == NULL)
+                data_block = (uint8_t *) malloc(fs->block_size);
+            if (data_block == NULL)
+                err = MALLOC_ERR; // malloc error
+            else
+                err = readBlock(fs->disk, addr, data_block);
+            if (err >= 0)
+                memcpy(&buffer[bytes_read], &data_block[offset], length);
+        }
+        if (err < 0)
+        {
+            free(addrs);
+            free(blocks);
+            free(data_block);
+            free_file_inode(&file_inode);
+            return err; // read error
+        }
+
+        bytes_read += length;
+
+        // move to the next block, possibly in the next extent
+        block++;
+        if (block == file_inode.extents[extent].length)
+        {
+            extent++;
+            block = 0;
+        }
+    }
+
+    // read the whole blocks, adjacent blocks come in with a single call
+    err = readBlocks(fs->disk, n_whole, addrs, blocks);
+    if (err >= 0)
+        read_ahead(fs, resource_table_entry, &file_inode, fp / fs->block_size, \
+            (fp + bytes_read - 1) / fs->block_size);
+
+    // free stuff
+    free(addrs);
+    free(blocks);
+    free(data_block);
+    free_file_inode(&file_inode);
+    if (err < 0)
+        return err; // read error
+
+    // successful return
+    return 0;
+}
+
+// called after a read of blocks first to last of the file. a read that
+// starts in the block the last one ended in or the block after continues
+// a sequential stream. whenever the stream gets within half a window of
+// what has been read ahead, the next blocks of the block map up to a
+// window past the read are prefetched into the block cache and the window
+// doubles. any other read ends the stream
+static void read_ahead(Mount *fs, Resource_table_entry *entry, File_inode *inode, \
+    int first, int last)
+{
+    if (first == entry->ra_next - 1 && last == first)
+        return; // still in the block the last read ended in
+    int sequential = first == entry->ra_next || first == entry->ra_next - 1;
+    entry->ra_next = last + 1;
+    if (!sequential)
+    {
+        entry->ra_window = 0;
+        entry->ra_end = 0;
+        return; // random access
+    }
+    if (entry->ra_window == 0)
+        entry->ra_window = READAHEAD_MIN_BLOCKS;
+    if (last + 1 + entry->ra_window / 2 < entry->ra_end)
+        return; // far enough ahead
+
+    // the blocks holding the rest of the window, up to the end of the file
+    int start = entry->ra_end > last + 1 ? entry->ra_end : last + 1;
+    int end = last + 1 + entry->ra_window;
+    int file_blocks = (int) (((int64_t) entry->size + fs->block_size - 1) / fs->block_size);
+    if (entry->delay_block >= 0)
+        file_blocks = entry->delay_block; // the rest are in memory
+    if (end > file_blocks)
+        end = file_blocks;
+    if (start >= end)
+        return; // nothing left to read ahead
+    int *addrs = (int *) malloc((end - start) * sizeof(int));
+    if (addrs == NULL)
+        return; // a failed read-ahead only costs the cache misses
+    int i;
+    for (i = start; i < end; i++)
+        addrs[i - start] = get_file_block(inode, i);
+    prefetchBlocks(fs->disk, end - start, addrs);
+    free(addrs);
+
+    entry->ra_end = end;
+    if (entry->ra_window < READAHEAD_MAX_BLOCKS)
+        entry->ra_window *= 2;
+}
+
+int tfs_seek(fileDescriptor FD, int offset)
+{
+    return tfsm_seek(DEFAULT_MOUNT, FD, offset);
+}
+
+int tfsm_seek(mountHandle m, fileDescriptor FD, int offset)
+{
+    uint64_t start = stat_clock();
+    Mount *fs = get_mount(m);
+    if (fs == NULL)
+        return stat_call(CALL_SEEK, start, INVALID_OP); // invalid handle
+
+    // check if file exists and is open
+    Resource_table_entry *resource_table_entry = lock_file(fs, FD);
+    if (resource_table_entry == NULL)
+        return stat_call(CALL_SEEK, start, NO_FD); // file not open or doesn't exist
+
+    // check if offset is invalid
+    int err = 0;
+    if (offset < 0 || offset > resource_table_entry->size)
+        err = INVALID_OP; // invalid offset
+    else
+    {
+        // seek file pointer, the block kept for tfs_readByte stays if the
+        // pointer is still in it
+        resource_table_entry->fp = offset;
+        if (offset / fs->block_size != resource_table_entry->read_index)
+            resource_table_entry->read_index = -1;
+    }
+    unlock_file(fs, resource_table_entry);
+    return stat_call(CALL_SEEK, start, err);
+}
+
+int tfs_rename(fileDescriptor FD, char *new_name)
+{
+    return tfsm_rename(DEFAULT_MOUNT, FD, new_name);
+}
+
+int tfsm_rename(mountHandle m, fileDescriptor FD, char *new_name)
+{
+    uint64_t start = stat_clock();
+    Mount *fs = get_mount(m);
+    if (fs == NULL)
+        return stat_call(CALL_RENAME, start, INVALID_OP); // invalid handle
+
+    if (strlen(new_name) > MAX_FILENAME_LEN)
+        return stat_call(CALL_RENAME, start, INVALID_OP); // invalid filename length
+
+    // check if file exists and is open
+    pthread_rwlock_wrlock(&fs->fs_lock);
+    Resource_table_entry *entry = get_resource_table_entry(fs, FD);
+    int err = entry == NULL ? NO_FD : rename_file(fs, entry, new_name);
+    pthread_rwlock_unlock(&fs->fs_lock);
+    if (err < 0)
+        return stat_call(CALL_RENAME, start, err); // not open, taken or write error
+
+    // write back the superblock and directory if a sync is due
+    return stat_call(CALL_RENAME, start, sync_if_due(fs));
+}
+
+// tfs_rename, with fs_lock held exclusive
+static int rename_file(Mount *fs, Resource_table_entry *resource_table_entry, \
+    char *new_name)
+{
+    int err;
+
+    // names must stay unique
+    if (find_root_inode_entry(fs, new_name) != NULL)
+        return INVALID_OP; // file with new name exists
+
+    // find root directory entry of the file
+    Root_inode_entry *root_inode_entry = \
+        find_root_inode_entry(fs, resource_table_entry->filename);
+    int file_inode_addr = resource_table_entry->inode_addr;
+
+    // read the file inode
+    File_inode file_inode;
+    err = read_file_inode(fs, file_inode_addr, &file_inode);
+    if (err < 0)
+        return err; // read error
+
+    // index the new name in the directory and the open file table first,
+    // so a failed insert leaves the file under its old name in both
+    if (hash_insert(fs->dir_index, name_key(new_name), root_inode_entry) < 0)
+    {
+        free_file_inode(&file_inode);
+        return MALLOC_ERR; // index malloc error
+    }
+    if (hash_insert(fs->open_index, name_key(new_name), resource_table_entry) < 0)
+    {
+        hash_remove(fs->dir_index, name_key(new_name));
+        free_file_inode(&file_inode);
+        return MALLOC_ERR; // index malloc error
+    }
+
+    // rename directory entry, the directory is written at the next sync
+    hash_remove(fs->dir_index, name_key(root_inode_entry->filename));
+    copy_name(root_inode_entry->filename, new_name);
+    fs->dir_dirty = 1;
+
+    // rename the open file
+    hash_remove(fs->open_index, name_key(resource_table_entry->filename));
+    copy_name(resource_table_entry->filename, new_name);
+
+    // update modification time
+    file_inode.mtime = time(NULL);
+
+    // write file inode entry to disk
+    err = write_file_inode(fs, file_inode_addr, &file_inode);
+    free_file_inode(&file_inode);
+    if (err < 0)
+        return err; // write error
+
+    // successful return
+    return 0;
+}
+
+int tfs_readdir(void)
+{
+    return tfsm_readdir(DEFAULT_MOUNT);
+}
+
+int tfsm_readdir(mountHandle m)
+{
+    uint64_t start = stat_clock();
+    Mount *fs = get_mount(m);
+    if (fs == NULL)
+        return stat_call(CALL_READDIR, start, INVALID_OP); // invalid handle
+
+    // check a disk is mounted
+    pthread_rwlock_rdlock(&fs->fs_lock);
+    if (fs->root_dir == NULL)
+    {
+        pthread_rwlock_unlock(&fs->fs_lock);
+        return stat_call(CALL_READDIR, start, INVALID_OP); // no disk mounted
+    }
+
+    // iterate through root directory inode to get filename
+    Node *cur = fs->root_dir->front;
+    while (cur->next != NULL)
+    {
+        printf("%.*s\n", MAX_FILENAME_LEN, \
+            ((Root_inode_entry *) cur->next->data)->filename);
+        cur = cur->next;
+    }
+    pthread_rwlock_unlock(&fs->fs_lock);
+
+    // successful return
+    return stat_call(CALL_READDIR, start, 0);
+}
+
+int tfs_stat(fileDescriptor FD, struct tm *creation_time, \
+    struct tm *access_time, struct tm *modification_time)
+{
+    return tfsm_stat(DEFAULT_MOUNT, FD, creation_time, access_time, modification_time);
+}
+
+int tfsm_stat(mountHandle m, fileDescriptor FD, struct tm *creation_time, \
+    struct tm *access_time, struct tm *modification_time)
+{
+    uint64_t start = stat_clock();
+    Mount *fs = get_mount(m);
+    if (fs == NULL)
+        return stat_call(CALL_STAT, start, INVALID_OP); // invalid handle
+
+    int err;
+
+    // check if file exists and is open
+    Resource_table_entry *resource_table_entry = lock_file(fs, FD);
+    if (resource_table_entry == NULL)
+        return stat_call(CALL_STAT, start, NO_FD); // file not open or doesn't exist
+
+    // get block with file inode
+    int file_inode_addr = resource_table_entry->inode_addr;
+
+    // read the file inode, delayed writes haven't set its mtime yet
+    File_inode file_inode;
+    err = read_file_inode(fs, file_inode_addr, &file_inode);
+    if (resource_table_entry->delay_block >= 0)
+        file_inode.mtime = resource_table_entry->delay_mtime;
+    unlock_file(fs, resource_table_entry);
+    if (err < 0)
+        return stat_call(CALL_STAT, start, err); // read error
+    free_file_inode(&file_inode);
+
+    // get creation time
+    time_t t = file_inode.ctime;
+    localtime_r(&t, creation_time);
+
+    // get access time
+    t = time(NULL);
+    localtime_r(&t, access_time);
+
+    // get modification time
+    t = file_inode.mtime;
+    localtime_r(&t, modification_time);
+
+    // successful return
+    return stat_call(CALL_STAT, start, 0);
+}
+
+// write the in memory superblock, free block bit array and directory back
+// to disk and flush the disk. with a journal they are committed together
+// with every inode written since the last sync
+int tfs_sync(void)
+{
+    return tfsm_sync(DEFAULT_MOUNT);
+}
+
+int tfsm_sync(mountHandle m)
+{
+    uint64_t start = stat_clock();
+    Mount *fs = get_mount(m);
+    if (fs == NULL)
+        return stat_call(CALL_SYNC, start, INVALID_OP); // invalid handle
+    return stat_call(CALL_SYNC, start, sync_mount(fs));
+}
+
+// tfsm_sync, taking fs_lock exclusive
+static int sync_mount(Mount *fs)
+{
+    pthread_rwlock_wrlock(&fs->fs_lock);
+    int err = sync_fs(fs);
+    pthread_rwlock_unlock(&fs->fs_lock);
+    return err;
+}
+
+// tfs_sync, with fs_lock held exclusive so nothing else is running
+static int sync_fs(Mount *fs)
+{
+    if (fs->disk < 0 || fs->free_map == NULL || fs->root_dir == NULL)
+        return INVALID_OP; // no file system mounted
+
+    // delayed blocks get their place on disk before the free map is stored
+    int err;
+    int fd;
+    for (fd = 0; fd < fs->resource_table->capacity; fd++)
+    {
+        if (fs->resource_table->slots[fd] == NULL)
+            continue;
+        err = flush_delayed(fs, fs->resource_table->slots[fd]);
+        if (err < 0)
+            return err; // disk full or write error
+    }
+
+    if (fs->dir_dirty)
+    {
+        // the directory goes first, it may allocate or free blocks
+        begin_free_map(fs);
+        err = store_directory(fs);
+        if (err < 0)
+        {
+            discard_free_map(fs);
+            return err; // disk full or write error
+        }
+        end_free_map(fs);
+        fs->dir_dirty = 0;
+    }
+    release_freed_blocks(fs);
+    err = store_free_map(fs);
+    if (err < 0)
+        return err; // write error
+
+    // one commit for every operation since the last sync
+    if (fs->journal != NULL)
+        err = journal_commit(fs->journal);
+    else
+        err = flushDisk(fs->disk);
+    if (err < 0)
+        return err; // write error
+    fs->last_sync = time(NULL);
+    return 0;
+}
+
+// sync at most every seconds seconds, 0 syncs after every operation
+int tfs_set_sync_interval(int seconds)
+{
+    return tfsm_set_sync_interval(DEFAULT_MOUNT, seconds);
+}
+
+int tfsm_set_sync_interval(mountHandle m, int seconds)
+{
+    Mount *fs = get_mount(m);
+    if (fs == NULL)
+        return INVALID_OP; // invalid handle
+
+    if (seconds < 0)
+        return INVALID_OP; // invalid interval
+    pthread_rwlock_wrlock(&fs->fs_lock);
+    fs->sync_interval = seconds;
+    pthread_rwlock_unlock(&fs->fs_lock);
+    return sync_if_due(fs);
+}
+
+// returns the number of free blocks writes can still take. blocks set
+// aside for delayed writes, and with a journal blocks freed since the last
+// sync, are not counted
+int tfs_free_blocks(void)
+{
+    return tfsm_free_blocks(DEFAULT_MOUNT);
+}
+
+int tfsm_free_blocks(mountHandle m)
+{
+    Mount *fs = get_mount(m);
+    if (fs == NULL)
+        return INVALID_OP; // invalid handle
+
+    pthread_rwlock_rdlock(&fs->fs_lock);
+    int n_free = INVALID_OP; // no file system mounted
+    if (fs->free_map != NULL)
+    {
+        pthread_mutex_lock(&fs->alloc_lock);
+        n_free = fs->free_map->n_free - fs->reserved_blocks;
+        pthread_mutex_unlock(&fs->alloc_lock);
+    }
+    pthread_rwlock_unlock(&fs->fs_lock);
+    return n_free;
+}
+
+// sync if the sync interval has passed since the last sync, or sooner if
+// the metadata logged since then is filling the journal
+int sync_if_due(Mount *fs)
+{
+    pthread_rwlock_rdlock(&fs->fs_lock);
+    pthread_mutex_lock(&fs->meta_lock);
+    int due = fs->disk >= 0 && (time(NULL) - fs->last_sync >= fs->sync_interval || \
+        (fs->journal != NULL && journal_full(fs->journal)));
+    pthread_mutex_unlock(&fs->meta_lock);
+    pthread_rwlock_unlock(&fs->fs_lock);
+    if (!due)
+        return 0; // nothing mounted or not due yet
+    return sync_mount(fs);
+}
+
+// if the file is open, puts the file described by FD in the filename buffer
+// returns 0 if successful, -1 if the file isn;t open/doesn't exist.
+int get_filename(fileDescriptor FD, char *filename)
+{
+    return tfsm_get_filename(DEFAULT_MOUNT, FD, filename);
+}
+
+int tfsm_get_filename(mountHandle m, fileDescriptor FD, char *filename)
+{
+    Mount *fs = get_mount(m);
+    if (fs == NULL)
+        return INVALID_OP; // invalid handle
+
+    // check if file exists and is open
+    pthread_rwlock_rdlock(&fs->fs_lock);
+    Resource_table_entry *entry = get_resource_table_entry(fs, FD);
+    if (entry != NULL)
+        copy_name(filename, entry->filename);
+    pthread_rwlock_unlock(&fs->fs_lock);
+    if (entry == NULL)
+        return NO_FD;
+    return 0;
+}
+
+// fill stats with the I/O, allocation and lookup counters and the latency
+// histogram of every public call since the last tfs_reset_stats, summed
+// over every thread and mount
+int tfs_get_stats(Tfs_stats *stats)
+{
+    if (stats == NULL)
+        return INVALID_OP; // no buffer
+    collect_stats(stats);
+    return 0;
+}
+
+// start the counters and histograms from zero
+int tfs_reset_stats(void)
+{
+    reset_stats();
+    return 0;
+}
+
+// time the public calls for the latency histograms if on is set, the
+// default, or only count them
+int tfs_set_stats_timing(int on)
+{
+    set_stat_timing(on);
+    return 0;
+}
+
+// write the counters and histograms to filename as JSON, replacing it
+int tfs_dump_stats(char *filename)
+{
+    Tfs_stats stats;
+    collect_stats(&stats);
+    FILE *file = fopen(filename, "w");
+    if (file == NULL)
+        return OPEN_ERR; // open error
+    int err = print_stats(file, &stats);
+    if (fclose(file) != 0 || err < 0)
+        return WRITE_ERR; // write error
+    return 0;
+}
+
+// take fs_lock shared and lock the open file described by FD
+// returns its entry, or NULL with nothing locked if the file isn't open
+static Resource_table_entry *lock_file(Mount *fs, fileDescriptor FD)
+{
+    pthread_rwlock_rdlock(&fs->fs_lock);
+    Resource_table_entry *entry = get_resource_table_entry(fs, FD);
+    if (entry == NULL)
+    {
+        pthread_rwlock_unlock(&fs->fs_lock);
+        return NULL;
+    }
+    pthread_mutex_lock(&entry->lock);
+    return entry;
+}
+
+static void unlock_file(Mount *fs, Resource_table_entry *entry)
+{
+    pthread_mutex_unlock(&entry->lock);
+    pthread_rwlock_unlock(&fs->fs_lock);
+}
+
+Resource_table *create_resource_table()
+{
+    Resource_table *table = (Resource_table *) malloc(sizeof(Resource_table));
+    if (table == NULL)
+        return NULL;
+    table->capacity = RESOURCE_TABLE_INITIAL_CAPACITY;
+    table->size = 0;
+    table->n_free = 0;
+    table->slots = (Resource_table_entry **) \
+        calloc(table->capacity, sizeof(Resource_table_entry *));
+    table->free_fds = (int *) malloc(table->capacity * sizeof(int));
+    if (table->slots == NULL || table->free_fds == NULL)
+    {
+        free_resource_table(table);
+        return NULL;
+    }
+    return table;
+}
+
+// frees the table. it must be empty, entries come from the open_pool of
+// the mount and are removed when it is unmounted
+void free_resource_table(Resource_table *table)
+{
+    free(table->slots);
+    free(table->free_fds);
+    free(table);
+}
+
+// returns the open file described by FD, or NULL
+Resource_table_entry *get_resource_table_entry(Mount *fs, fileDescriptor FD)
+{
+    if (fs->resource_table == NULL || FD < 0 || FD >= fs->resource_table->capacity)
+        return NULL;
+    stat_add(STAT_TABLE_LOOKUPS, 1);
+    stat_add(STAT_TABLE_SCANNED, 1);
+    return fs->resource_table->slots[FD];
+}
+
+// give entry a descriptor, reusing closed ones first, and index it by name
+int add_resource_table_entry(Mount *fs, Resource_table_entry *entry)
+{
+    int fd;
+    if (fs->resource_table->n_free > 0)
+        fd = fs->resource_table->free_fds[--fs->resource_table->n_free];
+    else if (fs->resource_table->size < fs->resource_table->capacity)
+        fd = fs->resource_table->size; // every lower descriptor is in use
+    else
+    {
+        // double the table
+        int capacity = fs->resource_table->capacity * 2;
+        Resource_table_entry **slots = (Resource_table_entry **) \
+            realloc(fs->resource_table->slots, capacity * sizeof(Resource_table_entry *));
+        if (slots == NULL)
+            return MALLOC_ERR; // realloc error
+        fs->resource_table->slots = slots;
+        int *free_fds = (int *) realloc(fs->resource_table->free_fds, \
+            capacity * sizeof(int));
+        if (free_fds == NULL)
+            return MALLOC_ERR; // realloc error
+        fs->resource_table->free_fds = free_fds;
+        memset(&slots[fs->resource_table->capacity], 0, \
+            (capacity - fs->resource_table->capacity) * sizeof(Resource_table_entry *));
+        fd = fs->resource_table->capacity;
+        fs->resource_table->capacity = capacity;
+    }
+
+    if (hash_insert(fs->open_index, name_key(entry->filename), entry) < 0)
+    {
+        fs->resource_table->free_fds[fs->resource_table->n_free++] = fd;
+        return MALLOC_ERR; // index malloc error
+    }
+    entry->fd = fd;
+    fs->resource_table->slots[fd] = entry;
+    fs->resource_table->size += 1;
+    return 0;
+}
+
+// close an open file and free its entry
+void remove_resource_table_entry(Mount *fs, Resource_table_entry *entry)
+{
+    hash_remove(fs->open_index, name_key(entry->filename));
+    fs->resource_table->slots[entry->fd] = NULL;
+    fs->resource_table->free_fds[fs->resource_table->n_free++] = entry->fd;
+    fs->resource_table->size -= 1;
+    pthread_mutex_destroy(&entry->lock);
+    free(entry->read_block);
+    free(entry->delay_data);
+    pool_free(fs->open_pool, entry);
+}
+
+// returns the root directory entry of filename,
+// or NULL if the file doesn't exist
+Root_inode_entry *find_root_inode_entry(Mount *fs, char *filename)
+{
+    if (fs->dir_index == NULL)
+        return NULL;
+    int probes;
+    Root_inode_entry *entry = (Root_inode_entry *) \
+        hash_find_probes(fs->dir_index, name_key(filename), &probes);
+    stat_add(STAT_DIR_LOOKUPS, 1);
+    stat_add(STAT_DIR_SCANNED, probes);
+    return entry;
+}
+
+// add an entry to the root directory and its index
+int add_root_inode_entry(Mount *fs, Root_inode_entry *entry)
+{
+    if (append(fs->root_dir, entry) < 0)
+        return MALLOC_ERR; // linked list malloc error
+    if (hash_insert(fs->dir_index, name_key(entry->filename), entry) < 0)
+    {
+        // take the entry back out of the list without freeing it
+        Node *cur = fs->root_dir->front;
+        while (cur->next != fs->root_dir->back)
+            cur = cur->next;
+        fs->root_dir->back->data = NULL;
+        delete(fs->root_dir, cur);
+        return MALLOC_ERR; // index malloc error
+    }
+    return 0;
+}
+
+// remove an entry from the root directory and its index, freeing it
+void remove_root_inode_entry(Mount *fs, Root_inode_entry *entry)
+{
+    hash_remove(fs->dir_index, name_key(entry->filename));
+    stat_add(STAT_DIR_LOOKUPS, 1);
+    Node *cur = fs->root_dir->front;
+    while (cur->next != NULL)
+    {
+        stat_add(STAT_DIR_SCANNED, 1);
+        if (cur->next->data == entry)
+        {
+            delete(fs->root_dir, cur);
+            return;
+        }
+        cur = cur->next;
+    }
+}
+
+// read the root directory from block 1 and its continuation blocks
+int load_directory(Mount *fs)
+{
+    fs->root_dir = create_pooled_list(fs->node_pool, fs->dir_pool);
+    fs->dir_spill = create_pooled_list(fs->node_pool, fs->spill_pool);
+    fs->dir_index = create_hash_index();
+    if (fs->root_dir == NULL || fs->dir_spill == NULL || fs->dir_index == NULL)
+        return MALLOC_ERR; // malloc error
+
+    // create directory block buffer
+    uint8_t *block = (uint8_t *) malloc(fs->block_size);
+    if (block == NULL)
+        return MALLOC_ERR; // malloc error
+
+    int disk_blocks = fs->free_map->n_blocks;
+    int addr = ROOT_INODE;
+    int i;
+    while (1)
+    {
+        int err = readBlock(fs->disk, addr, block);
+        if (err < 0)
+        {
+            free(block);
+            return err; // read error
+        }
+
+        // unpack the entries of this block
+        int count = get_u32(&block[DIR_COUNT_INDEX]);
+        if (count < 0 || count > DIR_ENTRIES_PER_BLOCK(fs->block_size))
+        {
+            free(block);
+            return INVALID_DISK; // corrupt directory
+        }
+        for (i = 0; i < count; i++)
+        {
+            uint8_t *packed = &block[DIR_ENTRY_INDEX + i * DIR_ENTRY_SIZE];
+            Root_inode_entry *entry = (Root_inode_entry *) \
+                alloc_data(fs->root_dir, sizeof(Root_inode_entry));
+            if (entry == NULL)
+            {
+                free(block);
+                return MALLOC_ERR; // malloc error
+            }
+            memcpy(entry->filename, packed, MAX_FILENAME_LEN);
+            entry->addr = get_u32(&packed[MAX_FILENAME_LEN]);
+            entry->size = get_u32(&packed[MAX_FILENAME_LEN + 4]);
+            if (find_root_inode_entry(fs, entry->filename) != NULL)
+            {
+                free_data(fs->root_dir, entry);
+                free(block);
+                return INVALID_DISK; // duplicate filename
+            }
+            if (add_root_inode_entry(fs, entry) < 0)
+            {
+                free_data(fs->root_dir, entry);
+                free(block);
+                return MALLOC_ERR; // malloc error
+            }
+        }
+
+        // follow the chain of directory blocks
+        int next = get_u32(&block[DIR_NEXT_INDEX]);
+        if (next == 0)
+            break;
+        if (next < 0 || next >= disk_blocks || fs->dir_spill->size >= disk_blocks)
+        {
+            free(block);
+            return INVALID_DISK; // corrupt directory
+        }
+        File_inode_entry *spill_entry = (File_inode_entry *) \
+            alloc_data(fs->dir_spill, sizeof(File_inode_entry));
+        if (spill_entry == NULL)
+        {
+            free(block);
+            return MALLOC_ERR; // malloc error
+        }
+        spill_entry->addr = next;
+        if (append(fs->dir_spill, spill_entry) < 0)
+        {
+            free_data(fs->dir_spill, spill_entry);
+            free(block);
+            return MALLOC_ERR; // linked list malloc error
+        }
+        addr = next;
+    }
+
+    free(block);
+    return 0;
+}
+
+// number of continuation blocks the directory needs after block 1
+int dir_spill_needed(Mount *fs)
+{
+    return dir_spill_blocks(fs, fs->root_dir->size);
+}
+
+// number of continuation blocks a directory of n_entries entries needs
+int dir_spill_blocks(Mount *fs, int n_entries)
+{
+    if (n_entries <= DIR_ENTRIES_PER_BLOCK(fs->block_size))
+        return 0;
+    return (n_entries - 1) / DIR_ENTRIES_PER_BLOCK(fs->block_size);
+}
+
+// write the root directory to block 1 and as many continuation blocks as
+// it needs. continuation blocks are allocated or freed in the free map,
+// the caller writes it back with store_free_map
+int store_directory(Mount *fs)
+{
+    int err = resize_chain(fs, fs->dir_spill, dir_spill_needed(fs));
+    if (err < 0)
+        return err; // disk full or malloc error
+
+    // create directory block buffers
+    uint8_t *block = (uint8_t *) malloc(fs->block_size);
+    uint8_t *stored = (uint8_t *) malloc(fs->block_size);
+    if (block == NULL || stored == NULL)
+    {
+        free(block);
+        free(stored);
+        return MALLOC_ERR; // malloc error
+    }
+
+    // pack the entries block by block
+    Node *cur = fs->root_dir->front->next;
+    Node *spill = fs->dir_spill->front->next;
+    int addr = ROOT_INODE;
+    while (1)
+    {
+        memset(block, 0, fs->block_size);
+        int count = 0;
+        while (cur != NULL && count < DIR_ENTRIES_PER_BLOCK(fs->block_size))
+        {
+            Root_inode_entry *entry = (Root_inode_entry *) cur->data;
+            uint8_t *packed = &block[DIR_ENTRY_INDEX + count * DIR_ENTRY_SIZE];
+            memcpy(packed, entry->filename, MAX_FILENAME_LEN);
+            put_u32(&packed[MAX_FILENAME_LEN], entry->addr);
+            put_u32(&packed[MAX_FILENAME_LEN + 4], entry->size);
+            count++;
+            cur = cur->next;
+        }
+        put_u32(&block[DIR_COUNT_INDEX], count);
+        if (spill != NULL)
+            put_u32(&block[DIR_NEXT_INDEX], \
+                ((File_inode_entry *) spill->data)->addr);
+
+        // only blocks that changed are written, and logged
+        err = read_meta(fs, addr, stored);
+        if (err == 0 && memcmp(stored, block, fs->block_size) != 0)
+            err = write_meta(fs, addr, block);
+        if (err < 0)
+        {
+            free(block);
+            free(stored);
+            return err; // read or write error
+        }
+
+        if (spill == NULL)
+            break;
+        addr = ((File_inode_entry *) spill->data)->addr;
+        spill = spill->next;
+    }
+
+    free(block);
+    free(stored);
+    return 0;
+}
+
+// make an empty in memory file inode
+int create_file_inode(Mount *fs, File_inode *inode)
+{
+    inode->ctime = 0;
+    inode->atime = 0;
+    inode->mtime = 0;
+    inode->n_extents = 0;
+    inode->n_blocks = 0;
+    inode->capacity = EXTENTS_INITIAL_CAPACITY;
+    inode->extents = (File_extent *) malloc(inode->capacity * sizeof(File_extent));
+    inode->spill = create_pooled_list(fs->node_pool, fs->spill_pool);
+    if (inode->extents == NULL || inode->spill == NULL)
+    {
+        free_file_inode(inode);
+        return MALLOC_ERR; // malloc error
     }
+    return 0;
+}
 
-    // create root directory inode buffer
-    uint8_t *root_inode = (uint8_t *) malloc(BLOCKSIZE);
-    if (root_inode == NULL)
+// read the file inode at addr and its block map continuation blocks
+int read_file_inode(Mount *fs, int addr, File_inode *inode)
+{
+    int err = create_file_inode(fs, inode);
+    if (err < 0)
+        return err; // malloc error
+
+    // create file inode buffer
+    uint8_t *block = (uint8_t *) malloc(fs->block_size);
+    if (block == NULL)
     {
-        free(filename);
+        free_file_inode(inode);
         return MALLOC_ERR; // malloc error
     }
-    
-    // read the block containing the root directory inode
-    err = readBlock(mounted_disk, ROOT_INODE, root_inode);
+
+    err = read_meta(fs, addr, block);
     if (err < 0)
     {
-        free(filename);
-        free(root_inode);
+        free(block);
+        free_file_inode(inode);
         return err; // read error
     }
 
-    // find block with file inode
-    int file_inode_addr = 0;
-    Node *cur = (*((LinkedList **) root_inode))->front;
-    while (cur->next != NULL)
+    // get time stamps
+    inode->ctime = get_i64(&block[CTIME_INDEX]);
+    inode->atime = get_i64(&block[ATIME_INDEX]);
+    inode->mtime = get_i64(&block[MTIME_INDEX]);
+
+    // unpack the extents, first from the inode then the continuation blocks
+    int disk_blocks = fs->free_map->n_blocks;
+    int next = get_u32(&block[INODE_NEXT_INDEX]);
+    int count = get_u32(&block[INODE_COUNT_INDEX]);
+    int max_count = INODE_EXTENTS_PER_BLOCK(fs->block_size);
+    uint8_t *packed = &block[INODE_MAP_INDEX];
+    int i;
+    while (1)
     {
-        if (!strncmp(((Root_inode_entry *) cur->next->data)->filename, \
-            filename, MAX_FILENAME_LEN))
+        if (count < 0 || count > max_count)
         {
-            file_inode_addr = ((Root_inode_entry *) cur->next->data)->addr;
+            free(block);
+            free_file_inode(inode);
+            return INVALID_DISK; // corrupt block map
+        }
+        for (i = 0; i < count; i++)
+        {
+            int start = get_u32(&packed[i * EXTENT_SIZE]);
+            int length = get_u32(&packed[i * EXTENT_SIZE + 4]);
+            if (start <= 0 || length <= 0 || start > disk_blocks - length)
+            {
+                free(block);
+                free_file_inode(inode);
+                return INVALID_DISK; // corrupt extent
+            }
+
+            // make room for the extent
+            if (inode->n_extents == inode->capacity)
+            {
+                File_extent *extents = (File_extent *) realloc(inode->extents, \
+                    2 * inode->capacity * sizeof(File_extent));
+                if (extents == NULL)
+                {
+                    free(block);
+                    free_file_inode(inode);
+                    return MALLOC_ERR; // realloc error
+                }
+                inode->extents = extents;
+                inode->capacity *= 2;
+            }
+            inode->extents[inode->n_extents].start = start;
+            inode->extents[inode->n_extents].length = length;
+            inode->extents[inode->n_extents].logical = inode->n_blocks;
+            inode->n_extents += 1;
+            inode->n_blocks += length;
+        }
+
+        if (next == 0)
             break;
+        if (next < 0 || next >= disk_blocks || inode->spill->size >= disk_blocks)
+        {
+            free(block);
+            free_file_inode(inode);
+            return INVALID_DISK; // corrupt block map
         }
-        cur = cur->next;
+
+        // remember the continuation block and read it
+        File_inode_entry *spill_entry = (File_inode_entry *) \
+            alloc_data(inode->spill, sizeof(File_inode_entry));
+        if (spill_entry == NULL || append(inode->spill, spill_entry) < 0)
+        {
+            free_data(inode->spill, spill_entry);
+            free(block);
+            free_file_inode(inode);
+            return MALLOC_ERR; // malloc error
+        }
+        spill_entry->addr = next;
+        err = read_meta(fs, next, block);
+        if (err < 0)
+        {
+            free(block);
+            free_file_inode(inode);
+            return err; // read error
+        }
+        next = get_u32(&block[MAP_NEXT_INDEX]);
+        count = get_u32(&block[MAP_COUNT_INDEX]);
+        max_count = MAP_EXTENTS_PER_BLOCK(fs->block_size);
+        packed = &block[MAP_EXTENT_INDEX];
     }
 
-    // free filename
-    free(filename);
-    free(root_inode);
+    free(block);
+    return 0;
+}
+
+// write the file inode at addr and the continuation blocks its block map
+// needs. continuation blocks are allocated or freed in the free map, the
+// caller writes it back with store_free_map
+int write_file_inode(Mount *fs, int addr, File_inode *inode)
+{
+    // number of continuation blocks needed after the inode
+    int needed = 0;
+    int inode_extents = INODE_EXTENTS_PER_BLOCK(fs->block_size);
+    int map_extents = MAP_EXTENTS_PER_BLOCK(fs->block_size);
+    if (inode->n_extents > inode_extents)
+        needed = (inode->n_extents - inode_extents + map_extents - 1) / map_extents;
+    int err = resize_chain(fs, inode->spill, needed);
+    if (err < 0)
+        return err; // disk full or malloc error
 
     // create file inode buffer
-    uint8_t *file_inode = (uint8_t *) malloc(BLOCKSIZE);
-    if (file_inode == NULL)
+    uint8_t *block = (uint8_t *) malloc(fs->block_size);
+    if (block == NULL)
         return MALLOC_ERR; // malloc error
-    
-    // read the block containing the file inode
-    err = readBlock(mounted_disk, file_inode_addr, file_inode);
-    if (err < 0)
+
+    // pack time stamps
+    memset(block, 0, fs->block_size);
+    put_i64(&block[CTIME_INDEX], inode->ctime);
+    put_i64(&block[ATIME_INDEX], inode->atime);
+    put_i64(&block[MTIME_INDEX], inode->mtime);
+
+    // pack the extents, first into the inode then the continuation blocks
+    int extent = 0;
+    Node *spill = inode->spill->front->next;
+    int next_index = INODE_NEXT_INDEX;
+    int count_index = INODE_COUNT_INDEX;
+    int extent_index = INODE_MAP_INDEX;
+    int max_count = inode_extents;
+    while (1)
     {
-        free(file_inode);
-        return err; // read error
+        int count = 0;
+        while (extent < inode->n_extents && count < max_count)
+        {
+            uint8_t *packed = &block[extent_index + count * EXTENT_SIZE];
+            put_u32(packed, inode->extents[extent].start);
+            put_u32(&packed[4], inode->extents[extent].length);
+            count++;
+            extent++;
+        }
+        put_u32(&block[count_index], count);
+        if (spill != NULL)
+            put_u32(&block[next_index], \
+                ((File_inode_entry *) spill->data)->addr);
+
+        err = write_meta(fs, addr, block);
+        if (err < 0)
+        {
+            free(block);
+            return err; // write error
+        }
+
+        if (spill == NULL)
+            break;
+        addr = ((File_inode_entry *) spill->data)->addr;
+        spill = spill->next;
+        memset(block, 0, fs->block_size);
+        next_index = MAP_NEXT_INDEX;
+        count_index = MAP_COUNT_INDEX;
+        extent_index = MAP_EXTENT_INDEX;
+        max_count = map_extents;
     }
 
-    // get creation time
-    localtime_r((time_t *)&file_inode[sizeof(LinkedList *)], creation_time);
+    free(block);
+    return 0;
+}
 
-    // get access time
-    time((time_t *)&file_inode[sizeof(LinkedList *) + sizeof(time_t *)]);
-    localtime_r((time_t *)&file_inode[sizeof(LinkedList *) + sizeof(time_t *)], access_time);
+void free_file_inode(File_inode *inode)
+{
+    free(inode->extents);
+    if (inode->spill != NULL)
+        free_linked_list(inode->spill);
+    inode->extents = NULL;
+    inode->spill = NULL;
+}
 
-    // get modification time
-    localtime_r((time_t *)&file_inode[sizeof(LinkedList *) + 2 * sizeof(time_t *)], modification_time);
+// returns the extent holding the index-th block of the file,
+// or -1 if the file is shorter
+int find_extent(File_inode *inode, int index)
+{
+    if (index < 0 || index >= inode->n_blocks)
+        return -1;
 
-    // free file inode
-    free(file_inode);
+    // binary search on the first block of each extent
+    int low = 0;
+    int high = inode->n_extents - 1;
+    while (low < high)
+    {
+        int mid = (low + high + 1) / 2;
+        if (inode->extents[mid].logical <= index)
+            low = mid;
+        else
+            high = mid - 1;
+    }
+    return low;
+}
 
-    // successful return
+// returns the address of the index-th block of the file,
+// or -1 if the file is shorter
+int get_file_block(File_inode *inode, int index)
+{
+    int extent = find_extent(inode, index);
+    if (extent < 0)
+        return -1;
+    return inode->extents[extent].start + index - inode->extents[extent].logical;
+}
+
+// add a block to the end of the file, growing the last extent if the
+// block follows it on disk
+int add_file_block(File_inode *inode, int addr)
+{
+    if (inode->n_extents > 0)
+    {
+        File_extent *last = &inode->extents[inode->n_extents - 1];
+        if (last->start + last->length == addr)
+        {
+            last->length += 1;
+            inode->n_blocks += 1;
+            return 0;
+        }
+    }
+
+    // start a new extent
+    if (inode->n_extents == inode->capacity)
+    {
+        File_extent *extents = (File_extent *) realloc(inode->extents, \
+            2 * inode->capacity * sizeof(File_extent));
+        if (extents == NULL)
+            return MALLOC_ERR; // realloc error
+        inode->extents = extents;
+        inode->capacity *= 2;
+    }
+    inode->extents[inode->n_extents].start = addr;
+    inode->extents[inode->n_extents].length = 1;
+    inode->extents[inode->n_extents].logical = inode->n_blocks;
+    inode->n_extents += 1;
+    inode->n_blocks += 1;
     return 0;
 }
 
+// cut the file down to its first n_blocks blocks, freeing the rest
+// returns 0 if successful or MALLOC_ERR, the free map changes must then be
+// discarded
+int truncate_file_blocks(Mount *fs, File_inode *inode, int n_blocks)
+{
+    int i;
+    while (inode->n_blocks > n_blocks)
+    {
+        File_extent *last = &inode->extents[inode->n_extents - 1];
+        int keep = n_blocks - last->logical;
+        if (keep < 0)
+            keep = 0;
+        for (i = keep; i < last->length; i++)
+            if (free_block(fs, last->start + i) < 0)
+                return MALLOC_ERR; // malloc error
+        inode->n_blocks -= last->length - keep;
+        last->length = keep;
+        if (keep == 0)
+            inode->n_extents -= 1;
+    }
+    return 0;
+}
 
+// grow the file to n_blocks blocks. new blocks are taken in runs, each
+// starting right after the last block of the file if that one is free
+// returns DISK_FULL or MALLOC_ERR if it can't, the free map changes must
+// then be discarded
+int grow_file_blocks(Mount *fs, File_inode *inode, int n_blocks)
+{
+    while (inode->n_blocks < n_blocks)
+    {
+        int hint = -1;
+        if (inode->n_extents > 0)
+            hint = inode->extents[inode->n_extents - 1].start + \
+                inode->extents[inode->n_extents - 1].length;
+        int length;
+        int addr = unfree_free_run(fs, hint, n_blocks - inode->n_blocks, &length);
+        if (addr < 0)
+            return addr; // no more disk space
+        int i;
+        for (i = 0; i < length; i++)
+            if (add_file_block(inode, addr + i) < 0)
+                return MALLOC_ERR; // malloc error
+    }
+    return 0;
+}
 
-// if the file is open, puts the file described by FD in the filename buffer
-// returns 0 if successful, -1 if the file isn;t open/doesn't exist.
-int get_filename(fileDescriptor FD, char *filename)
+// grow or shrink a chain of continuation blocks to needed blocks
+// blocks are allocated or freed in the free map
+int resize_chain(Mount *fs, LinkedList *chain, int needed)
 {
-    // check if file exists and is open
-    Node *cur = resource_table->front;
-    while (cur->next != NULL)
-    {
-        if (((Resource_table_entry *) cur->next->data)->fd == FD)
+    // allocate missing continuation blocks
+    while (chain->size < needed)
+    {
+        int addr = unfree_first_free_block(fs);
+        if (addr < 0)
+            return addr; // no free blocks
+        File_inode_entry *entry = (File_inode_entry *) \
+            alloc_data(chain, sizeof(File_inode_entry));
+        if (entry == NULL || append(chain, entry) < 0)
         {
-            strncpy(filename, ((Resource_table_entry *) \
-                cur->next->data)->filename, MAX_FILENAME_LEN);
-            return 0;
+            free_block(fs, addr);
+            free_data(chain, entry);
+            return MALLOC_ERR; // malloc error
         }
-        cur = cur->next;
+        entry->addr = addr;
+    }
+
+    // free continuation blocks that are no longer used
+    while (chain->size > needed)
+    {
+        Node *cur = chain->front;
+        while (cur->next != chain->back)
+            cur = cur->next;
+        if (free_block(fs, ((File_inode_entry *) chain->back->data)->addr) < 0)
+            return MALLOC_ERR; // malloc error
+        delete(chain, cur);
+    }
+    return 0;
+}
+
+// drop the continuation blocks of a chain past needed without freeing
+// them, for an operation whose free map changes are discarded
+void trim_chain(LinkedList *chain, int needed)
+{
+    while (chain->size > needed)
+    {
+        Node *cur = chain->front;
+        while (cur->next != chain->back)
+            cur = cur->next;
+        delete(chain, cur);
     }
-    return NO_FD;
 }
 
 void free_all()
 {
-    int err;
-    // create root directory inode buffer
-    uint8_t *root_inode = (uint8_t *) malloc(BLOCKSIZE);
-    if (root_inode == NULL)
-        return; // malloc error
-    uint8_t *file_inode = (uint8_t *) malloc(BLOCKSIZE);
-    if (file_inode == NULL)
-    {
-        free(root_inode);
-        return; // malloc error
-    }
-    
-    // read the block containing the root directory inode
-    err = readBlock(mounted_disk, ROOT_INODE, root_inode);
-    if (err < 0)
+    // unmount every disk, this frees the directories and open files
+    mountHandle m;
+    for (m = 0; m < MAX_MOUNTS; m++)
+        tfsm_unmount(m);
+
+    Mount *fs = get_mount(DEFAULT_MOUNT);
+    pthread_rwlock_wrlock(&fs->fs_lock);
+    free_open_table(fs);
+    pthread_rwlock_unlock(&fs->fs_lock);
+}
+
+// free the open file table of an unmounted file system
+static void free_open_table(Mount *fs)
+{
+    if (fs->resource_table != NULL)
+    {
+        free_resource_table(fs->resource_table);
+        fs->resource_table = NULL;
+    }
+    if (fs->open_index != NULL)
     {
-        free(root_inode);
-        free(file_inode);
-        return;
+        free_hash_index(fs->open_index);
+        fs->open_index = NULL;
     }
+}
 
-    // delete all file on disk
-    Node* cur = (*((LinkedList **) root_inode))->front;
-    while (cur->next != NULL)
+// every slot starts out unmounted with its locks ready
+static void init_mount_table(void)
+{
+    int m;
+    for (m = 0; m < MAX_MOUNTS; m++)
+    {
+        Mount *fs = &mount_table[m];
+        memset(fs, 0, sizeof(Mount));
+        pthread_rwlock_init(&fs->fs_lock, NULL);
+        pthread_mutex_init(&fs->alloc_lock, NULL);
+        pthread_mutex_init(&fs->meta_lock, NULL);
+        fs->disk = -1;
+        fs->block_size = BLOCKSIZE;
+        fs->sync_interval = DEFAULT_SYNC_INTERVAL;
+    }
+    mount_table[DEFAULT_MOUNT].in_use = 1;
+}
+
+// returns the mount table slot of handle m, or NULL if m is out of range
+// or was given back by tfsm_unmount
+static Mount *get_mount(mountHandle m)
+{
+    pthread_once(&table_once, init_mount_table);
+    if (m < 0 || m >= MAX_MOUNTS || \
+        !__atomic_load_n(&mount_table[m].in_use, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &mount_table[m];
+}
+
+// give the slot of handle m back for the next tfsm_mount
+static void release_mount(mountHandle m)
+{
+    pthread_mutex_lock(&table_lock);
+    __atomic_store_n(&mount_table[m].in_use, 0, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&table_lock);
+}
+
+// returns the block size recorded in the superblock of the mounted disk,
+// which was opened with the default block size. the header fits in the
+// first BLOCKSIZE bytes whatever the block size of the file system
+int read_block_size(Mount *fs)
+{
+    uint8_t *block = (uint8_t *) malloc(BLOCKSIZE);
+    if (block == NULL)
+        return MALLOC_ERR; // malloc error
+    int err = readBlock(fs->disk, SUPERBLOCK, block);
+    if (err < 0)
     {
-        err = readBlock(mounted_disk, ((Root_inode_entry *) \
-            cur->next->data)->addr, file_inode);
-        if (err < 0)
-        {
-            free(root_inode);
-            free(file_inode);
-            return;
-        }
-        free_linked_list(*((LinkedList **) file_inode));
-        cur = cur->next;
+        free(block);
+        return err; // read error
     }
+    int size = get_u32(&block[SB_BLOCKSIZE_INDEX]);
+    free(block);
+    if (size < MIN_BLOCKSIZE || size > MAX_BLOCKSIZE || (size & (size - 1)) != 0)
+        return INVALID_DISK; // Disk is invalid
+    return size;
+}
+
+// open the journal recorded in the superblock of the mounted disk and
+// replay its last commits. a file system without a journal is left alone
+int open_journal(Mount *fs)
+{
+    uint8_t *block = (uint8_t *) malloc(fs->block_size);
+    if (block == NULL)
+        return MALLOC_ERR; // malloc error
+    int err = readBlock(fs->disk, SUPERBLOCK, block);
+    int64_t start = get_u32(&block[SB_JOURNAL_INDEX]);
+    int64_t n_blocks = get_u32(&block[SB_JOURNAL_BLOCKS_INDEX]);
+    free(block);
+    if (err < 0)
+        return err; // read error
+    if (n_blocks == 0)
+        return 0; // no journal
+    if (start < BITMAP_START || n_blocks < 2 || \
+        start + n_blocks > get_disk_size(fs->disk) / fs->block_size)
+        return INVALID_DISK; // Disk is invalid
 
-    free_linked_list(*((LinkedList **) root_inode));
-    free_linked_list(resource_table);
-    free(root_inode);
-    free(file_inode);
+    fs->journal = create_journal(fs->disk, (int) start, (int) n_blocks);
+    if (fs->journal == NULL)
+        return MALLOC_ERR; // malloc error
+    return replay_journal(fs->journal);
 }
 
-// free block in free blocks list
-void free_block(uint8_t *superblock, int index)
+// read a metadata block, the running journal transaction may have a newer
+// copy than the disk
+int read_meta(Mount *fs, int addr, void *block)
 {
-    superblock[FREE_LIST_INDEX + index / BYTE] &= ~(ONE << index % BYTE);
+    int found = 0;
+    if (fs->journal != NULL)
+    {
+        pthread_mutex_lock(&fs->meta_lock);
+        found = journal_read(fs->journal, addr, block);
+        pthread_mutex_unlock(&fs->meta_lock);
+    }
+    if (found)
+        return 0;
+    return readBlock(fs->disk, addr, block);
 }
 
-// unfree block in free blocks list
-void unfree_block(uint8_t *superblock, int index)
+// write a metadata block, through the journal if the file system has one
+int write_meta(Mount *fs, int addr, void *block)
 {
-    superblock[FREE_LIST_INDEX + index / BYTE] |= (ONE << index % BYTE);
+    if (fs->journal == NULL)
+        return writeBlock(fs->disk, addr, block);
+    pthread_mutex_lock(&fs->meta_lock);
+    int err = journal_write(fs->journal, addr, block);
+    pthread_mutex_unlock(&fs->meta_lock);
+    return err;
 }
 
-// unfree first block in free blocks list
-// returns the address of that block
-// returns -1 if there are no free blocks
-int unfree_first_free_block(uint8_t *superblock)
+// read the superblock of the mounted disk into memory, check the file
+// system is valid and load the free block bit array into the free map
+int load_free_map(Mount *fs)
 {
-    int i = 0;
-    int j = 0;
-    int disk_blocks = get_disk_size(mounted_disk) / BLOCKSIZE;
-    for (i = FREE_LIST_INDEX; i < FREE_LIST_INDEX + disk_blocks / BYTE; i++)
+    // the superblock stays in memory until unmount
+    fs->superblock = (uint8_t *) malloc(fs->block_size);
+    if (fs->superblock == NULL)
+        return MALLOC_ERR; // malloc error
+
+    int err = readBlock(fs->disk, SUPERBLOCK, fs->superblock);
+    if (err < 0)
+        return err; // read error
+    if ((fs->superblock[MAGIC_INDEX] != MAGIC) || \
+        (fs->superblock[ROOT_INODE_INDEX] != ROOT_INODE))
+        return INVALID_DISK; // Disk is invalid
+
+    // the file system must fit on the disk with room for its bit array,
+    // either in the superblock or in the blocks after the root directory
+    int64_t n_blocks = get_u32(&fs->superblock[SB_BLOCKS_INDEX]);
+    int64_t bitmap_blocks = get_u32(&fs->superblock[SB_BITMAP_BLOCKS_INDEX]);
+    fs->bitmap_start = get_u32(&fs->superblock[SB_BITMAP_INDEX]);
+    fs->bitmap_offset = fs->bitmap_start == SUPERBLOCK ? SB_INLINE_BITMAP_INDEX : 0;
+    int inline_ok = fs->bitmap_start == SUPERBLOCK && bitmap_blocks == 1 && \
+        n_blocks >= BITMAP_START && n_blocks <= INLINE_BITMAP_BITS(fs->block_size);
+    int blocks_ok = fs->bitmap_start == BITMAP_START && \
+        bitmap_blocks == (n_blocks + BITS_PER_BITMAP_BLOCK(fs->block_size) - 1) / \
+            BITS_PER_BITMAP_BLOCK(fs->block_size) && \
+        BITMAP_START + bitmap_blocks <= n_blocks;
+    if (n_blocks > get_disk_size(fs->disk) / fs->block_size || (!inline_ok && !blocks_ok))
+        return INVALID_DISK; // Disk is invalid
+
+    // the journal, if any, follows the bit array
+    int64_t journal_start = get_u32(&fs->superblock[SB_JOURNAL_INDEX]);
+    int64_t journal_blocks = get_u32(&fs->superblock[SB_JOURNAL_BLOCKS_INDEX]);
+    int64_t first_free = inline_ok ? BITMAP_START : BITMAP_START + bitmap_blocks;
+    if (journal_blocks == 0 ? journal_start != 0 : \
+        journal_start != first_free || journal_start + journal_blocks > n_blocks)
+        return INVALID_DISK; // Disk is invalid
+
+    fs->free_map = create_free_map((int) n_blocks, fs->block_size - fs->bitmap_offset);
+    if (fs->free_map == NULL)
+        return MALLOC_ERR; // malloc error
+    if (fs->bitmap_start == SUPERBLOCK)
+    {
+        free_map_load_chunk(fs->free_map, 0, &fs->superblock[fs->bitmap_offset]);
+        return 0;
+    }
+
+    // read the bit array LOAD_BATCH_BLOCKS blocks at a time, each batch
+    // is adjacent so it takes a single call
+    uint8_t *batch = (uint8_t *) malloc((size_t) LOAD_BATCH_BLOCKS * fs->block_size);
+    int *addrs = (int *) malloc(LOAD_BATCH_BLOCKS * sizeof(int));
+    void **blocks = (void **) malloc(LOAD_BATCH_BLOCKS * sizeof(void *));
+    if (batch == NULL || addrs == NULL || blocks == NULL)
+    {
+        free(batch);
+        free(addrs);
+        free(blocks);
+        return MALLOC_ERR; // malloc error
+    }
+    int i, j;
+    for (i = 0; i < bitmap_blocks; i += LOAD_BATCH_BLOCKS)
     {
-        if (superblock[i] != 0b11111111)
+        int n = bitmap_blocks - i < LOAD_BATCH_BLOCKS ? bitmap_blocks - i : LOAD_BATCH_BLOCKS;
+        for (j = 0; j < n; j++)
         {
-            for (j = 0; j < BYTE; j++)
-            {
-                if (!(superblock[i] & (ONE << j)))
-                {
-                    // unfree block
-                    superblock[i] |= (ONE << j);
-                    
-                    // update root directory inode
-                    return BYTE * (i - FREE_LIST_INDEX) + j; 
-                }
-            }
+            addrs[j] = fs->bitmap_start + i + j;
+            blocks[j] = &batch[(size_t) j * fs->block_size];
         }
+        err = readBlocks(fs->disk, n, addrs, blocks);
+        if (err < 0)
+            break; // read error
+        for (j = 0; j < n; j++)
+            free_map_load_chunk(fs->free_map, i + j, blocks[j]);
+    }
+
+    free(batch);
+    free(addrs);
+    free(blocks);
+    return err < 0 ? err : 0;
+}
+
+// write the blocks of the bit array that changed since the last store
+int store_free_map(Mount *fs)
+{
+    if (fs->free_map->n_dirty == 0)
+        return 0; // nothing changed
+
+    // an inline bit array is written with the in memory superblock
+    if (fs->bitmap_start == SUPERBLOCK)
+    {
+        free_map_store_chunk(fs->free_map, 0, &fs->superblock[fs->bitmap_offset]);
+        int err = write_meta(fs, SUPERBLOCK, fs->superblock);
+        if (err < 0)
+            return err; // write error
+        free_map_clean(fs->free_map);
+        return 0;
     }
-    for (j = 0; j < disk_blocks % BYTE; j++)
+
+    // make block buffer
+    uint8_t *block = (uint8_t *) malloc(fs->block_size);
+    if (block == NULL)
+        return MALLOC_ERR; // malloc error
+
+    int i;
+    for (i = 0; i < fs->free_map->n_dirty; i++)
     {
-        if (!(superblock[i] & (ONE << j)))
+        int chunk = fs->free_map->dirty_list[i];
+        free_map_store_chunk(fs->free_map, chunk, block);
+        int err = write_meta(fs, fs->bitmap_start + chunk, block);
+        if (err < 0)
         {
-            // unfree block
-            superblock[i] |= (ONE << j);
-            
-            // update root directory inode
-            return BYTE * (i - FREE_LIST_INDEX) + j; 
+            free(block);
+            return err; // write error
         }
     }
-    return DISK_FULL; // no free blocks
-}
\ No newline at end of file
+    free_map_clean(fs->free_map);
+
+    free(block);
+    return 0;
+}
+
+// start an operation that allocates or frees blocks, the free map stays
+// locked until end_free_map or discard_free_map
+void begin_free_map(Mount *fs)
+{
+    pthread_mutex_lock(&fs->alloc_lock);
+    if (fs->free_map != NULL)
+        free_map_begin(fs->free_map);
+    fs->freed_mark = fs->n_freed;
+}
+
+// throw away the changes the current operation made to the free map
+void discard_free_map(Mount *fs)
+{
+    if (fs->free_map != NULL)
+        free_map_rollback(fs->free_map);
+    fs->n_freed = fs->freed_mark;
+    pthread_mutex_unlock(&fs->alloc_lock);
+}
+
+// finish the current operation, keeping its changes to the free map
+void end_free_map(Mount *fs)
+{
+    if (fs->free_map != NULL)
+        free_map_end(fs->free_map);
+    pthread_mutex_unlock(&fs->alloc_lock);
+}
+
+// free block in the free map. with a journal the block is only queued for
+// the next sync, which also makes sure the journal never replays it over
+// the data of its next owner
+// returns 0 if successful or MALLOC_ERR, the free map is left as it was
+int free_block(Mount *fs, int index)
+{
+    if (fs->journal == NULL)
+    {
+        if (free_map_free(fs->free_map, index) < 0)
+            return MALLOC_ERR; // undo log realloc error
+        return 0;
+    }
+
+    // make room in the queue
+    if (fs->n_freed == fs->freed_capacity)
+    {
+        int capacity = fs->freed_capacity == 0 ? FREED_INITIAL_CAPACITY : \
+            2 * fs->freed_capacity;
+        int *grown = (int *) realloc(fs->freed_blocks, capacity * sizeof(int));
+        if (grown == NULL)
+            return MALLOC_ERR; // realloc error
+        fs->freed_blocks = grown;
+        fs->freed_capacity = capacity;
+    }
+    fs->freed_blocks[fs->n_freed] = index;
+    fs->n_freed += 1;
+    return 0;
+}
+
+// free the blocks queued by free_block, called by tfs_sync just before the
+// free map is stored and the journal commits. they are dropped from the
+// running transaction and revoked if the last commit logged them. no
+// operation is logging free map changes, so freeing them can't fail
+void release_freed_blocks(Mount *fs)
+{
+    int i;
+    pthread_mutex_lock(&fs->meta_lock);
+    for (i = 0; i < fs->n_freed; i++)
+    {
+        journal_forget(fs->journal, fs->freed_blocks[i]);
+        free_map_free(fs->free_map, fs->freed_blocks[i]);
+    }
+    pthread_mutex_unlock(&fs->meta_lock);
+    fs->n_freed = 0;
+    fs->freed_mark = 0;
+}
+
+// returns 1 if a sync would free more blocks, 0 if not
+int freed_blocks_waiting(Mount *fs)
+{
+    pthread_mutex_lock(&fs->alloc_lock);
+    int waiting = fs->n_freed > 0;
+    pthread_mutex_unlock(&fs->alloc_lock);
+    return waiting;
+}
+
+// unfree block in the free map
+// returns 0 if successful or MALLOC_ERR, the free map is left as it was
+int unfree_block(Mount *fs, int index)
+{
+    if (free_map_unfree(fs->free_map, index) < 0)
+        return MALLOC_ERR; // undo log realloc error
+    return 0;
+}
+
+// unfree the next free block after the last one allocated, wrapping around
+// to the start of the disk
+// returns the address of that block
+// returns DISK_FULL if there are no free blocks
+// returns MALLOC_ERR if the free map can't log the change
+int unfree_first_free_block(Mount *fs)
+{
+    if (fs->free_map == NULL)
+        return DISK_FULL; // no file system mounted
+    if (fs->free_map->n_free <= fs->reserved_blocks)
+        return DISK_FULL; // the rest are reserved for delayed blocks
+    int index = free_map_alloc(fs->free_map);
+    if (index == FREE_MAP_NO_UNDO)
+        return MALLOC_ERR; // undo log realloc error
+    if (index < 0)
+        return DISK_FULL; // no free blocks
+    stat_add(STAT_BLOCK_ALLOCS, 1);
+    return index;
+}
+
+// unfree up to want adjacent free blocks, starting at hint if that block is
+// free, and put how many in length. blocks reserved for delayed blocks are
+// left alone
+// returns the address of the first block
+// returns DISK_FULL if there are no free blocks
+// returns MALLOC_ERR if the free map can't log the change
+int unfree_free_run(Mount *fs, int hint, int want, int *length)
+{
+    if (fs->free_map == NULL)
+        return DISK_FULL; // no file system mounted
+    if (want > fs->free_map->n_free - fs->reserved_blocks)
+        want = fs->free_map->n_free - fs->reserved_blocks;
+    int index = free_map_alloc_run(fs->free_map, hint, want, length);
+    if (index == FREE_MAP_NO_UNDO)
+        return MALLOC_ERR; // undo log realloc error
+    if (index < 0)
+        return DISK_FULL; // no free blocks
+    stat_add(STAT_RUN_ALLOCS, 1);
+    stat_add(STAT_RUN_BLOCKS, *length);
+    return index;
+}
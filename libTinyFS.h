@@ -5,13 +5,19 @@
 #include <stdint.h>
 #include <unistd.h>
 #include <time.h>
+#include <pthread.h>
 
 #include "libDisk.h"
 #include "linkedList.h"
+#include "hashIndex.h"
+#include "freeMap.h"
+#include "journal.h"
+#include "stats.h"
 
 
 #define DEFAULT_DISK_SIZE 10240
 #define DEFAULT_DISK_NAME "tinyFSDisk"
+#define DEFAULT_SYNC_INTERVAL 5 // seconds
 #define MAGIC 90 // 0x5A
 #define MAX_FILENAME_LEN 8
 
@@ -21,12 +27,74 @@
 #define SUPERBLOCK 0
 #define ROOT_INODE 1
 
-#define MAGIC_INDEX 0
-#define ROOT_INODE_INDEX 1
-#define FREE_LIST_INDEX 2
+// superblock (block 0)
+// integers are stored as uint32_t
+#define MAGIC_INDEX 0               // magic number, one byte
+#define ROOT_INODE_INDEX 1          // block of root directory, one byte
+#define SB_BLOCKS_INDEX 4           // number of blocks in the file system
+#define SB_BITMAP_INDEX 8           // first block of the free block bit array
+#define SB_BITMAP_BLOCKS_INDEX 12   // number of blocks in the bit array
+#define SB_BLOCKSIZE_INDEX 16       // bytes per block
+#define SB_JOURNAL_INDEX 20         // first block of the journal, 0 if none
+#define SB_JOURNAL_BLOCKS_INDEX 24  // number of blocks in the journal
+#define SB_INLINE_BITMAP_INDEX 32   // bit array of small file systems
+
+// free block bit array, one bit per block
+// 0 bit = free, 1 bit = not free, bytes are little endian
+// small file systems keep it in the rest of the superblock, larger ones in
+// as many blocks as needed after the root directory
+#define BITMAP_START 2
+#define BITS_PER_BITMAP_BLOCK(bs) ((bs) * BYTE)
+#define INLINE_BITMAP_BITS(bs) (((bs) - SB_INLINE_BITMAP_INDEX) * BYTE)
+
+// metadata journal, in the blocks after the bit array. file systems of
+// fewer than JOURNAL_MIN_FS_BLOCKS blocks have none, larger ones get one
+// block in JOURNAL_FRACTION, at least JOURNAL_MIN_BLOCKS and at most
+// JOURNAL_MAX_BLOCKS
+#define JOURNAL_MIN_FS_BLOCKS 1024
+#define JOURNAL_FRACTION 32
+#define JOURNAL_MIN_BLOCKS 32
+#define JOURNAL_MAX_BLOCKS 2048
+
+// blocks freed between syncs are queued in an array that starts this big
+#define FREED_INITIAL_CAPACITY 64
+
+// blocks of the bit array read with one readBlocks call at mount
+#define LOAD_BATCH_BLOCKS 256
+
+// file systems mounted at once. handle DEFAULT_MOUNT is used by tfs_mount
+// and the other calls without a handle, tfsm_mount hands out the rest
+#define MAX_MOUNTS 16
+#define DEFAULT_MOUNT 0
+
+// directory block (block 1 and its continuation blocks)
+// all fields are packed, integers are stored as uint32_t
+#define DIR_NEXT_INDEX 0    // next directory block, 0 if last
+#define DIR_COUNT_INDEX 4   // number of entries in this block
+#define DIR_ENTRY_INDEX 8   // first entry
+#define DIR_ENTRY_SIZE 16   // filename[8], addr, size
+#define DIR_ENTRIES_PER_BLOCK(bs) (((bs) - DIR_ENTRY_INDEX) / DIR_ENTRY_SIZE)
+
+// file inode block
+#define CTIME_INDEX 0       // creation time, int64_t
+#define ATIME_INDEX 8       // access time, int64_t
+#define MTIME_INDEX 16      // modification time, int64_t
+#define INODE_NEXT_INDEX 24 // first block map continuation block, 0 if none
+#define INODE_COUNT_INDEX 28 // number of extents in this block
+#define INODE_MAP_INDEX 32  // extents of the file data, in order
+#define EXTENT_SIZE 8       // first block, number of blocks
+#define INODE_EXTENTS_PER_BLOCK(bs) (((bs) - INODE_MAP_INDEX) / EXTENT_SIZE)
+
+// block map continuation block
+#define MAP_NEXT_INDEX 0    // next continuation block, 0 if last
+#define MAP_COUNT_INDEX 4   // number of extents in this block
+#define MAP_EXTENT_INDEX 8  // extents of the file data, in order
+#define MAP_EXTENTS_PER_BLOCK(bs) (((bs) - MAP_EXTENT_INDEX) / EXTENT_SIZE)
 
 typedef int fileDescriptor;
 
+typedef int mountHandle;
+
 typedef struct Root_inode_entry
 {
     char filename[MAX_FILENAME_LEN];
@@ -39,17 +107,145 @@ typedef struct File_inode_entry
     int addr;
 } File_inode_entry;
 
+// run of contiguous data blocks of a file
+typedef struct File_extent
+{
+    int start;      // first block on disk
+    int length;     // number of blocks
+    int logical;    // index of the first block within the file, not stored
+} File_extent;
+
+#define EXTENTS_INITIAL_CAPACITY 4
+
+// in memory copy of a file inode
+typedef struct File_inode
+{
+    int64_t ctime;
+    int64_t atime;
+    int64_t mtime;
+    File_extent *extents;   // data blocks of the file, in order
+    int n_extents;
+    int capacity;
+    int n_blocks;           // total length of all extents
+    LinkedList *spill;      // File_inode_entry for every map continuation block
+} File_inode;
+
 typedef struct Resource_table_entry
 {
+    pthread_mutex_t lock;   // held while the file is read or written
     char filename[MAX_FILENAME_LEN];
     int fd;
     int fp;
+    int inode_addr; // cached from the root directory entry
+    int size;       // cached from the root directory entry
+    int ra_next;    // block a sequential read would start at
+    int ra_window;  // blocks read ahead, 0 if the reads aren't sequential
+    int ra_end;     // blocks before this one have been read ahead
+    uint8_t *read_block;    // data block tfs_readByte reads from, or NULL
+    int read_index;         // block of the file in read_block, -1 if none
+    // data written to the end of the file that has no place on disk yet.
+    // delay_data holds blocks delay_block to the end of the file and is
+    // newer than anything on disk, delay_reserved of them are past the
+    // block map and have free blocks set aside for them
+    uint8_t *delay_data;
+    int delay_block;        // first block in delay_data, -1 if none
+    int delay_count;        // blocks in delay_data
+    int delay_capacity;     // blocks delay_data has room for
+    int delay_reserved;
+    time_t delay_mtime;     // modification time for the inode
+    // blocks past the end of the file set aside by tfs_fallocate. writes
+    // that shrink the file keep the first prealloc_blocks blocks, and
+    // closing the file gives back the ones past its end unless
+    // prealloc_keep is set
+    int prealloc_blocks;
+    int prealloc_keep;
 } Resource_table_entry;
 
-int tfs_mkfs(char *filename, int nBytes);
+#define RESOURCE_TABLE_INITIAL_CAPACITY 16
+
+// read-ahead of sequential reads starts at READAHEAD_MIN_BLOCKS blocks and
+// doubles up to READAHEAD_MAX_BLOCKS, half of what libDisk caches
+#define READAHEAD_MIN_BLOCKS 4
+#define READAHEAD_MAX_BLOCKS (DEFAULT_CACHE_FRAMES / 2)
+
+// writes to the end of a file are kept in memory, up to DELAY_FILE_BYTES
+// per open file and DELAY_MOUNT_BYTES per mount, and only get blocks when
+// the file is closed or synced, so each file goes to disk as one run
+#define DELAY_FILE_BYTES (1 << 20)
+#define DELAY_MOUNT_BYTES (8 << 20)
+
+// tfs_fallocate flag, the blocks past the end of the file stay with it
+// when it is closed
+#define FALLOC_KEEP 1
+
+// open file table indexed directly by file descriptor
+typedef struct Resource_table
+{
+    Resource_table_entry **slots;   // NULL if the descriptor is free
+    int capacity;
+    int size;                       // number of open files
+    int *free_fds;                  // stack of closed descriptors to reuse
+    int n_free;
+} Resource_table;
+
+// one mounted file system, a slot of the mount table
+//
+// locks, always taken in this order. every call holds fs_lock, shared if
+// it works on one open file and exclusive if it mounts, syncs or changes
+// the directory or the open file table. an open file is read or written
+// with its own lock held, so different files are used in parallel.
+// alloc_lock is held from begin_free_map until the operation ends.
+// different mounts share no locks
+typedef struct Mount
+{
+    pthread_rwlock_t fs_lock;
+    pthread_mutex_t alloc_lock; // guards the free map, freed_blocks and the
+                                // delayed block counts
+    pthread_mutex_t meta_lock;  // guards the journal, dir_dirty and the
+                                // directory entry sizes under a shared fs_lock
+    int in_use;                 // slot handed out by tfsm_mount
+    int disk;                   // libDisk disk, -1 if nothing is mounted
+    int block_size;             // read from the superblock at mount
+    Resource_table *resource_table;
+    Hash_index *open_index;     // resource table entries by filename
+    LinkedList *root_dir;       // loaded at mount
+    LinkedList *dir_spill;      // directory blocks after block 1
+    Hash_index *dir_index;      // root directory entries by filename
+    Free_map *free_map;         // word at a time copy of the bit array
+    uint8_t *superblock;        // in memory until unmount
+    Journal *journal;           // NULL if the file system has none
+    // with a journal, blocks freed since the last sync stay allocated until
+    // the sync commits their release, so nothing overwrites them before
+    // then. freed_mark is where the current operation started
+    int *freed_blocks;
+    int n_freed;
+    int freed_capacity;
+    int freed_mark;
+    // objects of the directory, block maps and open file table come from
+    // pools, given back all at once at unmount
+    Pool *node_pool;            // list nodes
+    Pool *dir_pool;             // Root_inode_entry
+    Pool *spill_pool;           // File_inode_entry
+    Pool *open_pool;            // Resource_table_entry
+    int delayed_blocks;         // blocks in the delay_data of open files
+    int reserved_blocks;        // free blocks set aside for delayed blocks
+    int dir_dirty;              // 1 if the directory changed since the sync
+    int sync_interval;          // seconds between syncs, 0 after every call
+    time_t last_sync;
+    // chunk i of the free map is at byte bitmap_offset of block
+    // bitmap_start + i
+    int bitmap_start;
+    int bitmap_offset;
+} Mount;
+
+int tfs_mkfs(char *filename, int64_t nBytes);
+
+int tfs_mkfs_blocksize(char *filename, int64_t nBytes, int blockSize);
 
 int tfs_mount(char *filename);
 
+int tfs_mount_mode(char *filename, int mode);
+
 int tfs_unmount(void);
 
 fileDescriptor tfs_open(char *name);
@@ -58,25 +254,161 @@ int tfs_close(fileDescriptor FD);
 
 int tfs_write(fileDescriptor FD, char *buffer, int size);
 
+int tfs_pwrite(fileDescriptor FD, char *buffer, int size, int offset);
+
+int tfs_append(fileDescriptor FD, char *buffer, int size);
+
+int tfs_fallocate(fileDescriptor FD, int size, int flags);
+
 int tfs_delete(fileDescriptor FD);
 
 int tfs_readByte(fileDescriptor FD, char *buffer);
 
+int tfs_read(fileDescriptor FD, char *buffer, int size);
+
 int tfs_seek(fileDescriptor FD, int offset);
 
 int tfs_rename(fileDescriptor FD, char *new_name);
 
-int tfs_readdir();
+int tfs_readdir(void);
 
 int tfs_stat(fileDescriptor FD, struct tm *creation_time, \
     struct tm *access_time, struct tm *modification_time);
 
+int tfs_sync(void);
+
+int tfs_set_sync_interval(int seconds);
+
+int tfs_free_blocks(void);
+
 int get_filename(fileDescriptor FD, char *filename);
 
-void free_block(uint8_t *superblock, int index);
+// counters and call latencies of every mount, see stats.h
+int tfs_get_stats(Tfs_stats *stats);
+
+int tfs_reset_stats(void);
+
+int tfs_dump_stats(char *filename);
+
+int tfs_set_stats_timing(int on);
+
+// the same calls on a file system mounted with tfsm_mount, file descriptors
+// belong to the mount that opened them
+mountHandle tfsm_mount(char *filename, int mode);
+
+int tfsm_unmount(mountHandle m);
+
+fileDescriptor tfsm_open(mountHandle m, char *name);
+
+int tfsm_close(mountHandle m, fileDescriptor FD);
+
+int tfsm_write(mountHandle m, fileDescriptor FD, char *buffer, int size);
+
+int tfsm_pwrite(mountHandle m, fileDescriptor FD, char *buffer, int size, int offset);
+
+int tfsm_append(mountHandle m, fileDescriptor FD, char *buffer, int size);
+
+int tfsm_fallocate(mountHandle m, fileDescriptor FD, int size, int flags);
+
+int tfsm_delete(mountHandle m, fileDescriptor FD);
+
+int tfsm_readByte(mountHandle m, fileDescriptor FD, char *buffer);
+
+int tfsm_read(mountHandle m, fileDescriptor FD, char *buffer, int size);
+
+int tfsm_seek(mountHandle m, fileDescriptor FD, int offset);
+
+int tfsm_rename(mountHandle m, fileDescriptor FD, char *new_name);
+
+int tfsm_readdir(mountHandle m);
+
+int tfsm_stat(mountHandle m, fileDescriptor FD, struct tm *creation_time, \
+    struct tm *access_time, struct tm *modification_time);
+
+int tfsm_sync(mountHandle m);
+
+int tfsm_set_sync_interval(mountHandle m, int seconds);
+
+int tfsm_free_blocks(mountHandle m);
+
+int tfsm_get_filename(mountHandle m, fileDescriptor FD, char *filename);
+
+int sync_if_due(Mount *fs);
+
+Resource_table *create_resource_table();
+
+void free_resource_table(Resource_table *table);
+
+Resource_table_entry *get_resource_table_entry(Mount *fs, fileDescriptor FD);
+
+int add_resource_table_entry(Mount *fs, Resource_table_entry *entry);
+
+void remove_resource_table_entry(Mount *fs, Resource_table_entry *entry);
+
+Root_inode_entry *find_root_inode_entry(Mount *fs, char *filename);
+
+int add_root_inode_entry(Mount *fs, Root_inode_entry *entry);
+
+void remove_root_inode_entry(Mount *fs, Root_inode_entry *entry);
+
+int load_directory(Mount *fs);
+
+int dir_spill_needed(Mount *fs);
+
+int dir_spill_blocks(Mount *fs, int n_entries);
+
+int store_directory(Mount *fs);
+
+int create_file_inode(Mount *fs, File_inode *inode);
+
+int read_file_inode(Mount *fs, int addr, File_inode *inode);
+
+int write_file_inode(Mount *fs, int addr, File_inode *inode);
+
+void free_file_inode(File_inode *inode);
+
+int find_extent(File_inode *inode, int index);
+
+int get_file_block(File_inode *inode, int index);
+
+int add_file_block(File_inode *inode, int addr);
+
+int truncate_file_blocks(Mount *fs, File_inode *inode, int n_blocks);
+
+int grow_file_blocks(Mount *fs, File_inode *inode, int n_blocks);
+
+int resize_chain(Mount *fs, LinkedList *chain, int needed);
+
+void trim_chain(LinkedList *chain, int needed);
+
+int read_block_size(Mount *fs);
+
+int open_journal(Mount *fs);
+
+int read_meta(Mount *fs, int addr, void *block);
+
+int write_meta(Mount *fs, int addr, void *block);
+
+int load_free_map(Mount *fs);
+
+int store_free_map(Mount *fs);
+
+void begin_free_map(Mount *fs);
+
+void discard_free_map(Mount *fs);
+
+void end_free_map(Mount *fs);
+
+int free_block(Mount *fs, int index);
+
+void release_freed_blocks(Mount *fs);
+
+int freed_blocks_waiting(Mount *fs);
+
+int unfree_block(Mount *fs, int index);
 
-void unfree_block(uint8_t *superblock, int index);
+int unfree_first_free_block(Mount *fs);
 
-int unfree_first_free_block(uint8_t *superblock);
+int unfree_free_run(Mount *fs, int hint, int want, int *length);
 
 void free_all();
\ No newline at end of file
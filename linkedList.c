@@ -1,14 +1,38 @@
 #include "linkedList.h"
 
+static Node *new_node(LinkedList *list)
+{
+    if (list->node_pool != NULL)
+        return (Node *) pool_alloc(list->node_pool);
+    return (Node *) malloc(sizeof(Node));
+}
+
+// free a node and its data
+static void release_node(LinkedList *list, Node *node)
+{
+    free_data(list, node->data);
+    if (list->node_pool != NULL)
+        pool_free(list->node_pool, node);
+    else
+        free(node);
+}
+
 LinkedList *create_linked_list()
+{
+    return create_pooled_list(NULL, NULL);
+}
+
+LinkedList *create_pooled_list(Pool *node_pool, Pool *data_pool)
 {
     // create list
     LinkedList *list = (LinkedList*) malloc(sizeof(LinkedList));
     if (list == NULL)
         return list;
+    list->node_pool = node_pool;
+    list->data_pool = data_pool;
 
     // add dummy node
-    list->front = (Node *) malloc(sizeof(Node));
+    list->front = new_node(list);
     if (list->front == NULL)
     {
         perror("malloc");
@@ -34,12 +58,10 @@ void free_linked_list(LinkedList *list)
     while (cur->next != NULL)
     {
         next = cur->next;
-        free(cur->data);
-        free(cur);
+        release_node(list, cur);
         cur = next;
     }
-    free(cur->data);
-    free(cur);
+    release_node(list, cur);
     free(list);
 }
 
@@ -50,7 +72,7 @@ int append(LinkedList *list, void *data)
 
 int insert(LinkedList *list, void *data, int index)
 {
-    Node *node = (Node *) malloc(sizeof(Node));
+    Node *node = new_node(list);
     if (node == NULL)
         return -1;
     node->data = data;
@@ -88,14 +110,31 @@ void delete(LinkedList *list, Node *prev)
     // free node and redirect previous node next
     Node *temp = NULL;
     temp = prev->next->next;
-    free(prev->next->data);
-    free(prev->next);
+    release_node(list, prev->next);
     prev->next = temp;
 
     // decrement size
     list->size -= 1;
 }
 
+// allocate size bytes for data that will be put in the list, from its
+// data pool if it has one
+void *alloc_data(LinkedList *list, size_t size)
+{
+    if (list->data_pool != NULL)
+        return pool_alloc(list->data_pool);
+    return malloc(size);
+}
+
+// free data from alloc_data that didn't make it into the list
+void free_data(LinkedList *list, void *data)
+{
+    if (list->data_pool != NULL)
+        pool_free(list->data_pool, data);
+    else
+        free(data);
+}
+
 // void delete(LinkedList *list, int index)
 // {
 //     // if index is too high, return -1
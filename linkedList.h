@@ -3,6 +3,8 @@
 #include <stdint.h>
 #include <string.h>
 
+#include "pool.h"
+
 typedef struct Node
 {
     void *data;
@@ -10,19 +12,29 @@ typedef struct Node
     //int index;
 } Node;
 
+// nodes come from node_pool and data is given back to data_pool, either
+// is NULL to use malloc and free
 typedef struct LinkedList
 {
     Node* front;
     Node* back;
     int size;
+    Pool *node_pool;
+    Pool *data_pool;
 } LinkedList;
 
 LinkedList *create_linked_list();
 
+LinkedList *create_pooled_list(Pool *node_pool, Pool *data_pool);
+
 void free_linked_list(LinkedList *list);
 
 int append(LinkedList *list, void *data);
 
 int insert(LinkedList *list, void *data, int index);
 
-void delete(LinkedList *list, Node *prev);
\ No newline at end of file
+void delete(LinkedList *list, Node *prev);
+
+void *alloc_data(LinkedList *list, size_t size);
+
+void free_data(LinkedList *list, void *data);
\ No newline at end of file
@@ -0,0 +1,84 @@
+#include "pool.h"
+
+// make an empty pool of objects of object_size bytes
+Pool *create_pool(size_t object_size)
+{
+    if (object_size == 0 || object_size > POOL_CHUNK_BYTES - CACHE_LINE)
+        return NULL;
+    Pool *pool = (Pool *) malloc(sizeof(Pool));
+    if (pool == NULL)
+        return NULL;
+    pthread_mutex_init(&pool->lock, NULL);
+    if (object_size < sizeof(void *))
+        object_size = sizeof(void *);
+    pool->object_size = (object_size + 7) & ~(size_t) 7;
+    pool->free_list = NULL;
+    pool->chunk = NULL;
+    pool->used = POOL_CHUNK_BYTES;
+    pool->n_chunks = 0;
+    return pool;
+}
+
+// give every chunk back to the heap, objects still handed out go with them
+void free_pool(Pool *pool)
+{
+    if (pool == NULL)
+        return;
+    uint8_t *chunk = pool->chunk;
+    while (chunk != NULL)
+    {
+        uint8_t *prev;
+        memcpy(&prev, chunk, sizeof(uint8_t *));
+        free(chunk);
+        chunk = prev;
+    }
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+// returns an uninitialized object, or NULL if a new chunk can't be allocated
+void *pool_alloc(Pool *pool)
+{
+    void *object;
+    pthread_mutex_lock(&pool->lock);
+
+    // reuse a given back object first
+    if (pool->free_list != NULL)
+    {
+        object = pool->free_list;
+        memcpy(&pool->free_list, object, sizeof(void *));
+        pthread_mutex_unlock(&pool->lock);
+        return object;
+    }
+
+    // start a new chunk when the newest one is used up, objects begin on
+    // the cache line after the link to the previous chunk
+    if (pool->used + pool->object_size > POOL_CHUNK_BYTES)
+    {
+        void *chunk = NULL;
+        if (posix_memalign(&chunk, CACHE_LINE, POOL_CHUNK_BYTES) != 0)
+        {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL; // malloc error
+        }
+        memcpy(chunk, &pool->chunk, sizeof(uint8_t *));
+        pool->chunk = (uint8_t *) chunk;
+        pool->used = CACHE_LINE;
+        pool->n_chunks += 1;
+    }
+    object = &pool->chunk[pool->used];
+    pool->used += pool->object_size;
+    pthread_mutex_unlock(&pool->lock);
+    return object;
+}
+
+// give an object from pool_alloc back to the pool, NULL is ignored
+void pool_free(Pool *pool, void *object)
+{
+    if (object == NULL)
+        return;
+    pthread_mutex_lock(&pool->lock);
+    memcpy(object, &pool->free_list, sizeof(void *));
+    pool->free_list = object;
+    pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,32 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#define CACHE_LINE 64
+#define POOL_CHUNK_BYTES 16384 // multiple of CACHE_LINE
+
+// fixed size object pool. objects are carved out of cache line aligned
+// chunks of POOL_CHUNK_BYTES, so objects allocated together sit together,
+// and given back objects go on a free list for the next pool_alloc.
+// chunks are only returned to the heap, all at once, by free_pool. the
+// first word of each chunk links it to the previous one. the pool has its
+// own lock, taken after every other lock
+typedef struct Pool
+{
+    pthread_mutex_t lock;
+    size_t object_size;     // at least a pointer, a multiple of 8
+    void *free_list;        // given back objects, linked through their first word
+    uint8_t *chunk;         // newest chunk, NULL if none
+    size_t used;            // bytes of the newest chunk handed out
+    int n_chunks;
+} Pool;
+
+Pool *create_pool(size_t object_size);
+
+void free_pool(Pool *pool);
+
+void *pool_alloc(Pool *pool);
+
+void pool_free(Pool *pool, void *object);
@@ -0,0 +1,233 @@
+#include "stats.h"
+
+static Thread_stats *get_thread_stats(void);
+static void retire_thread(void *value);
+static void make_key(void);
+static void add_stats(Tfs_stats *total, Tfs_stats *stats);
+static void sum_stats(Tfs_stats *stats);
+static void add_relaxed(uint64_t *value, uint64_t n);
+
+static const char *stat_names[N_STATS] = {
+    "readBlock", "writeBlock", "readBlocks", "writeBlocks", "blocks_read", \
+    "blocks_written", "bytes_read", "bytes_written", "cache_hits", "cache_misses", \
+    "block_allocs", "run_allocs", "run_blocks", "dir_lookups", "dir_scanned", \
+    "table_lookups", "table_scanned"
+};
+
+static const char *call_names[N_CALLS] = {
+    "mkfs", "mount", "unmount", "open", "close", "write", "pwrite", "append", \
+    "fallocate", "delete", "readByte", "read", "seek", "rename", "readdir", "stat", \
+    "sync"
+};
+
+// counters of the calling thread, NULL until its first event
+static __thread Thread_stats *local;
+
+// list of live threads, the totals of exited ones and the snapshot
+// subtracted by collect_stats since the last reset_stats, all guarded by
+// list_lock
+static pthread_mutex_t list_lock = PTHREAD_MUTEX_INITIALIZER;
+static Thread_stats *threads;
+static Tfs_stats retired;
+static Tfs_stats baseline;
+
+// 0 if calls are counted without reading the clock
+static int timing = 1;
+
+// the destructor of key retires the counters of an exiting thread
+static pthread_key_t key;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+
+// add n to counter for the calling thread
+void stat_add(int counter, uint64_t n)
+{
+    Thread_stats *t = get_thread_stats();
+    if (t == NULL)
+        return; // malloc error, the event is not counted
+    add_relaxed(&t->stats.counters[counter], n);
+}
+
+// returns the monotonic clock in nanoseconds, the start of a timed call,
+// or 0 if timing is off
+uint64_t stat_clock(void)
+{
+    if (!__atomic_load_n(&timing, __ATOMIC_RELAXED))
+        return 0;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// record a call that started at start and returned result. a call started
+// with timing off is counted but goes in no histogram bucket
+// returns result, so a call can end with return stat_call(...)
+int stat_call(int call, uint64_t start, int result)
+{
+    Thread_stats *t = get_thread_stats();
+    if (t == NULL)
+        return result; // malloc error, the call is not counted
+    add_relaxed(&t->stats.calls[call], 1);
+    if (result < 0)
+        add_relaxed(&t->stats.errors[call], 1);
+    if (start == 0)
+        return result; // not timed
+    uint64_t end = stat_clock();
+    if (end == 0)
+        return result; // timing turned off during the call
+
+    // floor of log2 of ns
+    uint64_t ns = end - start;
+    int bucket = ns == 0 ? 0 : 63 - __builtin_clzll(ns);
+    if (bucket >= STAT_BUCKETS)
+        bucket = STAT_BUCKETS - 1;
+    add_relaxed(&t->stats.latency[call][bucket], 1);
+    add_relaxed(&t->stats.call_ns[call], ns);
+    return result;
+}
+
+// turn the latency histograms on or off, reading the clock twice is most
+// of the cost of a short call like tfs_seek. the counters stay on
+void set_stat_timing(int on)
+{
+    __atomic_store_n(&timing, on != 0, __ATOMIC_RELAXED);
+}
+
+// fill stats with the totals of every thread since the last reset_stats
+void collect_stats(Tfs_stats *stats)
+{
+    pthread_mutex_lock(&list_lock);
+    sum_stats(stats);
+    uint64_t *values = (uint64_t *) stats;
+    uint64_t *base = (uint64_t *) &baseline;
+    size_t i;
+    for (i = 0; i < sizeof(Tfs_stats) / sizeof(uint64_t); i++)
+        values[i] -= base[i];
+    pthread_mutex_unlock(&list_lock);
+}
+
+// start counting from zero. the counters of running threads are owned by
+// them, so the current totals are remembered and subtracted instead
+void reset_stats(void)
+{
+    pthread_mutex_lock(&list_lock);
+    sum_stats(&baseline);
+    pthread_mutex_unlock(&list_lock);
+}
+
+// write stats to file as JSON, the counters by name and for every entry
+// point that was called its count, errors, total time and the non-empty
+// histogram buckets as [lowest nanoseconds, calls] pairs
+// returns 0 if successful, -1 on a write error
+int print_stats(FILE *file, Tfs_stats *stats)
+{
+    int i, j;
+    fprintf(file, "{\n  \"counters\": {");
+    for (i = 0; i < N_STATS; i++)
+        fprintf(file, "%s\n    \"%s\": %llu", i > 0 ? "," : "", stat_names[i], \
+            (unsigned long long) stats->counters[i]);
+    fprintf(file, "\n  },\n  \"calls\": {");
+    int first = 1;
+    for (i = 0; i < N_CALLS; i++)
+    {
+        if (stats->calls[i] == 0)
+            continue;
+        fprintf(file, "%s\n    \"%s\": {\"count\": %llu, \"errors\": %llu, " \
+            "\"total_ns\": %llu, \"histogram\": [", first ? "" : ",", call_names[i], \
+            (unsigned long long) stats->calls[i], (unsigned long long) stats->errors[i], \
+            (unsigned long long) stats->call_ns[i]);
+        int first_bucket = 1;
+        for (j = 0; j < STAT_BUCKETS; j++)
+        {
+            if (stats->latency[i][j] == 0)
+                continue;
+            fprintf(file, "%s[%llu, %llu]", first_bucket ? "" : ", ", \
+                j == 0 ? 0ULL : 1ULL << j, (unsigned long long) stats->latency[i][j]);
+            first_bucket = 0;
+        }
+        fprintf(file, "]}");
+        first = 0;
+    }
+    fprintf(file, "\n  }\n}\n");
+    return ferror(file) ? -1 : 0;
+}
+
+const char *stat_name(int counter)
+{
+    if (counter < 0 || counter >= N_STATS)
+        return NULL;
+    return stat_names[counter];
+}
+
+const char *call_name(int call)
+{
+    if (call < 0 || call >= N_CALLS)
+        return NULL;
+    return call_names[call];
+}
+
+// returns the counters of the calling thread, adding them to the list of
+// live threads on the first call, or NULL on a malloc error
+static Thread_stats *get_thread_stats(void)
+{
+    if (local != NULL)
+        return local;
+    pthread_once(&key_once, make_key);
+    Thread_stats *t = (Thread_stats *) calloc(1, sizeof(Thread_stats));
+    if (t == NULL)
+        return NULL;
+    pthread_mutex_lock(&list_lock);
+    t->next = threads;
+    threads = t;
+    pthread_mutex_unlock(&list_lock);
+    pthread_setspecific(key, t);
+    local = t;
+    return t;
+}
+
+// key destructor, fold the counters of an exiting thread into the retired
+// totals and free them
+static void retire_thread(void *value)
+{
+    Thread_stats *t = (Thread_stats *) value;
+    pthread_mutex_lock(&list_lock);
+    Thread_stats **prev = &threads;
+    while (*prev != t)
+        prev = &(*prev)->next;
+    *prev = t->next;
+    add_stats(&retired, &t->stats);
+    pthread_mutex_unlock(&list_lock);
+    local = NULL;
+    free(t);
+}
+
+static void make_key(void)
+{
+    pthread_key_create(&key, retire_thread);
+}
+
+// fill stats with the totals of the retired and live threads, list_lock
+// is held
+static void sum_stats(Tfs_stats *stats)
+{
+    memcpy(stats, &retired, sizeof(Tfs_stats));
+    Thread_stats *t;
+    for (t = threads; t != NULL; t = t->next)
+        add_stats(stats, &t->stats);
+}
+
+// add every value of stats to total, reading stats with relaxed loads
+static void add_stats(Tfs_stats *total, Tfs_stats *stats)
+{
+    uint64_t *values = (uint64_t *) total;
+    uint64_t *adds = (uint64_t *) stats;
+    size_t i;
+    for (i = 0; i < sizeof(Tfs_stats) / sizeof(uint64_t); i++)
+        values[i] += __atomic_load_n(&adds[i], __ATOMIC_RELAXED);
+}
+
+// add n to a counter of the calling thread, which only it writes
+static void add_relaxed(uint64_t *value, uint64_t n)
+{
+    __atomic_store_n(value, __atomic_load_n(value, __ATOMIC_RELAXED) + n, \
+        __ATOMIC_RELAXED);
+}
@@ -0,0 +1,89 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+// latency histogram buckets, bucket i counts calls that took from 2^i up
+// to 2^(i+1) nanoseconds, the last one everything longer
+#define STAT_BUCKETS 40
+
+// event counters, summed over every mount and disk of the process
+#define STAT_READ_BLOCK 0       // readBlock calls
+#define STAT_WRITE_BLOCK 1      // writeBlock calls
+#define STAT_READ_BLOCKS 2      // readBlocks calls
+#define STAT_WRITE_BLOCKS 3     // writeBlocks calls
+#define STAT_BLOCKS_READ 4      // blocks asked for by the four calls above
+#define STAT_BLOCKS_WRITTEN 5
+#define STAT_BYTES_READ 6       // bytes moved from the backing file
+#define STAT_BYTES_WRITTEN 7    // bytes moved to the backing file
+#define STAT_CACHE_HITS 8       // blocks found in the block cache
+#define STAT_CACHE_MISSES 9     // blocks looked for and not found
+#define STAT_BLOCK_ALLOCS 10    // blocks from unfree_first_free_block
+#define STAT_RUN_ALLOCS 11      // unfree_free_run calls that found blocks
+#define STAT_RUN_BLOCKS 12      // blocks they handed out
+#define STAT_DIR_LOOKUPS 13     // directory entries looked up by name
+#define STAT_DIR_SCANNED 14     // slots and list nodes looked at doing it
+#define STAT_TABLE_LOOKUPS 15   // open files looked up by descriptor or name
+#define STAT_TABLE_SCANNED 16   // slots looked at doing it
+#define N_STATS 17
+
+// public entry points with a latency histogram, the tfs_ call and the
+// tfsm_ call taking a mount handle count as one
+#define CALL_MKFS 0
+#define CALL_MOUNT 1
+#define CALL_UNMOUNT 2
+#define CALL_OPEN 3
+#define CALL_CLOSE 4
+#define CALL_WRITE 5
+#define CALL_PWRITE 6
+#define CALL_APPEND 7
+#define CALL_FALLOCATE 8
+#define CALL_DELETE 9
+#define CALL_READBYTE 10
+#define CALL_READ 11
+#define CALL_SEEK 12
+#define CALL_RENAME 13
+#define CALL_READDIR 14
+#define CALL_STAT 15
+#define CALL_SYNC 16
+#define N_CALLS 17
+
+// a snapshot of the counters and histograms
+typedef struct Tfs_stats
+{
+    uint64_t counters[N_STATS];
+    uint64_t calls[N_CALLS];            // calls made
+    uint64_t errors[N_CALLS];           // calls that returned an error
+    uint64_t call_ns[N_CALLS];          // total time spent in the timed ones
+    uint64_t latency[N_CALLS][STAT_BUCKETS];
+} Tfs_stats;
+
+// the counters of one thread. only the owning thread adds to them, so an
+// update is a relaxed load and store with no lock or locked instruction;
+// collect_stats reads them with relaxed loads while the thread runs. the
+// counters of a thread that exits are folded into the retired totals
+typedef struct Thread_stats
+{
+    Tfs_stats stats;
+    struct Thread_stats *next;  // next thread in the list of live threads
+} Thread_stats;
+
+void stat_add(int counter, uint64_t n);
+
+uint64_t stat_clock(void);
+
+void set_stat_timing(int on);
+
+int stat_call(int call, uint64_t start, int result);
+
+void collect_stats(Tfs_stats *stats);
+
+void reset_stats(void);
+
+int print_stats(FILE *file, Tfs_stats *stats);
+
+const char *stat_name(int counter);
+
+const char *call_name(int call);
@@ -0,0 +1,354 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libTinyFS.h"
+
+// file system benchmark: for every disk size, file count and file size in
+// the run table below, makes a fresh file system and times each call of
+// tfs_mkfs, tfs_mount, tfs_open on new and on existing files, tfs_write of
+// every size in the write size table that fits and of the whole file,
+// tfs_pwrite, tfs_append, tfs_fallocate, tfs_sync, tfs_read of the whole
+// file, tfs_readByte, tfs_seek, tfs_rename, tfs_stat and tfs_delete. prints
+// one row per run and operation with the number of calls, calls per second
+// of time spent in them and the median and 99th percentile latency, as CSV
+// or as JSON, so runs from two builds can be compared
+//
+// usage: tfsbench [csv|json] [file]
+
+#define REPEATS 8               // tfs_mkfs and tfs_mount calls per run
+#define SEEKS_PER_FILE 64
+#define MAX_BYTE_READS 65536    // tfs_readByte calls per run
+#define SMALL_WRITE 256         // bytes per tfs_pwrite and tfs_append
+
+typedef struct Run
+{
+    int64_t disk_bytes;
+    int n_files;
+    int file_bytes;
+} Run;
+
+static const Run runs[] = {
+    {1 << 20, 16, 256},
+    {1 << 20, 16, 4096},
+    {1 << 20, 128, 256},
+    {16 << 20, 16, 65536},
+    {16 << 20, 256, 4096},
+    {16 << 20, 1024, 256},
+    {64 << 20, 64, 262144},
+    {64 << 20, 4096, 1024},
+};
+#define N_RUNS ((int) (sizeof(runs) / sizeof(runs[0])))
+
+// tfs_write sizes timed in every run, a size is skipped when writing it to
+// every file would take more than half the disk
+static const int write_sizes[] = {256, 4096, 65536};
+#define N_WRITE_SIZES ((int) (sizeof(write_sizes) / sizeof(write_sizes[0])))
+
+// latencies of one operation in one run, in nanoseconds
+typedef struct Samples
+{
+    double *ns;
+    int count;
+    int capacity;
+} Samples;
+
+static int json;
+static int rows;
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void add_sample(Samples *s, double ns)
+{
+    if (s->count == s->capacity)
+    {
+        int capacity = s->capacity == 0 ? 1024 : 2 * s->capacity;
+        double *ns_list = (double *) realloc(s->ns, capacity * sizeof(double));
+        if (ns_list == NULL)
+        {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+        s->ns = ns_list;
+        s->capacity = capacity;
+    }
+    s->ns[s->count++] = ns;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+// exit with the call and error code if a timed call failed
+static void check(int err, char *op)
+{
+    if (err < 0)
+    {
+        fprintf(stderr, "%s failed with error %d\n", op, err);
+        exit(1);
+    }
+}
+
+// print one row and empty the samples
+static void report(const Run *run, char *op, Samples *s)
+{
+    if (s->count == 0)
+        return;
+    double total = 0;
+    int i;
+    for (i = 0; i < s->count; i++)
+        total += s->ns[i];
+    qsort(s->ns, s->count, sizeof(double), compare_double);
+    double ops = total > 0 ? s->count / (total / 1e9) : 0;
+    double p50 = s->ns[s->count / 2] / 1e3;
+    double p99 = s->ns[(int) ((int64_t) s->count * 99 / 100)] / 1e3;
+    if (json)
+        printf("%s\n  {\"disk_bytes\": %lld, \"files\": %d, \"file_bytes\": %d, " \
+            "\"op\": \"%s\", \"count\": %d, \"ops_per_sec\": %.1f, " \
+            "\"p50_us\": %.3f, \"p99_us\": %.3f}", rows > 0 ? "," : "", \
+            (long long) run->disk_bytes, run->n_files, run->file_bytes, op, \
+            s->count, ops, p50, p99);
+    else
+        printf("%lld,%d,%d,%s,%d,%.1f,%.3f,%.3f\n", (long long) run->disk_bytes, \
+            run->n_files, run->file_bytes, op, s->count, ops, p50, p99);
+    rows++;
+    s->count = 0;
+}
+
+// time one call, the statement must set err
+#define TIMED(samples, call) \
+    do \
+    { \
+        double start = now_ns(); \
+        err = (call); \
+        add_sample(samples, now_ns() - start); \
+    } while (0)
+
+static void bench_run(char *file, const Run *run, char *data, char *buf, \
+    fileDescriptor *fds, Samples *s)
+{
+    char name[16];
+    char byte;
+    int err;
+    int i, j;
+
+    for (i = 0; i < REPEATS; i++)
+    {
+        TIMED(s, tfs_mkfs(file, run->disk_bytes));
+        check(err, "tfs_mkfs");
+    }
+    report(run, "mkfs", s);
+
+    check(tfs_mount(file), "tfs_mount");
+    for (i = 0; i < run->n_files; i++)
+    {
+        snprintf(name, sizeof(name), "f%05d", i);
+        TIMED(s, fds[i] = tfs_open(name));
+        check(err, "tfs_open");
+    }
+    report(run, "open_create", s);
+
+    // every file rewritten at each size, then at the size of the run
+    char op[32];
+    int size;
+    for (j = 0; j <= N_WRITE_SIZES; j++)
+    {
+        size = j < N_WRITE_SIZES ? write_sizes[j] : run->file_bytes;
+        if (j < N_WRITE_SIZES && (size == run->file_bytes || \
+            (int64_t) size * run->n_files > run->disk_bytes / 2))
+            continue;
+        for (i = 0; i < run->n_files; i++)
+        {
+            TIMED(s, tfs_write(fds[i], data, size));
+            check(err, "tfs_write");
+        }
+        snprintf(op, sizeof(op), "write_%d", size);
+        report(run, op, s);
+    }
+
+    // small writes at random offsets, the file pointer is left alone
+    size = run->file_bytes < SMALL_WRITE ? run->file_bytes : SMALL_WRITE;
+    srand(1);
+    for (i = 0; i < run->n_files; i++)
+    {
+        for (j = 0; j < SEEKS_PER_FILE; j++)
+        {
+            TIMED(s, tfs_pwrite(fds[i], data, size, \
+                rand() % (run->file_bytes - size + 1)));
+            check(err, "tfs_pwrite");
+        }
+    }
+    snprintf(op, sizeof(op), "pwrite_%d", size);
+    report(run, op, s);
+
+    for (i = 0; i < run->n_files; i++)
+    {
+        TIMED(s, tfs_append(fds[i], data, SMALL_WRITE));
+        check(err, "tfs_append");
+    }
+    snprintf(op, sizeof(op), "append_%d", SMALL_WRITE);
+    report(run, op, s);
+
+    // room to double each file, given back when it is closed
+    for (i = 0; i < run->n_files; i++)
+    {
+        TIMED(s, tfs_fallocate(fds[i], 2 * run->file_bytes, 0));
+        check(err, "tfs_fallocate");
+    }
+    report(run, "fallocate", s);
+
+    // each sync has one rewritten block to write back
+    for (i = 0; i < REPEATS; i++)
+    {
+        check(tfs_pwrite(fds[i % run->n_files], data, size, 0), "tfs_pwrite");
+        TIMED(s, tfs_sync());
+        check(err, "tfs_sync");
+    }
+    report(run, "sync", s);
+
+    // close and reopen so the writes reach the disk before the mounts
+    for (i = 0; i < run->n_files; i++)
+        check(tfs_close(fds[i]), "tfs_close");
+    check(tfs_unmount(), "tfs_unmount");
+    for (i = 0; i < REPEATS; i++)
+    {
+        TIMED(s, tfs_mount(file));
+        check(err, "tfs_mount");
+        if (i < REPEATS - 1)
+            check(tfs_unmount(), "tfs_unmount");
+    }
+    report(run, "mount", s);
+
+    for (i = 0; i < run->n_files; i++)
+    {
+        snprintf(name, sizeof(name), "f%05d", i);
+        TIMED(s, fds[i] = tfs_open(name));
+        check(err, "tfs_open");
+    }
+    report(run, "open_existing", s);
+
+    // whole files, then back to the start for the byte reads
+    for (i = 0; i < run->n_files; i++)
+    {
+        TIMED(s, tfs_read(fds[i], buf, run->file_bytes));
+        check(err, "tfs_read");
+        check(tfs_seek(fds[i], 0), "tfs_seek");
+    }
+    snprintf(op, sizeof(op), "read_%d", run->file_bytes);
+    report(run, op, s);
+
+    // the first bytes of every file, MAX_BYTE_READS in all
+    int bytes_per_file = MAX_BYTE_READS / run->n_files;
+    if (bytes_per_file > run->file_bytes)
+        bytes_per_file = run->file_bytes;
+    if (bytes_per_file < 1)
+        bytes_per_file = 1;
+    for (i = 0; i < run->n_files; i++)
+    {
+        for (j = 0; j < bytes_per_file; j++)
+        {
+            TIMED(s, tfs_readByte(fds[i], &byte));
+            check(err, "tfs_readByte");
+        }
+    }
+    report(run, "readByte", s);
+
+    srand(1);
+    for (i = 0; i < run->n_files; i++)
+    {
+        for (j = 0; j < SEEKS_PER_FILE; j++)
+        {
+            TIMED(s, tfs_seek(fds[i], rand() % run->file_bytes));
+            check(err, "tfs_seek");
+        }
+    }
+    report(run, "seek", s);
+
+    for (i = 0; i < run->n_files; i++)
+    {
+        snprintf(name, sizeof(name), "r%05d", i);
+        TIMED(s, tfs_rename(fds[i], name));
+        check(err, "tfs_rename");
+    }
+    report(run, "rename", s);
+
+    struct tm creation_time, access_time, modification_time;
+    for (i = 0; i < run->n_files; i++)
+    {
+        TIMED(s, tfs_stat(fds[i], &creation_time, &access_time, &modification_time));
+        check(err, "tfs_stat");
+    }
+    report(run, "stat", s);
+
+    for (i = 0; i < run->n_files; i++)
+    {
+        TIMED(s, tfs_delete(fds[i]));
+        check(err, "tfs_delete");
+    }
+    report(run, "delete", s);
+    check(tfs_unmount(), "tfs_unmount");
+}
+
+int main(int argc, char **argv)
+{
+    json = argc > 1 && strcmp(argv[1], "json") == 0;
+    if (argc > 1 && !json && strcmp(argv[1], "csv") != 0)
+    {
+        fprintf(stderr, "usage: %s [csv|json] [file]\n", argv[0]);
+        return 1;
+    }
+    char *file = argc > 2 ? argv[2] : "tfsbench.disk";
+
+    int max_files = 0;
+    int max_bytes = 0;
+    int i;
+    for (i = 0; i < N_RUNS; i++)
+    {
+        if (runs[i].n_files > max_files)
+            max_files = runs[i].n_files;
+        if (runs[i].file_bytes > max_bytes)
+            max_bytes = runs[i].file_bytes;
+    }
+    for (i = 0; i < N_WRITE_SIZES; i++)
+        if (write_sizes[i] > max_bytes)
+            max_bytes = write_sizes[i];
+    char *data = (char *) malloc(max_bytes);
+    char *buf = (char *) malloc(max_bytes);
+    fileDescriptor *fds = (fileDescriptor *) malloc(max_files * sizeof(fileDescriptor));
+    if (data == NULL || buf == NULL || fds == NULL)
+    {
+        free(data);
+        free(buf);
+        free(fds);
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    for (i = 0; i < max_bytes; i++)
+        data[i] = 'a' + i % 26;
+
+    Samples samples = {NULL, 0, 0};
+    if (json)
+        printf("[");
+    else
+        printf("disk_bytes,files,file_bytes,op,count,ops_per_sec,p50_us,p99_us\n");
+    for (i = 0; i < N_RUNS; i++)
+        bench_run(file, &runs[i], data, buf, fds, &samples);
+    if (json)
+        printf("\n]\n");
+
+    free(samples.ns);
+    free(data);
+    free(buf);
+    free(fds);
+    remove(file);
+    return 0;
+}
@@ -1,3 +1,5 @@
+#include <sys/wait.h>
+
 #include "libTinyFS.h"
 
 // 50 characters
@@ -8,6 +10,907 @@
 #define VERYBIGSTR "hlmBoSAOc7DUcQd9g1BsuXsGegVqHl8MQWOG77EEyM50GdjImL4PUqt0fRk9sJI5u3i7vWVfV29OUgtGtgKWx25n4wlubVyojIIEDZNzr36wYnKnAsXCvhdJRetGLcxMFEQCEjm21mlEvpw2migzsXHNYJJhxGR8s2OQHs9U5hFMm1ZUb747u4S2hQYICXAwhf0KwS8rpTkm66A7bbibJ0TxwJ02lsYFpRAX5T1a2Sq93n3NmSasAdlLx19dvyFDmyLlfvWxPCZlFKDghAZfdpPSkHT41EcmN4aH2jHkrECChjNHpGBXaX7tCBQQ3tlTZUULwPdubXYGikN8nqt09IO4qFmGa8yM2eDs83LEsSSup3fBh69s2129PlT0JgSCS83zos3lHqyoxJ050N4Sby1yqsOK5VD4Y6B4C7pptdAPF64LIScjIupU6zZULL6b9bKyqdlkBfQI4snQl7cPbc1S52DCuLTgfvS2CI6NMpFpwK0vnpun57lFhMbwaEaW"
 // Max disk size character string
 
+// disk every check below works on, made and removed by the check
+#define CHECK_DISK "CHECK_DISK"
+
+// print the result of one check the way main does
+static void report(char *name, int ok)
+{
+    if (ok)
+        printf("%s: success\n", name);
+    else
+        printf("%s: failure\n", name);
+}
+
+// blocks written through the cache only reach the image when they are
+// evicted, the cache is resized or the disk is closed. a second open of
+// the image with no cache sees what has reached it
+static int check_cache(void)
+{
+    uint8_t block[BLOCKSIZE];
+    uint8_t on_disk[BLOCKSIZE];
+    int disk = openDisk(CHECK_DISK, 32 * BLOCKSIZE);
+    int raw = openDisk(CHECK_DISK, 0);
+    int ok = disk >= 0 && raw >= 0 && setCacheSize(disk, 8) >= 0 && \
+        setCacheSize(raw, 0) >= 0;
+    int i;
+
+    // eight dirty blocks fit in the cache, none of them is written yet
+    for (i = 0; ok && i < 8; i++)
+    {
+        memset(block, 'a' + i, BLOCKSIZE);
+        ok = writeBlock(disk, i, block) >= 0 && readBlock(raw, i, on_disk) >= 0 && \
+            on_disk[0] == 0;
+    }
+
+    // resizing writes them all back
+    ok = ok && setCacheSize(disk, 2) >= 0;
+    for (i = 0; ok && i < 8; i++)
+        ok = readBlock(raw, i, on_disk) >= 0 && on_disk[0] == 'a' + i && \
+            on_disk[BLOCKSIZE - 1] == 'a' + i;
+
+    // with two frames every block but the last two is evicted
+    for (i = 8; ok && i < 16; i++)
+    {
+        memset(block, 'a' + i, BLOCKSIZE);
+        ok = writeBlock(disk, i, block) >= 0;
+    }
+    for (i = 8; ok && i < 14; i++)
+        ok = readBlock(raw, i, on_disk) >= 0 && on_disk[0] == 'a' + i;
+
+    // and closing writes back the rest
+    ok = ok && closeDisk(disk) >= 0;
+    for (i = 14; ok && i < 16; i++)
+        ok = readBlock(raw, i, on_disk) >= 0 && on_disk[0] == 'a' + i;
+    closeDisk(raw);
+    remove(CHECK_DISK);
+    return ok;
+}
+
+// the size recorded when a disk is opened is its size, opened again or
+// not, and blocks outside it are refused
+static int check_geometry(void)
+{
+    uint8_t block[BLOCKSIZE];
+    memset(block, 'g', BLOCKSIZE);
+    int disk = openDisk(CHECK_DISK, 10 * BLOCKSIZE);
+    int ok = disk >= 0 && get_disk_size(disk) == 10 * BLOCKSIZE && \
+        writeBlock(disk, 9, block) >= 0 && writeBlock(disk, 10, block) < 0 && \
+        readBlock(disk, 10, block) < 0 && readBlock(disk, -1, block) < 0;
+    closeDisk(disk);
+    memset(block, 0, BLOCKSIZE);
+    disk = openDisk(CHECK_DISK, 0);
+    ok = ok && disk >= 0 && get_disk_size(disk) == 10 * BLOCKSIZE && \
+        readBlock(disk, 9, block) >= 0 && block[0] == 'g' && block[BLOCKSIZE - 1] == 'g';
+    closeDisk(disk);
+    remove(CHECK_DISK);
+    return ok;
+}
+
+// make a file system of size bytes on CHECK_DISK and mount it, run check
+// and print its result, then unmount and remove the disk. check returns 1
+// if it passed
+static void run_check(char *name, int size, int (*check)(void))
+{
+    int ok = tfs_mkfs(CHECK_DISK, size) >= 0 && tfs_mount(CHECK_DISK) >= 0 && check();
+    report(name, ok);
+    tfs_unmount();
+    remove(CHECK_DISK);
+}
+
+// returns 1 if the file open at fd holds exactly the size bytes of expect,
+// read a byte at a time from the start
+static int holds(fileDescriptor fd, char *expect, int size)
+{
+    char byte;
+    int i;
+    if (fd < 0 || tfs_seek(fd, 0) < 0)
+        return 0;
+    for (i = 0; i < size; i++)
+        if (tfs_readByte(fd, &byte) < 0 || byte != expect[i])
+            return 0;
+    return tfs_readByte(fd, &byte) < 0;
+}
+
+// a file written on the mmap backend reads back the same from it and,
+// after a remount, from the fd backend
+static int check_mmap(void)
+{
+    int ok = tfs_unmount() >= 0 && tfs_mount_mode(CHECK_DISK, DISK_MODE_MMAP) >= 0;
+    fileDescriptor fd = tfs_open("mapped");
+    ok = ok && fd >= 0 && tfs_write(fd, VERYBIGSTR, 512) >= 0 && holds(fd, VERYBIGSTR, 512);
+    ok = ok && tfs_sync() >= 0;
+    ok = ok && tfs_unmount() >= 0 && tfs_mount(CHECK_DISK) >= 0;
+    return ok && holds(tfs_open("mapped"), VERYBIGSTR, 512);
+}
+
+#define NAME_FILES 64
+
+// opens a file by name and returns holds on it
+static int holds_file(char *name, char *expect, int size)
+{
+    return holds(tfs_open(name), expect, size);
+}
+
+// every file is found by its name after files around it are renamed and
+// deleted and after a remount, and old names of renamed files are free
+static int check_names(void)
+{
+    fileDescriptor fds[NAME_FILES];
+    char name[16];
+    int ok = 1;
+    int i;
+    for (i = 0; ok && i < NAME_FILES; i++)
+    {
+        snprintf(name, sizeof(name), "n%d", i);
+        fds[i] = tfs_open(name);
+        ok = fds[i] >= 0 && tfs_write(fds[i], &BIGSTR[i], 50) >= 0;
+    }
+    for (i = 1; ok && i < NAME_FILES; i += 2)
+    {
+        snprintf(name, sizeof(name), "r%d", i);
+        ok = tfs_rename(fds[i], name) >= 0;
+    }
+    for (i = 2; ok && i < NAME_FILES; i += 4)
+        ok = tfs_delete(fds[i]) >= 0;
+    ok = ok && tfs_unmount() >= 0 && tfs_mount(CHECK_DISK) >= 0;
+    for (i = 0; ok && i < NAME_FILES; i++)
+    {
+        snprintf(name, sizeof(name), i % 2 ? "r%d" : "n%d", i);
+        if (i % 4 == 2)
+            ok = holds_file(name, NULL, 0);
+        else
+            ok = holds_file(name, &BIGSTR[i], 50);
+        if (ok && i % 2)
+        {
+            snprintf(name, sizeof(name), "n%d", i);
+            ok = holds_file(name, NULL, 0);
+        }
+    }
+    return ok;
+}
+
+#define FD_FILES 32
+
+// descriptors of closed files are refused, and reopening the files hands
+// out descriptors that don't clash with the ones still open
+static int check_fds(void)
+{
+    fileDescriptor fds[FD_FILES];
+    char name[16];
+    char byte;
+    int ok = 1;
+    int i, j;
+    for (i = 0; ok && i < FD_FILES; i++)
+    {
+        snprintf(name, sizeof(name), "f%d", i);
+        fds[i] = tfs_open(name);
+        ok = fds[i] >= 0 && tfs_write(fds[i], &BIGSTR[i], 50) >= 0;
+    }
+    for (i = 0; ok && i < FD_FILES; i += 2)
+        ok = tfs_close(fds[i]) >= 0 && tfs_readByte(fds[i], &byte) < 0;
+    for (i = 0; ok && i < FD_FILES; i += 2)
+    {
+        snprintf(name, sizeof(name), "f%d", i);
+        fds[i] = tfs_open(name);
+        for (j = 1; ok && j < FD_FILES; j += 2)
+            ok = fds[i] >= 0 && fds[i] != fds[j];
+    }
+    for (i = 0; ok && i < FD_FILES; i++)
+        ok = holds(fds[i], &BIGSTR[i], 50);
+    return ok;
+}
+
+#define SPREAD_BYTES 2048
+
+// fill buf with size letters, no two blocks alike for a given seed
+static void fill(char *buf, int size, int seed)
+{
+    int i;
+    for (i = 0; i < size; i++)
+        buf[i] = 'a' + (i + i / 26 + seed) % 26;
+}
+
+// a file written into free space broken up by other files keeps its data
+// across the gaps, and so do the files around it, after a remount
+static int check_extents(void)
+{
+    char data[SPREAD_BYTES];
+    char name[16];
+    fileDescriptor fds[8];
+    int ok = 1;
+    int i;
+    for (i = 0; ok && i < 8; i++)
+    {
+        snprintf(name, sizeof(name), "e%d", i);
+        fds[i] = tfs_open(name);
+        ok = fds[i] >= 0 && tfs_write(fds[i], BIGSTR, 256) >= 0;
+    }
+    for (i = 0; ok && i < 8; i += 2)
+        ok = tfs_delete(fds[i]) >= 0;
+    fill(data, SPREAD_BYTES, 0);
+    fileDescriptor fd = tfs_open("spread");
+    ok = ok && fd >= 0 && tfs_write(fd, data, SPREAD_BYTES) >= 0 && tfs_close(fd) >= 0 && \
+        tfs_unmount() >= 0 && tfs_mount(CHECK_DISK) >= 0 && \
+        holds_file("spread", data, SPREAD_BYTES);
+    for (i = 1; ok && i < 8; i += 2)
+    {
+        snprintf(name, sizeof(name), "e%d", i);
+        ok = holds_file(name, BIGSTR, 256);
+    }
+    return ok;
+}
+
+// tfs_pwrite in the middle of a file replaces only those bytes and leaves
+// the file pointer where it was
+static int check_pwrite_inside(void)
+{
+    char expect[256];
+    char byte;
+    memcpy(expect, BIGSTR, 256);
+    memcpy(&expect[100], SMALLSTR, 50);
+    fileDescriptor fd = tfs_open("pwrite");
+    return fd >= 0 && tfs_write(fd, BIGSTR, 256) >= 0 && tfs_readByte(fd, &byte) >= 0 && \
+        tfs_pwrite(fd, SMALLSTR, 50, 100) >= 0 && tfs_readByte(fd, &byte) >= 0 && \
+        byte == BIGSTR[1] && holds(fd, expect, 256);
+}
+
+// tfs_pwrite doesn't leave holes, past the end of a file it is refused and
+// the file is left as it was, at the end it extends the file
+static int check_pwrite_end(void)
+{
+    char expect[306];
+    memcpy(expect, BIGSTR, 256);
+    memcpy(&expect[256], SMALLSTR, 50);
+    fileDescriptor fd = tfs_open("pwrite");
+    return fd >= 0 && tfs_write(fd, BIGSTR, 256) >= 0 && \
+        tfs_pwrite(fd, SMALLSTR, 50, 257) == INVALID_OP && holds(fd, BIGSTR, 256) && \
+        tfs_pwrite(fd, SMALLSTR, 50, 256) >= 0 && holds(fd, expect, 306);
+}
+
+// tfs_append after a tfs_write adds to what it wrote, before and after a
+// remount
+static int check_append(void)
+{
+    char expect[306];
+    memcpy(expect, SMALLSTR, 50);
+    memcpy(&expect[50], BIGSTR, 256);
+    fileDescriptor fd = tfs_open("append");
+    return fd >= 0 && tfs_write(fd, SMALLSTR, 50) >= 0 && \
+        tfs_append(fd, BIGSTR, 256) >= 0 && holds(fd, expect, 306) && \
+        tfs_unmount() >= 0 && tfs_mount(CHECK_DISK) >= 0 && \
+        holds_file("append", expect, 306);
+}
+
+// once the disk is full, blocks freed near its start are found again by
+// the search, which goes on from where the last allocation left off
+static int check_free_search(void)
+{
+    char name[16];
+    fileDescriptor fd = tfs_open("first");
+    int ok = fd >= 0 && tfs_write(fd, BIGSTR, 256) >= 0;
+    int err = 0;
+    int i;
+    for (i = 0; ok && err >= 0 && i < 64; i++)
+    {
+        snprintf(name, sizeof(name), "w%d", i);
+        fileDescriptor full = tfs_open(name);
+        err = full < 0 ? full : tfs_write(full, BIGSTR, 256);
+    }
+    ok = ok && err == DISK_FULL && tfs_delete(fd) >= 0;
+    fd = tfs_open("again");
+    return ok && fd >= 0 && tfs_write(fd, SMALLSTR, 50) >= 0 && holds(fd, SMALLSTR, 50);
+}
+
+#define LARGE_FILE 65536
+
+// files fill a 4 MiB disk well past the old 508 KiB limit, and after a
+// remount the free map still knows which blocks are taken
+static int check_large_disk(void)
+{
+    char *data = (char *) malloc(LARGE_FILE);
+    char name[16];
+    int err = data == NULL ? MALLOC_ERR : 0;
+    int n_files = 0;
+    while (err >= 0 && n_files < 128)
+    {
+        snprintf(name, sizeof(name), "l%d", n_files);
+        fill(data, LARGE_FILE, n_files);
+        fileDescriptor fd = tfs_open(name);
+        err = fd < 0 ? fd : tfs_write(fd, data, LARGE_FILE);
+        if (err >= 0)
+            err = tfs_close(fd);
+        if (err >= 0)
+            n_files++;
+    }
+    int ok = err == DISK_FULL && n_files * LARGE_FILE > (3 << 20) && \
+        tfs_unmount() >= 0 && tfs_mount(CHECK_DISK) >= 0;
+
+    // the last file reads back, and the space of the first holds a new one
+    snprintf(name, sizeof(name), "l%d", n_files - 1);
+    if (ok)
+        fill(data, LARGE_FILE, n_files - 1);
+    ok = ok && holds_file(name, data, LARGE_FILE);
+    fileDescriptor fd = tfs_open("l0");
+    ok = ok && fd >= 0 && tfs_delete(fd) >= 0;
+    if (ok)
+        fill(data, LARGE_FILE, -1);
+    fd = tfs_open("again");
+    ok = ok && fd >= 0 && tfs_write(fd, data, LARGE_FILE) >= 0 && holds(fd, data, LARGE_FILE);
+    free(data);
+    return ok;
+}
+
+// file systems with bigger blocks keep a file spread over several of them
+// across a remount
+static int check_block_sizes(void)
+{
+    static const int sizes[3] = {512, 4096, 65536};
+    char *data = (char *) malloc(3 * 65536 + 100);
+    int ok = data != NULL;
+    int i;
+    for (i = 0; ok && i < 3; i++)
+    {
+        int size = 3 * sizes[i] + 100;
+        fill(data, size, i);
+        ok = tfs_mkfs_blocksize(CHECK_DISK, 64 * sizes[i], sizes[i]) >= 0 && \
+            tfs_mount(CHECK_DISK) >= 0;
+        fileDescriptor fd = tfs_open("blocks");
+        ok = ok && fd >= 0 && tfs_write(fd, data, size) >= 0 && tfs_unmount() >= 0 && \
+            tfs_mount(CHECK_DISK) >= 0 && holds_file("blocks", data, size);
+    }
+    free(data);
+    return ok;
+}
+
+// block sizes that aren't a power of two from MIN_BLOCKSIZE to
+// MAX_BLOCKSIZE are refused
+static int check_bad_block_sizes(void)
+{
+    return tfs_mkfs_blocksize(CHECK_DISK, 64 * 128, 128) < 0 && \
+        tfs_mkfs_blocksize(CHECK_DISK, 64 * 3000, 3000) < 0 && \
+        tfs_mkfs_blocksize(CHECK_DISK, 64 * 131072, 131072) < 0;
+}
+
+// in a child, write kept and sync, then write later and sync only if
+// sync_later, and exit without unmounting, so nothing written after the
+// last tfs_sync reaches the disk
+static void crash_after_sync(int sync_later)
+{
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        if (tfs_mkfs(CHECK_DISK, 1 << 20) < 0 || tfs_mount(CHECK_DISK) < 0)
+            _exit(1);
+        tfs_set_sync_interval(3600);
+        fileDescriptor fd = tfs_open("kept");
+        tfs_write(fd, SMALLSTR, 50);
+        tfs_close(fd);
+        tfs_sync();
+        fd = tfs_open("later");
+        tfs_write(fd, BIGSTR, 256);
+        tfs_close(fd);
+        if (sync_later)
+            tfs_sync();
+        _exit(0);
+    }
+    if (pid > 0)
+        waitpid(pid, NULL, 0);
+}
+
+// flip a byte of the checksum in the newest commit block of the journal,
+// as if the crash tore the commit block
+static int tear_last_commit(void)
+{
+    int disk = openDisk(CHECK_DISK, 0);
+    if (disk < 0)
+        return disk;
+    setCacheSize(disk, 0);
+    uint8_t block[BLOCKSIZE];
+    int n_blocks = get_disk_size(disk) / BLOCKSIZE;
+    int newest = -1;
+    uint32_t newest_seq = 0;
+    uint64_t magic;
+    uint32_t seq;
+    int i;
+    for (i = 0; i < n_blocks; i++)
+    {
+        if (readBlock(disk, i, block) < 0)
+            break;
+        memcpy(&magic, block + JC_MAGIC_INDEX, sizeof(magic));
+        memcpy(&seq, block + JC_SEQ_INDEX, sizeof(seq));
+        if (magic == JOURNAL_COMMIT_MAGIC && (newest < 0 || seq > newest_seq))
+        {
+            newest = i;
+            newest_seq = seq;
+        }
+    }
+    int err = newest < 0 ? READ_ERR : readBlock(disk, newest, block);
+    if (err >= 0)
+    {
+        block[JC_SUM_INDEX] ^= 0xFF;
+        err = writeBlock(disk, newest, block);
+    }
+    closeDisk(disk);
+    return err;
+}
+
+// crash after one or two syncs, tearing the last commit if asked, and
+// check the remount replays exactly the committed transactions
+static int check_journal(int sync_later, int tear)
+{
+    crash_after_sync(sync_later);
+    int ok = (!tear || tear_last_commit() >= 0) && tfs_mount(CHECK_DISK) >= 0 && \
+        holds_file("kept", SMALLSTR, 50);
+    if (sync_later && !tear)
+        ok = ok && holds_file("later", BIGSTR, 256);
+    else
+        ok = ok && holds_file("later", NULL, 0);
+    tfs_unmount();
+    remove(CHECK_DISK);
+    return ok;
+}
+
+// writeBlocks and readBlocks with the blocks out of order and one listed
+// twice, the later buffer winning, read back through the cache and then
+// through a second open of the image with no cache
+static int check_vectored(void)
+{
+    static const int writes[5] = {9, 3, 4, 12, 3};
+    static const int reads[5] = {12, 3, 9, 4, 3};
+    static const char expect[5] = {'d', 'e', 'a', 'c', 'e'};
+    uint8_t data[5][BLOCKSIZE];
+    uint8_t got[5][BLOCKSIZE];
+    void *data_list[5];
+    void *got_list[5];
+    int i;
+    for (i = 0; i < 5; i++)
+    {
+        memset(data[i], 'a' + i, BLOCKSIZE);
+        data_list[i] = data[i];
+        got_list[i] = got[i];
+    }
+
+    // block 4 is cached with other data first
+    int disk = openDisk(CHECK_DISK, 32 * BLOCKSIZE);
+    int ok = disk >= 0 && writeBlock(disk, 4, data[3]) >= 0 && \
+        writeBlocks(disk, 5, (int *) writes, data_list) >= 0 && \
+        readBlocks(disk, 5, (int *) reads, got_list) >= 0;
+    for (i = 0; ok && i < 5; i++)
+        ok = got[i][0] == expect[i] && got[i][BLOCKSIZE - 1] == expect[i];
+    closeDisk(disk);
+
+    disk = openDisk(CHECK_DISK, 0);
+    ok = ok && disk >= 0 && setCacheSize(disk, 0) >= 0 && \
+        readBlocks(disk, 5, (int *) reads, got_list) >= 0;
+    for (i = 0; ok && i < 5; i++)
+        ok = got[i][0] == expect[i] && got[i][BLOCKSIZE - 1] == expect[i];
+    closeDisk(disk);
+    remove(CHECK_DISK);
+    return ok;
+}
+
+#define THREAD_ROUNDS 2000
+
+// a file shared by the threads of the concurrency check
+typedef struct Thread_file
+{
+    fileDescriptor fd;
+    int bad;    // reads or writes that failed or saw a torn write
+} Thread_file;
+
+// rewrite the file with BIGSTR and the first 256 characters of VERYBIGSTR
+// in turn, ending with BIGSTR
+static void *writer_thread(void *arg)
+{
+    Thread_file *file = (Thread_file *) arg;
+    int i;
+    for (i = 0; i < THREAD_ROUNDS; i++)
+        if (tfs_write(file->fd, i % 2 ? BIGSTR : VERYBIGSTR, 256) < 0)
+            file->bad++;
+    return NULL;
+}
+
+// read the file back from the start, every read must see one whole write
+static void *reader_thread(void *arg)
+{
+    Thread_file *file = (Thread_file *) arg;
+    struct tm creation_time, access_time, modification_time;
+    char buf[256];
+    int i;
+    for (i = 0; i < THREAD_ROUNDS; i++)
+    {
+        if (tfs_seek(file->fd, 0) < 0 || tfs_read(file->fd, buf, 256) != 256 || \
+            tfs_stat(file->fd, &creation_time, &access_time, &modification_time) < 0)
+            file->bad++;
+        else if (memcmp(buf, BIGSTR, 256) && memcmp(buf, VERYBIGSTR, 256))
+            file->bad++;
+    }
+    return NULL;
+}
+
+// one writer and one reader on one file while another writer rewrites a
+// second file, then both files hold their last write after a remount
+static int check_threads(void)
+{
+    Thread_file first = {tfs_open("first"), 0};
+    Thread_file second = {tfs_open("second"), 0};
+    if (first.fd < 0 || second.fd < 0 || tfs_write(first.fd, BIGSTR, 256) < 0)
+        return 0;
+    pthread_t threads[3];
+    pthread_create(&threads[0], NULL, writer_thread, &first);
+    pthread_create(&threads[1], NULL, reader_thread, &first);
+    pthread_create(&threads[2], NULL, writer_thread, &second);
+    int i;
+    for (i = 0; i < 3; i++)
+        pthread_join(threads[i], NULL);
+    return first.bad == 0 && second.bad == 0 && tfs_unmount() >= 0 && \
+        tfs_mount(CHECK_DISK) >= 0 && holds_file("first", BIGSTR, 256) && \
+        holds_file("second", BIGSTR, 256);
+}
+
+// two disks mounted with tfsm_mount get a file of the same name, and each
+// only sees its own, also after both are remounted
+static int check_mount_isolation(void)
+{
+    char buf[256];
+    int ok = tfs_mkfs("MOUNT_DISK_A", DEFAULT_DISK_SIZE) >= 0 && \
+        tfs_mkfs("MOUNT_DISK_B", DEFAULT_DISK_SIZE) >= 0;
+    mountHandle a = tfsm_mount("MOUNT_DISK_A", DISK_MODE_FD);
+    mountHandle b = tfsm_mount("MOUNT_DISK_B", DISK_MODE_FD);
+    ok = ok && a >= 0 && b >= 0 && a != b && \
+        tfsm_write(a, tfsm_open(a, "same"), BIGSTR, 256) >= 0 && \
+        tfsm_write(a, tfsm_open(a, "only_a"), BIGSTR, 256) >= 0 && \
+        tfsm_write(b, tfsm_open(b, "same"), SMALLSTR, 50) >= 0 && \
+        tfsm_unmount(a) >= 0 && tfsm_unmount(b) >= 0;
+    a = tfsm_mount("MOUNT_DISK_A", DISK_MODE_FD);
+    b = tfsm_mount("MOUNT_DISK_B", DISK_MODE_FD);
+    ok = ok && a >= 0 && b >= 0;
+    fileDescriptor fd = ok ? tfsm_open(a, "same") : -1;
+    ok = ok && fd >= 0 && tfsm_read(a, fd, buf, 256) == 256 && \
+        memcmp(buf, BIGSTR, 256) == 0 && tfsm_readByte(a, fd, buf) < 0;
+    fd = ok ? tfsm_open(b, "same") : -1;
+    ok = ok && fd >= 0 && tfsm_read(b, fd, buf, 50) == 50 && \
+        memcmp(buf, SMALLSTR, 50) == 0 && tfsm_readByte(b, fd, buf) < 0;
+    fd = ok ? tfsm_open(b, "only_a") : -1;
+    ok = ok && fd >= 0 && tfsm_readByte(b, fd, buf) < 0;
+    tfsm_unmount(a);
+    tfsm_unmount(b);
+    remove("MOUNT_DISK_A");
+    remove("MOUNT_DISK_B");
+    return ok;
+}
+
+// handles past the mount table, and handles given back by tfsm_unmount,
+// are refused
+static int check_mount_handles(void)
+{
+    int ok = tfs_mkfs("MOUNT_DISK_A", DEFAULT_DISK_SIZE) >= 0;
+    mountHandle a = tfsm_mount("MOUNT_DISK_A", DISK_MODE_FD);
+    ok = ok && a >= 0 && tfsm_open(a, "same") >= 0 && tfsm_unmount(a) >= 0 && \
+        tfsm_open(MAX_MOUNTS, "same") < 0 && tfsm_unmount(MAX_MOUNTS) < 0 && \
+        tfsm_open(a, "same") < 0 && tfsm_unmount(a) < 0 && tfsm_sync(a) < 0;
+    remove("MOUNT_DISK_A");
+    return ok;
+}
+
+#define AHEAD_BYTES (40 * BLOCKSIZE + 100)
+
+// a file read front to back while read-ahead runs in front of the reads
+// comes back whole and ends where it should, with the file after it on
+// disk not showing through, and so does the rest of it after a seek
+static int check_read_ahead(void)
+{
+    char *data = (char *) malloc(AHEAD_BYTES);
+    char byte;
+    if (data == NULL)
+        return 0;
+    fill(data, AHEAD_BYTES, 0);
+    fileDescriptor fd = tfs_open("ahead");
+    fileDescriptor next = tfs_open("next");
+    int ok = fd >= 0 && next >= 0 && tfs_write(fd, data, AHEAD_BYTES) >= 0 && \
+        tfs_write(next, VERYBIGSTR, 512) >= 0 && tfs_unmount() >= 0 && \
+        tfs_mount(CHECK_DISK) >= 0 && holds_file("ahead", data, AHEAD_BYTES) && \
+        holds_file("next", VERYBIGSTR, 512);
+    int i;
+    fd = tfs_open("ahead");
+    ok = ok && tfs_seek(fd, 20 * BLOCKSIZE + 7) >= 0;
+    for (i = 20 * BLOCKSIZE + 7; ok && i < AHEAD_BYTES; i++)
+        ok = tfs_readByte(fd, &byte) >= 0 && byte == data[i];
+    free(data);
+    return ok && tfs_readByte(fd, &byte) < 0;
+}
+
+// tfs_readByte keeps the block under the file pointer, so writes through
+// the same descriptor must not leave it stale
+static int check_byte_buffer(void)
+{
+    char byte;
+    fileDescriptor fd = tfs_open("buffered");
+    int ok = fd >= 0 && tfs_write(fd, BIGSTR, 256) >= 0 && \
+        tfs_readByte(fd, &byte) >= 0 && byte == BIGSTR[0];
+
+    // the byte under the file pointer is rewritten
+    ok = ok && tfs_pwrite(fd, "#", 1, 1) >= 0 && tfs_readByte(fd, &byte) >= 0 && \
+        byte == '#' && tfs_readByte(fd, &byte) >= 0 && byte == BIGSTR[2];
+
+    // a new write starts the file pointer over on new data
+    return ok && tfs_write(fd, SMALLSTR, 50) >= 0 && tfs_readByte(fd, &byte) >= 0 && \
+        byte == SMALLSTR[0];
+}
+
+// writes BIGSTR then appends SMALLSTR, both delayed, and returns 1 if the
+// file reads back as both, 306 bytes, with tfs_readByte and tfs_read
+static int write_delayed(fileDescriptor fd)
+{
+    char expect[306];
+    char buf[306];
+    memcpy(expect, BIGSTR, 256);
+    memcpy(&expect[256], SMALLSTR, 50);
+    return fd >= 0 && tfs_write(fd, BIGSTR, 256) >= 0 && \
+        tfs_append(fd, SMALLSTR, 50) >= 0 && holds(fd, expect, 306) && \
+        tfs_seek(fd, 0) >= 0 && tfs_read(fd, buf, 306) == 306 && \
+        memcmp(buf, expect, 306) == 0 && tfs_seek(fd, 306) >= 0 && tfs_seek(fd, 307) < 0;
+}
+
+// delayed writes read back before the file is closed
+static int check_delayed_open(void)
+{
+    struct tm creation_time, access_time, modification_time;
+    fileDescriptor fd = tfs_open("delayed");
+    Tfs_stats before, after;
+    tfs_get_stats(&before);
+    int ok = write_delayed(fd) && \
+        tfs_stat(fd, &creation_time, &access_time, &modification_time) >= 0;
+    tfs_get_stats(&after);
+
+    // no blocks were given out for them yet
+    ok = ok && after.counters[STAT_BLOCK_ALLOCS] == before.counters[STAT_BLOCK_ALLOCS] && \
+        after.counters[STAT_RUN_BLOCKS] == before.counters[STAT_RUN_BLOCKS];
+    return ok;
+}
+
+// and after tfs_sync has written them
+static int check_delayed_sync(void)
+{
+    char expect[306];
+    memcpy(expect, BIGSTR, 256);
+    memcpy(&expect[256], SMALLSTR, 50);
+    fileDescriptor fd = tfs_open("delayed");
+    return write_delayed(fd) && tfs_sync() >= 0 && holds(fd, expect, 306);
+}
+
+// and after an unmount, with the file still open, and a remount
+static int check_delayed_remount(void)
+{
+    char expect[306];
+    memcpy(expect, BIGSTR, 256);
+    memcpy(&expect[256], SMALLSTR, 50);
+    return write_delayed(tfs_open("delayed")) && tfs_unmount() >= 0 && \
+        tfs_mount(CHECK_DISK) >= 0 && holds_file("delayed", expect, 306);
+}
+
+// blocks are reserved as writes are delayed, so a full disk fails the
+// append that doesn't fit, and what was appended before it is kept
+static int check_delayed_full(void)
+{
+    char buf[256];
+    fileDescriptor fd = tfs_open("full");
+    int err = fd;
+    int appended = 0;
+    while (err >= 0 && appended < 64)
+    {
+        err = tfs_append(fd, BIGSTR, 256);
+        if (err >= 0)
+            appended++;
+    }
+    int ok = err == DISK_FULL && appended > 0 && tfs_close(fd) >= 0 && \
+        tfs_unmount() >= 0 && tfs_mount(CHECK_DISK) >= 0;
+    fd = tfs_open("full");
+    int i;
+    for (i = 0; ok && i < appended; i++)
+        ok = tfs_read(fd, buf, 256) == 256 && memcmp(buf, BIGSTR, 256) == 0;
+    return ok && tfs_readByte(fd, buf) < 0;
+}
+
+// a tfs_pwrite in the last block of a file on disk moves that block to
+// memory, read-ahead in front of a sequential read must stop before it
+// and not bring back the old copy
+static int check_delayed_read_ahead(void)
+{
+    char data[8 * 256 + 256];
+    fill(data, 8 * 256, 0);
+    fileDescriptor fd = tfs_open("ahead");
+    int ok = fd >= 0 && tfs_write(fd, data, 8 * 256) >= 0 && tfs_close(fd) >= 0;
+    memcpy(&data[7 * 256 + 10], SMALLSTR, 50);
+    memcpy(&data[8 * 256], BIGSTR, 256);
+    fd = tfs_open("ahead");
+    return ok && fd >= 0 && tfs_pwrite(fd, SMALLSTR, 50, 7 * 256 + 10) >= 0 && \
+        tfs_append(fd, BIGSTR, 256) >= 0 && holds(fd, data, 9 * 256);
+}
+
+// FALLOC_KEEP takes the blocks without changing the size of the file
+static int check_falloc_keep(void)
+{
+    char byte;
+    fileDescriptor fd = tfs_open("falloc");
+    int free_open = tfs_free_blocks();
+    return fd >= 0 && tfs_fallocate(fd, 8 * BLOCKSIZE, FALLOC_KEEP) >= 0 && \
+        tfs_free_blocks() <= free_open - 8 && tfs_seek(fd, 1) < 0 && \
+        tfs_readByte(fd, &byte) < 0;
+}
+
+// writes fill the preallocated blocks without taking more, and FALLOC_KEEP
+// holds on to the rest past the close
+static int check_falloc_fill(void)
+{
+    fileDescriptor fd = tfs_open("falloc");
+    int ok = fd >= 0 && tfs_fallocate(fd, 8 * BLOCKSIZE, FALLOC_KEEP) >= 0;
+    int free_keep = tfs_free_blocks();
+    return ok && tfs_write(fd, VERYBIGSTR, 512) >= 0 && tfs_close(fd) >= 0 && \
+        tfs_free_blocks() == free_keep && holds_file("falloc", VERYBIGSTR, 512);
+}
+
+// shrinking the file and dropping FALLOC_KEEP frees the blocks past its
+// end at the close. free counts are taken after a sync, a journal keeps
+// freed blocks until then
+static int check_falloc_truncate(void)
+{
+    fileDescriptor fd = tfs_open("falloc");
+    int ok = fd >= 0 && tfs_fallocate(fd, 8 * BLOCKSIZE, FALLOC_KEEP) >= 0 && \
+        tfs_write(fd, VERYBIGSTR, 512) >= 0 && tfs_close(fd) >= 0;
+    int free_keep = tfs_free_blocks();
+    fd = tfs_open("falloc");
+    return ok && fd >= 0 && tfs_write(fd, SMALLSTR, 50) >= 0 && \
+        tfs_fallocate(fd, 0, 0) >= 0 && tfs_close(fd) >= 0 && tfs_sync() >= 0 && \
+        tfs_free_blocks() == free_keep + 7;
+}
+
+// without FALLOC_KEEP the size stays the same too, and the close frees the
+// blocks
+static int check_falloc_close(void)
+{
+    fileDescriptor fd = tfs_open("nokeep");
+    int free_open = tfs_free_blocks();
+    return fd >= 0 && tfs_fallocate(fd, 8 * BLOCKSIZE, 0) >= 0 && \
+        tfs_free_blocks() <= free_open - 8 && tfs_seek(fd, 1) < 0 && \
+        tfs_close(fd) >= 0 && tfs_sync() >= 0 && tfs_free_blocks() == free_open;
+}
+
+// deleting a file frees its preallocated blocks with the rest
+static int check_falloc_delete(void)
+{
+    int free_empty = tfs_free_blocks();
+    fileDescriptor fd = tfs_open("falloc");
+    return fd >= 0 && tfs_fallocate(fd, 8 * BLOCKSIZE, FALLOC_KEEP) >= 0 && \
+        tfs_write(fd, SMALLSTR, 50) >= 0 && tfs_delete(fd) >= 0 && tfs_sync() >= 0 && \
+        tfs_free_blocks() == free_empty;
+}
+
+#define POOL_FILES 300
+
+// files made, closed and deleted over and over, with a remount after each
+// round, keep their data while the pools hand the same objects out again
+static int check_pools(void)
+{
+    char name[16];
+    fileDescriptor fd;
+    int ok = 1;
+    int round, i;
+    for (round = 0; ok && round < 3; round++)
+    {
+        for (i = 0; ok && i < POOL_FILES; i++)
+        {
+            snprintf(name, sizeof(name), "p%d", i);
+            fd = tfs_open(name);
+            ok = fd >= 0 && tfs_write(fd, &BIGSTR[(i + round) % 200], 50) >= 0 && \
+                tfs_close(fd) >= 0;
+        }
+
+        // every other file is deleted, the next round makes it again
+        for (i = round % 2; ok && i < POOL_FILES; i += 2)
+        {
+            snprintf(name, sizeof(name), "p%d", i);
+            fd = tfs_open(name);
+            ok = fd >= 0 && tfs_delete(fd) >= 0;
+        }
+        ok = ok && tfs_unmount() >= 0 && tfs_mount(CHECK_DISK) >= 0;
+    }
+    for (i = 0; ok && i < POOL_FILES; i++)
+    {
+        snprintf(name, sizeof(name), "p%d", i);
+        if (i % 2)
+            ok = holds_file(name, &BIGSTR[(i + 2) % 200], 50);
+        else
+            ok = holds_file(name, NULL, 0);
+    }
+    return ok;
+}
+
+// returns the calls of an entry point that went in a histogram bucket
+static uint64_t timed_calls(Tfs_stats *stats, int call)
+{
+    uint64_t n = 0;
+    int i;
+    for (i = 0; i < STAT_BUCKETS; i++)
+        n += stats->latency[call][i];
+    return n;
+}
+
+// a known sequence of calls adds up in the counters and histograms. the
+// file is read cold front to back, so read-ahead brings in its blocks and
+// stops at its end, before the blocks of the next file
+static int check_stats(void)
+{
+    Tfs_stats stats;
+    char byte;
+    int i;
+    fileDescriptor fd = tfs_open("counted");
+    fileDescriptor next = tfs_open("next");
+    int ok = fd >= 0 && next >= 0 && tfs_write(fd, VERYBIGSTR, 512) >= 0 && \
+        tfs_write(next, VERYBIGSTR, 512) >= 0 && tfs_unmount() >= 0 && \
+        tfs_mount(CHECK_DISK) >= 0;
+    fd = tfs_open("counted");
+    tfs_reset_stats();
+    for (i = 0; ok && i < 512; i++)
+        ok = tfs_readByte(fd, &byte) >= 0;
+    ok = ok && tfs_readByte(fd, &byte) < 0 && tfs_seek(fd, 513) < 0;
+
+    // calls made with timing off are counted but not timed
+    tfs_set_stats_timing(0);
+    ok = ok && tfs_seek(fd, 0) >= 0;
+    tfs_set_stats_timing(1);
+    tfs_get_stats(&stats);
+    return ok && stats.calls[CALL_OPEN] == 0 && stats.calls[CALL_READBYTE] == 513 && \
+        stats.errors[CALL_READBYTE] == 1 && timed_calls(&stats, CALL_READBYTE) == 513 && \
+        stats.calls[CALL_SEEK] == 2 && stats.errors[CALL_SEEK] == 1 && \
+        timed_calls(&stats, CALL_SEEK) == 1 && \
+        stats.counters[STAT_BYTES_READ] == 2 * BLOCKSIZE;
+}
+
+// malloc calls left before one fails, -1 for none. the demo is linked with
+// -Wl,--wrap=malloc, so every malloc of the library comes through here
+static int malloc_countdown = -1;
+
+void *__real_malloc(size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+    if (malloc_countdown == 0)
+    {
+        malloc_countdown = -1;
+        return NULL;
+    }
+    if (malloc_countdown > 0)
+        malloc_countdown--;
+    return __real_malloc(size);
+}
+
+// fail each malloc of a tfs_open that makes a new file in turn. a failed
+// open leaves no directory entry or block behind, so the open that
+// finally succeeds makes the file from scratch
+static int check_open_rollback(void)
+{
+    struct tm creation_time, access_time, modification_time;
+    int free_empty = tfs_free_blocks();
+    fileDescriptor fd = -1;
+    int ok = 1;
+    int n;
+    for (n = 0; ok && fd < 0 && n < 100; n++)
+    {
+        malloc_countdown = n;
+        fd = tfs_open("rollback");
+        malloc_countdown = -1;
+        ok = fd >= 0 || tfs_free_blocks() == free_empty;
+    }
+    return ok && n > 1 && fd >= 0 && tfs_free_blocks() == free_empty - 1 && \
+        tfs_stat(fd, &creation_time, &access_time, &modification_time) >= 0 && \
+        creation_time.tm_year > 70 && tfs_write(fd, SMALLSTR, 50) >= 0 && \
+        tfs_unmount() >= 0 && tfs_mount(CHECK_DISK) >= 0 && \
+        holds_file("rollback", SMALLSTR, 50);
+}
+
 int main(int argc, char *argv[]){
 
     int fd1 = -1;
@@ -597,6 +1500,62 @@ int main(int argc, char *argv[]){
     // fd1 = tfs_open("file1");
 
 
+    // checks of the later features, each on a disk of its own
+    report("cache (write back on eviction, resize and close)", check_cache());
+    report("disk (size and block bounds)", check_geometry());
+    run_check("mmap (written mapped, read back with fd)", 64 * BLOCKSIZE, check_mmap);
+    run_check("names (lookups after renames, deletes and a remount)", 256 * BLOCKSIZE, \
+        check_names);
+    run_check("descriptors (closed ones refused, reused ones distinct)", \
+        128 * BLOCKSIZE, check_fds);
+    run_check("extents (file spread over gaps)", 64 * BLOCKSIZE, check_extents);
+    run_check("pwrite (inside the file)", DEFAULT_DISK_SIZE, check_pwrite_inside);
+    run_check("pwrite (past and at the end of the file)", DEFAULT_DISK_SIZE, \
+        check_pwrite_end);
+    run_check("append (after write)", DEFAULT_DISK_SIZE, check_append);
+    run_check("free map (search wraps around to freed blocks)", 64 * BLOCKSIZE, \
+        check_free_search);
+    run_check("large disk (files past 508 KiB, free map after remount)", 4 << 20, \
+        check_large_disk);
+    run_check("block size (512, 4096 and 65536)", DEFAULT_DISK_SIZE, check_block_sizes);
+    run_check("block size (128, 3000 and 131072 refused)", DEFAULT_DISK_SIZE, \
+        check_bad_block_sizes);
+    report("journal (committed data replays, uncommitted is absent)", check_journal(0, 0));
+    report("journal (second commit replays)", check_journal(1, 0));
+    report("journal (torn commit skipped)", check_journal(1, 1));
+    report("vectored (unsorted and repeated blocks)", check_vectored());
+    run_check("threads (writer and reader, contents after remount)", DEFAULT_DISK_SIZE, \
+        check_threads);
+    report("mounts (same name on two disks)", check_mount_isolation());
+    report("mounts (invalid handles)", check_mount_handles());
+    run_check("read ahead (sequential reads to the end of the file)", 128 * BLOCKSIZE, \
+        check_read_ahead);
+    run_check("readByte (block buffer after writes)", DEFAULT_DISK_SIZE, \
+        check_byte_buffer);
+    run_check("delayed (read before close)", DEFAULT_DISK_SIZE, check_delayed_open);
+    run_check("delayed (read after sync)", DEFAULT_DISK_SIZE, check_delayed_sync);
+    run_check("delayed (read after remount)", DEFAULT_DISK_SIZE, check_delayed_remount);
+    run_check("delayed (disk full)", 64 * BLOCKSIZE, check_delayed_full);
+    run_check("delayed (read ahead stops at delayed blocks)", 64 * BLOCKSIZE, \
+        check_delayed_read_ahead);
+    run_check("fallocate (keep reserves blocks, size unchanged)", DEFAULT_DISK_SIZE, \
+        check_falloc_keep);
+    run_check("fallocate (writes fill the preallocated blocks)", DEFAULT_DISK_SIZE, \
+        check_falloc_fill);
+    run_check("fallocate (truncate gives blocks back)", DEFAULT_DISK_SIZE, \
+        check_falloc_truncate);
+    run_check("fallocate (without keep, close gives blocks back)", DEFAULT_DISK_SIZE, \
+        check_falloc_close);
+    run_check("fallocate (delete gives blocks back)", DEFAULT_DISK_SIZE, \
+        check_falloc_delete);
+    run_check("pools (files made and deleted over remounts)", 2048 * BLOCKSIZE, \
+        check_pools);
+    run_check("stats (counters and histograms of known calls)", DEFAULT_DISK_SIZE, \
+        check_stats);
+    run_check("open (failed mallocs leave nothing behind)", DEFAULT_DISK_SIZE, \
+        check_open_rollback);
+
+
     // free all the stuff
     free(creation_time);
     free(access_time);
@@ -607,6 +1566,6 @@ int main(int argc, char *argv[]){
 }
 
 void print_error(int errorCode)  {
-    char* message = errorMessage[(-1 * errorCode) - 1];
+    const char *message = errorMessage[(-1 * errorCode) - 1];
     printf("\t%s\n", message);
 }
\ No newline at end of file
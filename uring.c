@@ -0,0 +1,195 @@
+#include "uring.h"
+
+#ifdef URING_SUPPORTED
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+// set up a ring with entries submission queue entries
+// returns NULL if io_uring is not available or setup fails
+Uring *create_uring(unsigned entries)
+{
+    Uring *ring = (Uring *) malloc(sizeof(Uring));
+    if (ring == NULL)
+        return NULL;
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = (int) syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0)
+    {
+        free(ring);
+        return NULL; // no io_uring in this kernel or not allowed
+    }
+
+    // map the submission ring, the completion ring and the entries
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    int single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single && cq_size > sq_size)
+        sq_size = cq_size;
+    void *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, \
+        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    void *cq = sq;
+    if (sq != MAP_FAILED && !single)
+        cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, \
+            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    size_t sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    void *sqes = MAP_FAILED;
+    if (sq != MAP_FAILED && cq != MAP_FAILED)
+        sqes = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, \
+            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED)
+    {
+        if (cq != MAP_FAILED && cq != sq)
+            munmap(cq, cq_size);
+        if (sq != MAP_FAILED)
+            munmap(sq, sq_size);
+        close(fd);
+        free(ring);
+        return NULL; // mmap error
+    }
+
+    uint8_t *sq_ptr = (uint8_t *) sq;
+    uint8_t *cq_ptr = (uint8_t *) cq;
+    ring->fd = fd;
+    ring->entries = params.sq_entries;
+    ring->queued = 0;
+    ring->sq_head = (unsigned *) (sq_ptr + params.sq_off.head);
+    ring->sq_tail = (unsigned *) (sq_ptr + params.sq_off.tail);
+    ring->sq_mask = (unsigned *) (sq_ptr + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (sq_ptr + params.sq_off.array);
+    ring->sqes = sqes;
+    ring->cq_head = (unsigned *) (cq_ptr + params.cq_off.head);
+    ring->cq_tail = (unsigned *) (cq_ptr + params.cq_off.tail);
+    ring->cq_mask = (unsigned *) (cq_ptr + params.cq_off.ring_mask);
+    ring->cqes = cq_ptr + params.cq_off.cqes;
+    ring->sq_map = sq;
+    ring->sq_map_size = sq_size;
+    ring->cq_map = cq;
+    ring->cq_map_size = cq_size;
+    ring->sqes_size = sqes_size;
+    return ring;
+}
+
+void free_uring(Uring *ring)
+{
+    if (ring == NULL)
+        return;
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_map != ring->sq_map)
+        munmap(ring->cq_map, ring->cq_map_size);
+    munmap(ring->sq_map, ring->sq_map_size);
+    close(ring->fd);
+    free(ring);
+}
+
+// number of entries that can be filled in before the next submit
+int uring_space(Uring *ring)
+{
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    return (int) (ring->entries - (*ring->sq_tail - head));
+}
+
+// fill in a readv or writev of n_iov buffers at offset of fd, iov must stay
+// valid until the request completes
+// returns 0 if successful, -1 if the submission queue is full
+int uring_prep(Uring *ring, int write, int fd, struct iovec *iov, int n_iov, \
+    off_t offset, uint64_t user_data)
+{
+    if (uring_space(ring) <= 0)
+        return -1; // submission queue full
+
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &((struct io_uring_sqe *) ring->sqes)[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t) (uintptr_t) iov;
+    sqe->len = n_iov;
+    sqe->off = (uint64_t) offset;
+    sqe->user_data = user_data;
+    ring->sq_array[index] = index;
+
+    // publish the entry to the kernel
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->queued += 1;
+    return 0;
+}
+
+// submit every queued entry and wait until at least wait_nr requests have
+// completed
+// returns 0 if successful, -1 on error. entries the kernel didn't take stay
+// queued and are submitted by the next call
+int uring_submit(Uring *ring, unsigned wait_nr)
+{
+    while (ring->queued > 0 || wait_nr > 0)
+    {
+        unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+        int n = (int) syscall(__NR_io_uring_enter, ring->fd, ring->queued, \
+            wait_nr, flags, NULL, 0);
+        if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EBUSY))
+            continue;
+        if (n < 0)
+            return -1; // enter error
+        ring->queued -= n;
+        if (ring->queued == 0)
+            break;
+        if (n == 0)
+            return -1; // the kernel took none of the queued entries
+    }
+    return 0;
+}
+
+// take one completion off the completion ring
+// returns 1 and fills user_data and res if there was one, 0 if not
+int uring_reap(Uring *ring, uint64_t *user_data, int *res)
+{
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    if (head == tail)
+        return 0; // nothing completed
+
+    struct io_uring_cqe *cqe = \
+        &((struct io_uring_cqe *) ring->cqes)[head & *ring->cq_mask];
+    *user_data = cqe->user_data;
+    *res = cqe->res;
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+#else
+
+// built without io_uring, every disk uses the synchronous path
+
+Uring *create_uring(unsigned entries)
+{
+    return NULL;
+}
+
+void free_uring(Uring *ring)
+{
+}
+
+int uring_space(Uring *ring)
+{
+    return 0;
+}
+
+int uring_prep(Uring *ring, int write, int fd, struct iovec *iov, int n_iov, \
+    off_t offset, uint64_t user_data)
+{
+    return -1;
+}
+
+int uring_submit(Uring *ring, unsigned wait_nr)
+{
+    return -1;
+}
+
+int uring_reap(Uring *ring, uint64_t *user_data, int *res)
+{
+    return 0;
+}
+
+#endif
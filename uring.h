@@ -0,0 +1,53 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+
+// io_uring needs the kernel header at build time and a kernel that allows
+// io_uring_setup at run time, create_uring returns NULL without either
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define URING_SUPPORTED 1
+#endif
+#endif
+
+// one io_uring instance driven with the raw system calls. the submission
+// and completion rings are shared with the kernel, head and tail indexes
+// are read and written with acquire and release ordering
+typedef struct Uring
+{
+    int fd;
+    unsigned entries;       // submission queue size, a power of two
+    unsigned queued;        // entries filled in but not yet submitted
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    void *sqes;             // struct io_uring_sqe[entries]
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    void *cqes;             // struct io_uring_cqe[]
+    void *sq_map;
+    size_t sq_map_size;
+    void *cq_map;           // same as sq_map if the kernel maps both at once
+    size_t cq_map_size;
+    size_t sqes_size;
+} Uring;
+
+Uring *create_uring(unsigned entries);
+
+void free_uring(Uring *ring);
+
+int uring_space(Uring *ring);
+
+int uring_prep(Uring *ring, int write, int fd, struct iovec *iov, int n_iov, \
+    off_t offset, uint64_t user_data);
+
+int uring_submit(Uring *ring, unsigned wait_nr);
+
+int uring_reap(Uring *ring, uint64_t *user_data, int *res);
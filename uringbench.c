@@ -0,0 +1,234 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libDisk.h"
+
+// block I/O microbenchmark: reads and writes every block of a scratch disk
+// in a random order with readBlock and writeBlock, then with submitRead and
+// submitWrite on an io_uring disk at several queue depths, then with
+// readBlocks and writeBlocks on both backends. the block cache is turned
+// off so every request reaches the backing file. prints MB/s for each
+//
+// usage: uringbench [file] [blocks] [rounds]
+
+#define BATCH_BLOCKS 256
+
+static const int depths[] = {1, 4, 16, 64, 256};
+#define N_DEPTHS ((int) (sizeof(depths) / sizeof(depths[0])))
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// one block at a time with readBlock or writeBlock
+static int run_single(int disk, int *order, int n, uint8_t *buffers, int write)
+{
+    int i;
+    for (i = 0; i < n; i++)
+    {
+        int err = write ? writeBlock(disk, order[i], buffers) : \
+            readBlock(disk, order[i], buffers);
+        if (err < 0)
+            return err;
+    }
+    return 0;
+}
+
+// depth requests in flight with submitRead or submitWrite, every finished
+// request is replaced by the next one. a request uses the buffer of its
+// slot, which is passed as the tag
+static int run_queued(int disk, int *order, int n, uint8_t *buffers, int depth, \
+    int write)
+{
+    Block_completion done[MAX_QUEUE_DEPTH];
+    int block_size = get_block_size(disk);
+    int next = 0;
+    int in_flight = 0;
+    while (next < n && in_flight < depth)
+    {
+        void *tag = (void *) (intptr_t) in_flight;
+        uint8_t *block = &buffers[(size_t) in_flight * block_size];
+        int err = write ? submitWrite(disk, order[next], block, tag) : \
+            submitRead(disk, order[next], block, tag);
+        if (err < 0)
+            return err;
+        next++;
+        in_flight++;
+    }
+    while (in_flight > 0)
+    {
+        int n_done = completeBlocks(disk, 1, done, depth);
+        if (n_done < 0)
+            return n_done;
+        int i;
+        for (i = 0; i < n_done; i++)
+        {
+            in_flight--;
+            if (done[i].result < 0)
+                return done[i].result;
+            if (next == n)
+                continue;
+            int slot = (int) (intptr_t) done[i].tag;
+            uint8_t *block = &buffers[(size_t) slot * block_size];
+            int err = write ? submitWrite(disk, order[next], block, done[i].tag) : \
+                submitRead(disk, order[next], block, done[i].tag);
+            if (err < 0)
+                return err;
+            next++;
+            in_flight++;
+        }
+    }
+    return 0;
+}
+
+// BATCH_BLOCKS blocks per call with readBlocks or writeBlocks
+static int run_batched(int disk, int *order, int n, uint8_t *buffers, int write)
+{
+    void *blocks[BATCH_BLOCKS];
+    int block_size = get_block_size(disk);
+    int i;
+    for (i = 0; i < BATCH_BLOCKS; i++)
+        blocks[i] = &buffers[(size_t) i * block_size];
+    for (i = 0; i < n; i += BATCH_BLOCKS)
+    {
+        int count = n - i < BATCH_BLOCKS ? n - i : BATCH_BLOCKS;
+        int err = write ? writeBlocks(disk, count, &order[i], blocks) : \
+            readBlocks(disk, count, &order[i], blocks);
+        if (err < 0)
+            return err;
+    }
+    return 0;
+}
+
+// open the scratch disk with the cache off, returns the disk or an error
+static int open_bench_disk(char *file, int mode)
+{
+    int disk = openDiskMode(file, 0, mode);
+    if (disk < 0)
+        return disk;
+    int err = setCacheSize(disk, 0);
+    if (err < 0)
+    {
+        closeDisk(disk);
+        return err;
+    }
+    return disk;
+}
+
+// time rounds passes of one access method and print MB/s. depth 0 is
+// readBlock or writeBlock, -1 readBlocks or writeBlocks
+static int bench(char *file, char *name, int mode, int depth, int *order, int n, \
+    int rounds, uint8_t *buffers)
+{
+    printf("%-24s", name);
+    int write;
+    for (write = 0; write < 2; write++)
+    {
+        int disk = open_bench_disk(file, mode);
+        if (disk < 0)
+            return disk;
+        if (depth > 0 && setQueueDepth(disk, depth) < 0)
+        {
+            closeDisk(disk);
+            return INVALID_OP;
+        }
+        double start = now();
+        int r;
+        int err = 0;
+        for (r = 0; r < rounds && err == 0; r++)
+        {
+            if (depth > 0)
+                err = run_queued(disk, order, n, buffers, depth, write);
+            else if (depth == 0)
+                err = run_single(disk, order, n, buffers, write);
+            else
+                err = run_batched(disk, order, n, buffers, write);
+        }
+        double seconds = now() - start;
+        closeDisk(disk);
+        if (err < 0)
+            return err;
+        printf(" %10.1f", (double) n * rounds * BLOCKSIZE / seconds / 1e6);
+    }
+    printf("\n");
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    char *file = argc > 1 ? argv[1] : "uringbench.disk";
+    int n_blocks = argc > 2 ? atoi(argv[2]) : 16384;
+    int rounds = argc > 3 ? atoi(argv[3]) : 3;
+    if (n_blocks < 3 || rounds <= 0)
+    {
+        fprintf(stderr, "usage: %s [file] [blocks] [rounds]\n", argv[0]);
+        return 1;
+    }
+
+    // create the scratch disk and a random order of its blocks
+    int disk = openDisk(file, (int64_t) n_blocks * BLOCKSIZE);
+    if (disk < 0)
+    {
+        fprintf(stderr, "cannot create %s\n", file);
+        return 1;
+    }
+    closeDisk(disk);
+    disk = openDiskMode(file, 0, DISK_MODE_URING);
+    int uring = disk >= 0 && get_disk_mode(disk) == DISK_MODE_URING;
+    if (disk >= 0)
+        closeDisk(disk);
+
+    int n_buffers = depths[N_DEPTHS - 1] > BATCH_BLOCKS ? depths[N_DEPTHS - 1] : BATCH_BLOCKS;
+    int *order = (int *) malloc(n_blocks * sizeof(int));
+    uint8_t *buffers = (uint8_t *) calloc(n_buffers, BLOCKSIZE);
+    if (order == NULL || buffers == NULL)
+    {
+        free(order);
+        free(buffers);
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    int i;
+    for (i = 0; i < n_blocks; i++)
+        order[i] = i;
+    srand(1);
+    for (i = n_blocks - 1; i > 0; i--)
+    {
+        int j = rand() % (i + 1);
+        int tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+
+    printf("%d blocks, %d rounds, random order, MB/s%s\n", n_blocks, rounds, \
+        uring ? "" : ", io_uring not available so queued requests are synchronous");
+    printf("%-24s %10s %10s\n", "method", "read", "write");
+    int err = bench(file, "readBlock/writeBlock", DISK_MODE_FD, 0, order, n_blocks, \
+        rounds, buffers);
+    for (i = 0; i < N_DEPTHS && err == 0; i++)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "submit depth %d", depths[i]);
+        err = bench(file, name, DISK_MODE_URING, depths[i], order, n_blocks, rounds, buffers);
+    }
+    if (err == 0)
+        err = bench(file, "readBlocks fd", DISK_MODE_FD, -1, order, n_blocks, rounds, buffers);
+    if (err == 0)
+        err = bench(file, "readBlocks io_uring", DISK_MODE_URING, -1, order, n_blocks, \
+            rounds, buffers);
+
+    free(order);
+    free(buffers);
+    remove(file);
+    if (err < 0)
+    {
+        fprintf(stderr, "\nI/O error %d\n", err);
+        return 1;
+    }
+    return 0;
+}